@@ -0,0 +1,261 @@
+﻿#include "async.h"
+#include <algorithm>
+
+#ifdef _WIN32
+#include <Windows.h>
+#else
+#include <pthread.h>
+#endif
+
+namespace Font {
+
+GlyphRequestQueue::GlyphRequestQueue() {}
+
+GlyphRequestQueue::~GlyphRequestQueue() {
+    StopWorkers();
+    std::vector<Notification> notifications;
+    {
+        std::unique_lock<std::mutex> lock(mutex_);
+        for (auto& job : queue_) {
+            Finish(job, GlyphRequestState::Cancelled, notifications);
+        }
+        queue_.clear();
+    }
+    Notify(notifications);
+}
+
+GlyphRequest* GlyphRequestQueue::Submit(FontInfo* font, uint32_t char_code, float origin_x, GlyphRequestCallback callback, void* user_data) {
+    GlyphRequest* request = new GlyphRequest;
+    request->font = font;
+    request->callback = callback;
+    request->user_data = user_data;
+    const FontGlyphKey key = MakeFontGlyphKey(*font, char_code, origin_x, &request->origin_carry);
+    std::unique_lock<std::mutex> lock(mutex_);
+    if (workers_.empty()) {
+        StartWorkers();
+    }
+    auto iter = in_flight_.find(key);
+    if (iter != in_flight_.end()) {
+        request->job = iter->second;
+    } else {
+        request->job = std::make_shared<GlyphJob>();
+        request->job->key = key;
+        request->job->font = *font;
+        in_flight_.emplace(key, request->job);
+        queue_.push_back(request->job);
+        work_ready_.notify_one();
+    }
+    request->job->requests.push_back(request);
+    return request;
+}
+
+GlyphRequestState GlyphRequestQueue::Poll(GlyphRequest* request, LinkedList<GlyphBitmapInfo>* glyphs) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    GlyphRequestState state = State(request);
+    if (state == GlyphRequestState::Ready && glyphs) {
+        *glyphs = Glyphs(request);
+    }
+    return state;
+}
+
+LinkedList<GlyphBitmapInfo> GlyphRequestQueue::Wait(GlyphRequest* request) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    job_done_.wait(lock, [this, request] { return State(request) != GlyphRequestState::Pending; });
+    return Glyphs(request);
+}
+
+LinkedList<GlyphBitmapInfo> GlyphRequestQueue::Glyphs(const GlyphRequest* request) const {
+    if (State(request) != GlyphRequestState::Ready) {
+        return {};
+    }
+    LinkedList<GlyphBitmapInfo> glyphs = request->job->glyphs;
+    for (size_t i = 0; i < glyphs.size(); i++) {
+        glyphs[i].bearing_x += request->origin_carry;
+    }
+    return glyphs;
+}
+
+void GlyphRequestQueue::Release(GlyphRequest* request) {
+    std::lock_guard<std::recursive_mutex> callback_lock(callback_mutex_);
+    {
+        std::unique_lock<std::mutex> lock(mutex_);
+        auto& requests = request->job->requests;
+        requests.erase(std::remove(requests.begin(), requests.end(), request), requests.end());
+    }
+    delete request;
+}
+
+void GlyphRequestQueue::Cancel(const FontInfo* font) {
+    std::vector<Notification> notifications;
+    {
+        std::unique_lock<std::mutex> lock(mutex_);
+        // Jobs shared with other fonts go on, those no live request is left on are dropped.
+        std::vector<std::shared_ptr<GlyphJob>> abandoned;
+        for (auto& entry : in_flight_) {
+            const std::shared_ptr<GlyphJob>& job = entry.second;
+            bool cancelled = false;
+            for (auto request : job->requests) {
+                if (request->font == font && !request->cancelled) {
+                    request->cancelled = true;
+                    cancelled = true;
+                    if (request->callback) {
+                        notifications.push_back({request, job, GlyphRequestState::Cancelled});
+                    }
+                }
+            }
+            if (cancelled && std::all_of(job->requests.begin(), job->requests.end(), [](const GlyphRequest* request) { return request->cancelled; })) {
+                abandoned.push_back(job);
+            }
+        }
+        // Running jobs cannot be interrupted, settle them now and let the worker drop its glyphs.
+        for (auto& job : abandoned) {
+            Finish(job, GlyphRequestState::Cancelled, notifications);
+            queue_.erase(std::remove(queue_.begin(), queue_.end(), job), queue_.end());
+        }
+        job_done_.notify_all();
+    }
+    Notify(notifications);
+}
+
+void GlyphRequestQueue::SetWorkers(uint32_t count, uint64_t affinity_mask) {
+    // Swap the worker set in one locked step so a concurrent Submit never sees it half stopped.
+    std::vector<std::thread> retired;
+    {
+        std::unique_lock<std::mutex> lock(mutex_);
+        retired = RetireWorkers();
+        worker_count_ = count;
+        affinity_mask_ = affinity_mask;
+        if (!queue_.empty()) {
+            StartWorkers();
+        }
+    }
+    for (auto& worker : retired) {
+        worker.join();
+    }
+}
+
+void GlyphRequestQueue::StartWorkers() {
+    if (!workers_.empty()) {
+        return;
+    }
+    uint32_t count = worker_count_;
+    if (count == 0) {
+        const uint32_t hardware = std::thread::hardware_concurrency();
+        count = hardware > 1 ? hardware - 1 : 1;
+    }
+    for (uint32_t i = 0; i < count; i++) {
+        workers_.emplace_back(&GlyphRequestQueue::WorkerLoop, this, generation_);
+        if (affinity_mask_) {
+#ifdef _WIN32
+            SetThreadAffinityMask(workers_.back().native_handle(), static_cast<DWORD_PTR>(affinity_mask_));
+#else
+            cpu_set_t cpus;
+            CPU_ZERO(&cpus);
+            for (int cpu = 0; cpu < 64; cpu++) {
+                if (affinity_mask_ & (uint64_t(1) << cpu)) {
+                    CPU_SET(cpu, &cpus);
+                }
+            }
+            pthread_setaffinity_np(workers_.back().native_handle(), sizeof(cpus), &cpus);
+#endif
+        }
+    }
+}
+
+std::vector<std::thread> GlyphRequestQueue::RetireWorkers() {
+    std::vector<std::thread> retired;
+    retired.swap(workers_);
+    generation_++;
+    work_ready_.notify_all();
+    return retired;
+}
+
+void GlyphRequestQueue::StopWorkers() {
+    std::vector<std::thread> retired;
+    {
+        std::unique_lock<std::mutex> lock(mutex_);
+        retired = RetireWorkers();
+    }
+    for (auto& worker : retired) {
+        worker.join();
+    }
+}
+
+void GlyphRequestQueue::WorkerLoop(uint64_t generation) {
+    PrivateGlyphRenderer renderer;
+    std::unique_lock<std::mutex> lock(mutex_);
+    while (true) {
+        work_ready_.wait(lock, [this, generation] { return generation != generation_ || !queue_.empty(); });
+        if (generation != generation_) {
+            return;
+        }
+        std::shared_ptr<GlyphJob> job = queue_.front();
+        queue_.pop_front();
+        lock.unlock();
+        LinkedList<GlyphBitmapInfo> glyphs = GetFreetypeFontInstance().GetGlyphBitmap(job->font, job->key.char_code, static_cast<float>(job->key.phase) / job->key.phases, renderer);
+        if (glyphs.empty()) {
+            // Same fallback as GetGlyphBitmapInfo.
+            FontInfo system_font = job->font;
+            system_font.size = -system_font.size;
+            glyphs = GetGlyphBitmapInfoSystem(&system_font, job->key.char_code, true, true);
+        }
+        std::vector<Notification> notifications;
+        lock.lock();
+        if (job->state == GlyphRequestState::Pending) {
+            job->glyphs = glyphs;
+            Finish(job, GlyphRequestState::Ready, notifications);
+        }
+        if (!notifications.empty()) {
+            lock.unlock();
+            Notify(notifications);
+            lock.lock();
+        }
+    }
+}
+
+void GlyphRequestQueue::Finish(const std::shared_ptr<GlyphJob>& job, GlyphRequestState state, std::vector<Notification>& notifications) {
+    if (job->state != GlyphRequestState::Pending) {
+        return;
+    }
+    job->state = state;
+    auto iter = in_flight_.find(job->key);
+    if (iter != in_flight_.end() && iter->second == job) {
+        in_flight_.erase(iter);
+    }
+    for (auto request : job->requests) {
+        if (request->callback && !request->cancelled) {
+            notifications.push_back({request, job, state});
+        }
+    }
+    job_done_.notify_all();
+}
+
+void GlyphRequestQueue::Notify(const std::vector<Notification>& notifications) {
+    std::lock_guard<std::recursive_mutex> callback_lock(callback_mutex_);
+    for (auto& notification : notifications) {
+        GlyphRequestCallback callback = nullptr;
+        void* user_data = nullptr;
+        LinkedList<GlyphBitmapInfo> glyphs;
+        {
+            // Skip requests released, or cancelled on their own, since the job settled.
+            std::unique_lock<std::mutex> lock(mutex_);
+            auto& requests = notification.job->requests;
+            if (std::find(requests.begin(), requests.end(), notification.request) != requests.end() && State(notification.request) == notification.state) {
+                callback = notification.request->callback;
+                user_data = notification.request->user_data;
+                glyphs = Glyphs(notification.request);
+            }
+        }
+        if (callback) {
+            callback(user_data, notification.state, glyphs);
+        }
+    }
+}
+
+GlyphRequestQueue& GetGlyphRequestQueue() {
+    // Constructed on first use, so it is destroyed before the FreeType instance its workers render with.
+    static GlyphRequestQueue queue;
+    return queue;
+}
+
+}  // namespace Font
@@ -0,0 +1,89 @@
+﻿#pragma once
+
+#include "font.h"
+#include "freetype.h"
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+namespace Font {
+
+// Requests for the same glyph, font settings and snapped subpixel phase share one job while it
+// is queued or running, whichever FontInfo they come from. The job renders at the phase alone.
+struct GlyphJob {
+    FontGlyphKey key;
+    // Copied on submit so workers never read a FontInfo the caller may destroy.
+    FontInfo font;
+    GlyphRequestState state = GlyphRequestState::Pending;
+    LinkedList<GlyphBitmapInfo> glyphs;
+    std::vector<GlyphRequest*> requests;
+};
+
+class GlyphRequest {
+public:
+    std::shared_ptr<GlyphJob> job;
+    // Only compared against, to cancel the request when its FontInfo is destroyed.
+    const FontInfo* font = nullptr;
+    // Whole pixels snapping carried the origin over, added to the job's glyphs.
+    int origin_carry = 0;
+    // Set when the request is cancelled on its own while the job goes on for others.
+    bool cancelled = false;
+    GlyphRequestCallback callback = nullptr;
+    void* user_data = nullptr;
+};
+
+// Worker threads rasterizing glyphs as GetGlyphBitmapInfo does off the caller's thread, each on
+// private FreeType faces so they render in parallel.
+// Workers start on the first request, callbacks run on the worker that finished the job.
+class GlyphRequestQueue {
+public:
+    GlyphRequestQueue();
+    ~GlyphRequestQueue();
+    GlyphRequest* Submit(FontInfo* font, uint32_t char_code, float origin_x, GlyphRequestCallback callback, void* user_data);
+    GlyphRequestState Poll(GlyphRequest* request, LinkedList<GlyphBitmapInfo>* glyphs);
+    LinkedList<GlyphBitmapInfo> Wait(GlyphRequest* request);
+    void Release(GlyphRequest* request);
+    // Cancel the requests made with `font`. Jobs left without other requests are dropped if queued,
+    // running ones finish but their glyphs are dropped.
+    void Cancel(const FontInfo* font);
+    // Restart the workers with a new count (0 picks one less than the hardware threads) and affinity mask (0 leaves it to the OS).
+    void SetWorkers(uint32_t count, uint64_t affinity_mask);
+
+private:
+    struct Notification {
+        GlyphRequest* request;
+        std::shared_ptr<GlyphJob> job;
+        GlyphRequestState state;
+    };
+    // Both run under mutex_: start a fresh generation when none is running, or retire the running one for joining.
+    void StartWorkers();
+    std::vector<std::thread> RetireWorkers();
+    void StopWorkers();
+    void WorkerLoop(uint64_t generation);
+    // Settle a job and collect the callbacks to run once the lock is dropped.
+    void Finish(const std::shared_ptr<GlyphJob>& job, GlyphRequestState state, std::vector<Notification>& notifications);
+    void Notify(const std::vector<Notification>& notifications);
+    GlyphRequestState State(const GlyphRequest* request) const { return request->cancelled ? GlyphRequestState::Cancelled : request->job->state; }
+    // The job's glyphs moved by the request's origin carry, empty unless the request is Ready.
+    LinkedList<GlyphBitmapInfo> Glyphs(const GlyphRequest* request) const;
+
+    std::mutex mutex_;
+    // Held while callbacks run so releasing a request waits for its callback, recursive so callbacks may release.
+    std::recursive_mutex callback_mutex_;
+    std::condition_variable work_ready_;
+    std::condition_variable job_done_;
+    std::deque<std::shared_ptr<GlyphJob>> queue_;
+    std::unordered_map<FontGlyphKey, std::shared_ptr<GlyphJob>, FontGlyphKeyHash> in_flight_;
+    std::vector<std::thread> workers_;
+    uint32_t worker_count_ = 0;
+    uint64_t affinity_mask_ = 0;
+    // Bumped whenever the worker set is retired, workers of an older generation exit.
+    uint64_t generation_ = 0;
+};
+
+GlyphRequestQueue& GetGlyphRequestQueue();
+}  // namespace Font
@@ -0,0 +1,485 @@
+﻿#include "atlas.h"
+#include "bitmap.h"
+#include "freetype.h"
+#include <algorithm>
+#include <chrono>
+
+namespace Font {
+
+// Transparent pixels kept right of and below every glyph so filtering does not pick up a neighbour.
+static const uint32_t AtlasPadding = 1;
+// Shelf heights are rounded up to this, so glyphs of similar height share shelves.
+static const uint32_t AtlasShelfStep = 4;
+
+static AtlasRect MakeRect(uint32_t page, uint32_t x, uint32_t y, uint32_t width, uint32_t height, uint32_t channel = 0) {
+    AtlasRect rect;
+    rect.page = page;
+    rect.channel = channel;
+    rect.x = x;
+    rect.y = y;
+    rect.width = width;
+    rect.height = height;
+    return rect;
+}
+
+GlyphAtlas::GlyphAtlas(uint32_t page_width, uint32_t page_height, uint32_t max_pages, AtlasFormat format)
+    : page_width_(page_width),
+      page_height_(page_height),
+      max_pages_(std::max(1u, max_pages)),
+      format_(format),
+      planes_(format == AtlasFormat::ChannelPacked ? 4 : 1),
+      plane_bytes_(format == AtlasFormat::ChannelPacked ? 1 : 4),
+      glyphs_(size_t(page_width) * page_height * 4 * std::max(1u, max_pages)) {
+    glyphs_.SetEvictCallback([this](const FontGlyphKey&, AtlasGlyph& glyph) {
+        if (glyph.rect.width && glyph.rect.height) {
+            Free(glyph.rect);
+            if (invalidate_) {
+                invalidate_(invalidate_user_data_, glyph.rect);
+            }
+        }
+    });
+}
+
+bool GlyphAtlas::GetGlyph(FontInfo* font, uint32_t char_code, float origin_x, AtlasGlyph* glyph) {
+    // Glyphs are stored for the subpixel phase alone, the whole pixels the snapping carries over are added on the way out.
+    int origin_carry;
+    const FontGlyphKey key = MakeFontGlyphKey(*font, char_code, origin_x, &origin_carry);
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    AtlasGlyph* cached = glyphs_.Find(key);
+    if (!cached) {
+        auto rendered = GetGlyphBitmapInfo(font, char_code, static_cast<float>(key.phase) / key.phases);
+        if (rendered.empty() || rendered[0].error_code == GlyphErrorCode::InvalidGlyph) {
+            return false;
+        }
+        const GlyphBitmapInfo& bitmap = rendered[0];
+        if (format_ == AtlasFormat::ChannelPacked && (bitmap.emoji || font->render_mode != GlyphRenderMode::Gray)) {
+            return false;
+        }
+        AtlasGlyph entry;
+        entry.error_code = bitmap.error_code;
+        entry.bearing_x = bitmap.bearing_x;
+        entry.bearing_y = bitmap.bearing_y;
+        entry.advance = bitmap.advance;
+        entry.advance_26_6 = bitmap.advance_26_6;
+        entry.emoji = bitmap.emoji;
+        size_t cost = sizeof(FontGlyphKey) + sizeof(AtlasGlyph);
+        if (bitmap.data && bitmap.width && bitmap.height) {
+            if (bitmap.width + AtlasPadding > page_width_ || bitmap.height + AtlasPadding > page_height_) {
+                return false;
+            }
+            // Nothing new goes onto a page Compact is emptying, it would be dropped with the glyph on it.
+            while (!Allocate(bitmap.width, bitmap.height, &entry.rect, max_pages_, compact_page_)) {
+                if (compact_page_ != UINT32_MAX) {
+                    // That page is the only room left, give up the pass rather than evict.
+                    compact_queue_.clear();
+                    compact_page_ = UINT32_MAX;
+                    continue;
+                }
+                if (!glyphs_.EvictOne()) {
+                    return false;
+                }
+            }
+            WritePixels(entry.rect, static_cast<const uint8_t*>(bitmap.data), size_t(bitmap.width) * 4);
+            // The padding is uploaded too, it may still hold an evicted glyph on the GPU side.
+            MarkDirty(entry.rect.page, entry.rect.x, entry.rect.y, entry.rect.width + AtlasPadding, entry.rect.height + AtlasPadding);
+            cost += size_t(bitmap.width + AtlasPadding) * (bitmap.height + AtlasPadding) * plane_bytes_;
+        }
+        cached = glyphs_.Insert(key, entry, cost);
+    }
+    *glyph = *cached;
+    glyph->bearing_x += origin_carry;
+    return true;
+}
+
+void GlyphAtlas::SetInvalidateCallback(AtlasInvalidateCallback callback, void* user_data) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    invalidate_ = callback;
+    invalidate_user_data_ = user_data;
+}
+
+uint32_t GlyphAtlas::GetPageCount() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return static_cast<uint32_t>(pages_.size());
+}
+
+const void* GlyphAtlas::GetPageData(uint32_t page) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return page < pages_.size() ? pages_[page].pixels.data() : nullptr;
+}
+
+AtlasStats GlyphAtlas::GetStats() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    AtlasStats stats;
+    stats.glyphs = static_cast<uint32_t>(glyphs_.size());
+    stats.pages = static_cast<uint32_t>(pages_.size());
+    stats.used_bytes = used_bytes_;
+    stats.evictions = glyphs_.evictions();
+    stats.encoded_blocks = encoded_blocks_;
+    stats.encode_ms = encode_ms_;
+    stats.encode_error = encoded_blocks_ ? double(encode_error_) / (encoded_blocks_ * 16) : 0;
+    return stats;
+}
+
+bool GlyphAtlas::AllocateInShelf(Shelf& shelf, uint32_t width, uint32_t* x) {
+    for (auto span = shelf.free_spans.begin(); span != shelf.free_spans.end(); ++span) {
+        if (span->width >= width) {
+            *x = span->x;
+            span->x += width;
+            span->width -= width;
+            if (!span->width) {
+                shelf.free_spans.erase(span);
+            }
+            shelf.used_width += width;
+            return true;
+        }
+    }
+    if (shelf.cursor + width <= page_width_) {
+        *x = shelf.cursor;
+        shelf.cursor += width;
+        shelf.used_width += width;
+        return true;
+    }
+    return false;
+}
+
+bool GlyphAtlas::Allocate(uint32_t width, uint32_t height, AtlasRect* rect, uint32_t page_limit, uint32_t skip_page, bool any_shelf) {
+    width += AtlasPadding;
+    height += AtlasPadding;
+    const uint32_t shelf_height = std::min(page_height_, (height + AtlasShelfStep - 1) / AtlasShelfStep * AtlasShelfStep);
+    for (uint32_t page = 0; page <= pages_.size() && page < page_limit; ++page) {
+        if (page == skip_page) {
+            continue;
+        }
+        if (page == pages_.size()) {
+            pages_.emplace_back();
+            pages_.back().pixels.assign(size_t(page_width_) * page_height_ * 4, 0);
+        }
+        for (uint32_t channel = 0; channel < planes_; ++channel) {
+            std::vector<Shelf>& shelves = pages_[page].shelves[channel];
+            bool placed = false;
+            uint32_t x = 0, y = 0;
+            // Shelves much taller than the glyph are left for taller glyphs unless they are empty.
+            for (auto& shelf : shelves) {
+                if (shelf.height < height || (!any_shelf && shelf.used_width && shelf.height > shelf_height + shelf_height / 2)) {
+                    continue;
+                }
+                if (AllocateInShelf(shelf, width, &x)) {
+                    y = shelf.y;
+                    placed = true;
+                    break;
+                }
+            }
+            const uint32_t top = shelves.empty() ? 0 : shelves.back().y + shelves.back().height;
+            if (!placed && top + shelf_height <= page_height_) {
+                shelves.push_back({top, shelf_height, width, width, {}});
+                y = top;
+                placed = true;
+            }
+            if (placed) {
+                *rect = MakeRect(page, x, y, width - AtlasPadding, height - AtlasPadding, channel);
+                used_bytes_ += size_t(width) * height * plane_bytes_;
+                pages_[page].used_bytes += size_t(width) * height * plane_bytes_;
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
+void GlyphAtlas::Free(const AtlasRect& rect) {
+    // Nothing samples a freed slot, so only the glyph later placed there is uploaded.
+    ClearPixels(rect);
+    const uint32_t width = rect.width + AtlasPadding;
+    const uint32_t height = rect.height + AtlasPadding;
+    used_bytes_ -= size_t(width) * height * plane_bytes_;
+    pages_[rect.page].used_bytes -= size_t(width) * height * plane_bytes_;
+    std::vector<Shelf>& shelves = pages_[rect.page].shelves[rect.channel];
+    auto shelf = std::find_if(shelves.begin(), shelves.end(), [&rect](const Shelf& candidate) { return candidate.y == rect.y; });
+    if (shelf == shelves.end()) {
+        return;
+    }
+    shelf->used_width -= width;
+    if (!shelf->used_width) {
+        shelf->cursor = 0;
+        shelf->free_spans.clear();
+    } else {
+        // Keep the spans sorted and merged with their neighbours.
+        auto spans = &shelf->free_spans;
+        auto next = std::lower_bound(spans->begin(), spans->end(), rect.x, [](const Span& span, uint32_t x) { return span.x < x; });
+        next = spans->insert(next, {rect.x, width});
+        if (next + 1 != spans->end() && next->x + next->width == (next + 1)->x) {
+            next->width += (next + 1)->width;
+            spans->erase(next + 1);
+        }
+        if (next != spans->begin() && (next - 1)->x + (next - 1)->width == next->x) {
+            (next - 1)->width += next->width;
+            next = spans->erase(next) - 1;
+        }
+        if (next->x + next->width == shelf->cursor) {
+            shelf->cursor = next->x;
+            spans->erase(next);
+        }
+    }
+    while (!shelves.empty() && !shelves.back().used_width) {
+        shelves.pop_back();
+    }
+}
+
+void GlyphAtlas::WritePixels(const AtlasRect& rect, const uint8_t* src, size_t src_pitch) {
+    const size_t pitch = size_t(page_width_) * 4;
+    uint8_t* dst = pages_[rect.page].pixels.data() + rect.y * pitch + size_t(rect.x) * 4;
+    for (uint32_t row = 0; row < rect.height; ++row, dst += pitch, src += src_pitch) {
+        if (format_ == AtlasFormat::RGBA) {
+            memcpy(dst, src, size_t(rect.width) * 4);
+        } else {
+            for (uint32_t x = 0; x < rect.width; ++x) {
+                dst[x * 4 + rect.channel] = src[x * 4 + 3];
+            }
+        }
+    }
+}
+
+void GlyphAtlas::CopyPixels(const AtlasRect& from, const AtlasRect& to) {
+    const size_t pitch = size_t(page_width_) * 4;
+    const uint8_t* src = pages_[from.page].pixels.data() + from.y * pitch + size_t(from.x) * 4;
+    uint8_t* dst = pages_[to.page].pixels.data() + to.y * pitch + size_t(to.x) * 4;
+    for (uint32_t row = 0; row < to.height; ++row, dst += pitch, src += pitch) {
+        if (format_ == AtlasFormat::RGBA) {
+            memcpy(dst, src, size_t(to.width) * 4);
+        } else {
+            for (uint32_t x = 0; x < to.width; ++x) {
+                dst[x * 4 + to.channel] = src[x * 4 + from.channel];
+            }
+        }
+    }
+}
+
+void GlyphAtlas::ClearPixels(const AtlasRect& rect) {
+    const size_t pitch = size_t(page_width_) * 4;
+    uint8_t* dst = pages_[rect.page].pixels.data() + rect.y * pitch + size_t(rect.x) * 4;
+    for (uint32_t row = 0; row < rect.height; ++row, dst += pitch) {
+        if (format_ == AtlasFormat::RGBA) {
+            memset(dst, 0, size_t(rect.width) * 4);
+        } else {
+            for (uint32_t x = 0; x < rect.width; ++x) {
+                dst[x * 4 + rect.channel] = 0;
+            }
+        }
+    }
+}
+
+bool GlyphAtlas::Compact(double time_budget_ms, LinkedList<AtlasRemap>* remaps) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    const auto deadline = std::chrono::steady_clock::now() + std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<double, std::milli>(time_budget_ms));
+    const size_t page_bytes = size_t(page_width_) * page_height_ * 4;
+    // Empty the least used page into free space on the others, then move the last page into
+    // its place so the remaining pages stay numbered without gaps.
+    while (pages_.size() > 1 && (used_bytes_ + page_bytes - 1) / page_bytes < pages_.size()) {
+        if (compact_page_ >= pages_.size()) {
+            compact_page_ = 0;
+            for (uint32_t page = 1; page < pages_.size(); ++page) {
+                if (pages_[page].used_bytes < pages_[compact_page_].used_bytes) {
+                    compact_page_ = page;
+                }
+            }
+            const uint32_t source = compact_page_;
+            compact_queue_.clear();
+            glyphs_.ForEach([this, source](const FontGlyphKey& key, const AtlasGlyph& glyph) {
+                if (glyph.rect.page == source && glyph.rect.width && glyph.rect.height) {
+                    compact_queue_.push_back(key);
+                }
+            });
+            // Taken from the back, tallest first as they are the hardest to place.
+            std::sort(compact_queue_.begin(), compact_queue_.end(), [this](const FontGlyphKey& a, const FontGlyphKey& b) { return glyphs_.Peek(a)->rect.height < glyphs_.Peek(b)->rect.height; });
+        }
+        const uint32_t source = compact_page_;
+        while (!compact_queue_.empty()) {
+            if (std::chrono::steady_clock::now() >= deadline) {
+                return false;
+            }
+            AtlasGlyph* glyph = glyphs_.Peek(compact_queue_.back());
+            if (glyph && glyph->rect.page == source && glyph->rect.width && glyph->rect.height) {
+                AtlasRect target;
+                if (!Allocate(glyph->rect.width, glyph->rect.height, &target, static_cast<uint32_t>(pages_.size()), source, true)) {
+                    // The other pages are too fragmented to take this page's glyphs.
+                    compact_queue_.clear();
+                    compact_page_ = UINT32_MAX;
+                    return true;
+                }
+                CopyPixels(glyph->rect, target);
+                MarkDirty(target.page, target.x, target.y, target.width + AtlasPadding, target.height + AtlasPadding);
+                if (remaps) {
+                    AtlasRemap remap;
+                    remap.from = glyph->rect;
+                    remap.to = target;
+                    remaps->add(remap);
+                }
+                Free(glyph->rect);
+                glyph->rect = target;
+            }
+            compact_queue_.pop_back();
+        }
+        compact_page_ = UINT32_MAX;
+        const uint32_t last = static_cast<uint32_t>(pages_.size() - 1);
+        if (source != last) {
+            std::swap(pages_[source], pages_[last]);
+            pages_[source].dirty.clear();
+            glyphs_.ForEach([this, source, last, remaps](const FontGlyphKey&, AtlasGlyph& glyph) {
+                if (glyph.rect.page == last && glyph.rect.width && glyph.rect.height) {
+                    AtlasRemap remap;
+                    remap.from = glyph.rect;
+                    glyph.rect.page = source;
+                    remap.to = glyph.rect;
+                    if (remaps) {
+                        remaps->add(remap);
+                    }
+                    MarkDirty(source, glyph.rect.x, glyph.rect.y, glyph.rect.width + AtlasPadding, glyph.rect.height + AtlasPadding);
+                }
+            });
+        }
+        pages_.pop_back();
+    }
+    return true;
+}
+
+static uint64_t RectArea(const AtlasRect& rect) { return uint64_t(rect.width) * rect.height; }
+
+void GlyphAtlas::MarkDirty(uint32_t page, uint32_t x, uint32_t y, uint32_t width, uint32_t height) {
+    AtlasRect area = MakeRect(page, x, y, std::min(width, page_width_ - x), std::min(height, page_height_ - y));
+    std::vector<AtlasRect>& dirty = pages_[page].dirty;
+    // Merge while the bounding box wastes at most half the area it adds, neighbours on a shelf
+    // and overlapping areas always qualify. Merging can make other areas mergeable, so start over.
+    bool merged = true;
+    while (merged) {
+        merged = false;
+        for (auto other = dirty.begin(); other != dirty.end(); ++other) {
+            const uint32_t left = std::min(area.x, other->x);
+            const uint32_t top = std::min(area.y, other->y);
+            const uint32_t right = std::max(area.x + area.width, other->x + other->width);
+            const uint32_t bottom = std::max(area.y + area.height, other->y + other->height);
+            const AtlasRect bounds = MakeRect(page, left, top, right - left, bottom - top);
+            if (RectArea(bounds) * 2 <= (RectArea(area) + RectArea(*other)) * 3) {
+                area = bounds;
+                dirty.erase(other);
+                merged = true;
+                break;
+            }
+        }
+    }
+    dirty.push_back(area);
+}
+
+LinkedList<AtlasUpload> GlyphAtlas::CollectUploads(uint32_t row_alignment) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (compression_ != AtlasCompression::None) {
+        return CollectBlockUploads();
+    }
+    row_alignment = std::max(1u, row_alignment);
+    size_t staging_size = 0;
+    for (auto& page : pages_) {
+        for (auto& rect : page.dirty) {
+            const size_t pitch = (size_t(rect.width) * 4 + row_alignment - 1) / row_alignment * row_alignment;
+            staging_size += pitch * rect.height;
+        }
+    }
+    staging_.resize(staging_size);
+    LinkedList<AtlasUpload> uploads;
+    size_t offset = 0;
+    const size_t page_pitch = size_t(page_width_) * 4;
+    for (auto& page : pages_) {
+        for (auto& rect : page.dirty) {
+            AtlasUpload upload;
+            upload.rect = rect;
+            upload.pitch = static_cast<uint32_t>((size_t(rect.width) * 4 + row_alignment - 1) / row_alignment * row_alignment);
+            upload.data = staging_.data() + offset;
+            for (uint32_t row = 0; row < rect.height; ++row) {
+                memcpy(staging_.data() + offset + size_t(row) * upload.pitch, page.pixels.data() + (rect.y + row) * page_pitch + size_t(rect.x) * 4, size_t(rect.width) * 4);
+            }
+            offset += size_t(upload.pitch) * rect.height;
+            uploads.add(upload);
+        }
+        page.dirty.clear();
+    }
+    return uploads;
+}
+
+bool GlyphAtlas::SetCompression(AtlasCompression compression) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (compression == AtlasCompression::BC5 && format_ != AtlasFormat::ChannelPacked) {
+        return false;
+    }
+    compression_ = compression;
+    for (auto& page : pages_) {
+        page.dirty.assign(1, MakeRect(static_cast<uint32_t>(&page - pages_.data()), 0, 0, page_width_, page_height_));
+    }
+    return true;
+}
+
+LinkedList<AtlasUpload> GlyphAtlas::CollectBlockUploads() {
+    const auto start = std::chrono::steady_clock::now();
+    // Planes handed out per dirty area, and the BC4 blocks making up one block of the upload.
+    std::vector<uint32_t> planes;
+    uint32_t channels_per_block = 1;
+    if (format_ == AtlasFormat::RGBA) {
+        planes = {3};
+    } else if (compression_ == AtlasCompression::BC4) {
+        planes = {0, 1, 2, 3};
+    } else {
+        planes = {0, 2};
+        channels_per_block = 2;
+    }
+    const size_t block_bytes = 8 * channels_per_block;
+    size_t staging_size = 0;
+    for (auto& page : pages_) {
+        for (auto& rect : page.dirty) {
+            const size_t blocks = size_t((rect.x + rect.width + 3) / 4 - rect.x / 4) * ((rect.y + rect.height + 3) / 4 - rect.y / 4);
+            staging_size += blocks * block_bytes * planes.size();
+        }
+    }
+    staging_.resize(staging_size);
+    LinkedList<AtlasUpload> uploads;
+    uint8_t* out = staging_.data();
+    const size_t page_pitch = size_t(page_width_) * 4;
+    uint8_t edge[4 * 16];
+    for (auto& page : pages_) {
+        const uint32_t page_index = static_cast<uint32_t>(&page - pages_.data());
+        for (auto& rect : page.dirty) {
+            const uint32_t left = rect.x / 4, top = rect.y / 4;
+            const uint32_t right = (rect.x + rect.width + 3) / 4, bottom = (rect.y + rect.height + 3) / 4;
+            for (uint32_t plane : planes) {
+                AtlasUpload upload;
+                upload.rect = MakeRect(page_index, left * 4, top * 4, std::min(right * 4, page_width_) - left * 4, std::min(bottom * 4, page_height_) - top * 4, plane);
+                upload.pitch = static_cast<uint32_t>((right - left) * block_bytes);
+                upload.data = out;
+                for (uint32_t by = top; by < bottom; ++by) {
+                    for (uint32_t bx = left; bx < right; ++bx) {
+                        const uint8_t* src = page.pixels.data() + by * 4 * page_pitch + size_t(bx) * 16;
+                        size_t src_pitch = page_pitch;
+                        if (bx * 4 + 4 > page_width_ || by * 4 + 4 > page_height_) {
+                            // Blocks hanging over the page edge repeat its last pixels.
+                            for (uint32_t y = 0; y < 4; ++y) {
+                                for (uint32_t x = 0; x < 4; ++x) {
+                                    memcpy(edge + (y * 4 + x) * 4, page.pixels.data() + std::min(by * 4 + y, page_height_ - 1) * page_pitch + size_t(std::min(bx * 4 + x, page_width_ - 1)) * 4, 4);
+                                }
+                            }
+                            src = edge;
+                            src_pitch = 16;
+                        }
+                        for (uint32_t channel = plane; channel < plane + channels_per_block; ++channel) {
+                            encode_error_ += EncodeBC4Block(out, src, src_pitch, channel);
+                            out += 8;
+                            ++encoded_blocks_;
+                        }
+                    }
+                }
+                uploads.add(upload);
+            }
+        }
+        page.dirty.clear();
+    }
+    encode_ms_ += std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+    return uploads;
+}
+
+}  // namespace Font
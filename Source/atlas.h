@@ -0,0 +1,88 @@
+﻿#pragma once
+
+#include "font.h"
+#include "cache.h"
+#include "freetype.h"
+#include <mutex>
+#include <string>
+#include <vector>
+
+namespace Font {
+
+// Pages are cut into shelves, horizontal strips as tall as the glyphs placed in them.
+// A glyph goes into the first shelf of a suitable height with room left, either a slot
+// freed by an evicted glyph or the unused space at the shelf's end. Shelves that empty
+// out take any glyph that fits, and empty shelves at the bottom of a page are released.
+// Channel packed pages have a separate set of shelves for each channel.
+class GlyphAtlas {
+public:
+    GlyphAtlas(uint32_t page_width, uint32_t page_height, uint32_t max_pages, AtlasFormat format);
+    bool GetGlyph(FontInfo* font, uint32_t char_code, float origin_x, AtlasGlyph* glyph);
+    void SetInvalidateCallback(AtlasInvalidateCallback callback, void* user_data);
+    uint32_t GetPageCount();
+    const void* GetPageData(uint32_t page);
+    AtlasStats GetStats();
+    LinkedList<AtlasUpload> CollectUploads(uint32_t row_alignment);
+    bool SetCompression(AtlasCompression compression);
+    bool Compact(double time_budget_ms, LinkedList<AtlasRemap>* remaps);
+
+private:
+    // Unused run of a shelf.
+    struct Span {
+        uint32_t x;
+        uint32_t width;
+    };
+    struct Shelf {
+        uint32_t y;
+        uint32_t height;
+        // Start of the never used space at the end of the shelf.
+        uint32_t cursor;
+        uint32_t used_width;
+        std::vector<Span> free_spans;
+    };
+    struct Page {
+        std::vector<uint8_t> pixels;
+        // Ordered by y, one layout per channel plane.
+        std::vector<Shelf> shelves[4];
+        // Areas written since the last CollectUploads, no two of them worth merging.
+        std::vector<AtlasRect> dirty;
+        size_t used_bytes = 0;
+    };
+    // Place a glyph on one of the first `page_limit` pages other than `skip_page`, adding a page if that
+    // is allowed and needed. `any_shelf` also accepts shelves much taller than the glyph.
+    bool Allocate(uint32_t width, uint32_t height, AtlasRect* rect, uint32_t page_limit, uint32_t skip_page = UINT32_MAX, bool any_shelf = false);
+    bool AllocateInShelf(Shelf& shelf, uint32_t width, uint32_t* x);
+    void Free(const AtlasRect& rect);
+    // Store `src` (RGBA rows) at `rect`, taking only the coverage in channel packed atlases.
+    void WritePixels(const AtlasRect& rect, const uint8_t* src, size_t src_pitch);
+    void CopyPixels(const AtlasRect& from, const AtlasRect& to);
+    void ClearPixels(const AtlasRect& rect);
+    LinkedList<AtlasUpload> CollectBlockUploads();
+    // Record a changed area of a page, merging it with dirty areas it touches or nearly touches.
+    void MarkDirty(uint32_t page, uint32_t x, uint32_t y, uint32_t width, uint32_t height);
+
+    std::mutex mutex_;
+    uint32_t page_width_;
+    uint32_t page_height_;
+    uint32_t max_pages_;
+    AtlasFormat format_;
+    // Shelf layouts per page, and the bytes a glyph pixel takes up in them.
+    uint32_t planes_;
+    uint32_t plane_bytes_;
+    std::vector<Page> pages_;
+    TwoQueueCache<FontGlyphKey, AtlasGlyph, FontGlyphKeyHash> glyphs_;
+    size_t used_bytes_ = 0;
+    // Holds the pixels handed out by the last CollectUploads.
+    std::vector<uint8_t> staging_;
+    // Glyphs of the page being emptied by Compact, carried over between calls.
+    std::vector<FontGlyphKey> compact_queue_;
+    uint32_t compact_page_ = UINT32_MAX;
+    AtlasCompression compression_ = AtlasCompression::None;
+    uint64_t encoded_blocks_ = 0;
+    uint64_t encode_error_ = 0;
+    double encode_ms_ = 0;
+    AtlasInvalidateCallback invalidate_ = nullptr;
+    void* invalidate_user_data_ = nullptr;
+};
+
+}  // namespace Font
@@ -0,0 +1,474 @@
+﻿#include <algorithm>
+#include <cstring>
+#include <vector>
+
+#include "bitmap.h"
+
+#if defined(_M_X64) || defined(_M_AMD64) || defined(__x86_64__) || defined(__SSE2__) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define FONT_SSE2 1
+#include <emmintrin.h>
+#include <tmmintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#define FONT_TARGET_SSSE3
+#else
+#define FONT_TARGET_SSSE3 __attribute__((target("ssse3")))
+#endif
+#endif
+
+namespace Font {
+
+#ifdef FONT_SSE2
+static bool HasSSSE3() {
+#ifdef _MSC_VER
+    int info[4];
+    __cpuid(info, 1);
+    return (info[2] & (1 << 9)) != 0;
+#else
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("ssse3");
+#endif
+}
+
+static const bool CpuHasSSSE3 = HasSSSE3();
+#endif
+
+void ExpandGrayToRGBA(uint8_t* dst, size_t dst_pitch, const uint8_t* src, size_t src_pitch, uint32_t width, uint32_t height) {
+    for (uint32_t row = 0; row < height; ++row) {
+        const uint8_t* s = src + row * src_pitch;
+        uint8_t* d = dst + row * dst_pitch;
+        uint32_t col = 0;
+#ifdef FONT_SSE2
+        for (; col + 16 <= width; col += 16) {
+            __m128i value = _mm_loadu_si128((const __m128i*)(s + col));
+            __m128i lo = _mm_unpacklo_epi8(value, value);
+            __m128i hi = _mm_unpackhi_epi8(value, value);
+            _mm_storeu_si128((__m128i*)(d + col * 4), _mm_unpacklo_epi16(lo, lo));
+            _mm_storeu_si128((__m128i*)(d + col * 4 + 16), _mm_unpackhi_epi16(lo, lo));
+            _mm_storeu_si128((__m128i*)(d + col * 4 + 32), _mm_unpacklo_epi16(hi, hi));
+            _mm_storeu_si128((__m128i*)(d + col * 4 + 48), _mm_unpackhi_epi16(hi, hi));
+        }
+#endif
+        for (; col < width; ++col) {
+            uint8_t value = s[col];
+            d[col * 4] = value;
+            d[col * 4 + 1] = value;
+            d[col * 4 + 2] = value;
+            d[col * 4 + 3] = value;
+        }
+    }
+}
+
+static inline uint8_t Max3(uint8_t a, uint8_t b, uint8_t c) {
+    uint8_t m = a > b ? a : b;
+    return m > c ? m : c;
+}
+
+#ifdef FONT_SSE2
+// Eight LCD pixels (24 source bytes) to eight RGBA pixels per iteration.
+FONT_TARGET_SSSE3 static uint32_t ConvertLcdRowSSSE3(uint8_t* d, const uint8_t* s, uint32_t width, bool bgr) {
+    const __m128i rgb_lo = _mm_setr_epi8(0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11, -1);
+    const __m128i bgr_lo = _mm_setr_epi8(2, 1, 0, -1, 5, 4, 3, -1, 8, 7, 6, -1, 11, 10, 9, -1);
+    const __m128i shuffle = bgr ? bgr_lo : rgb_lo;
+    uint32_t col = 0;
+    // The 16 byte loads read 4 bytes past the 12 consumed ones, keep them inside the row.
+    for (; (col + 8) * 3 + 4 <= width * 3; col += 8) {
+        for (int half = 0; half < 2; ++half) {
+            __m128i value = _mm_loadu_si128((const __m128i*)(s + (col + half * 4) * 3));
+            __m128i pixels = _mm_shuffle_epi8(value, shuffle);
+            __m128i g = _mm_srli_epi32(pixels, 8);
+            __m128i b = _mm_srli_epi32(pixels, 16);
+            __m128i alpha = _mm_max_epu8(_mm_max_epu8(pixels, g), b);
+            alpha = _mm_slli_epi32(_mm_and_si128(alpha, _mm_set1_epi32(0xff)), 24);
+            _mm_storeu_si128((__m128i*)(d + (col + half * 4) * 4), _mm_or_si128(pixels, alpha));
+        }
+    }
+    return col;
+}
+#endif
+
+void ConvertLcdToRGBA(uint8_t* dst, size_t dst_pitch, const uint8_t* src, size_t src_pitch, uint32_t width, uint32_t height, bool bgr) {
+    const int r_index = bgr ? 2 : 0;
+    const int b_index = bgr ? 0 : 2;
+    for (uint32_t row = 0; row < height; ++row) {
+        const uint8_t* s = src + row * src_pitch;
+        uint8_t* d = dst + row * dst_pitch;
+        uint32_t col = 0;
+#ifdef FONT_SSE2
+        if (CpuHasSSSE3) {
+            col = ConvertLcdRowSSSE3(d, s, width, bgr);
+        }
+#endif
+        for (; col < width; ++col) {
+            uint8_t r = s[col * 3 + r_index];
+            uint8_t g = s[col * 3 + 1];
+            uint8_t b = s[col * 3 + b_index];
+            d[col * 4] = r;
+            d[col * 4 + 1] = g;
+            d[col * 4 + 2] = b;
+            d[col * 4 + 3] = Max3(r, g, b);
+        }
+    }
+}
+
+void ConvertLcdVerticalToRGBA(uint8_t* dst, size_t dst_pitch, const uint8_t* src, size_t src_pitch, uint32_t width, uint32_t height, bool bgr) {
+    for (uint32_t row = 0; row < height; ++row) {
+        const uint8_t* rs = src + (row * 3 + (bgr ? 2 : 0)) * src_pitch;
+        const uint8_t* gs = src + (row * 3 + 1) * src_pitch;
+        const uint8_t* bs = src + (row * 3 + (bgr ? 0 : 2)) * src_pitch;
+        uint8_t* d = dst + row * dst_pitch;
+        uint32_t col = 0;
+#ifdef FONT_SSE2
+        for (; col + 16 <= width; col += 16) {
+            __m128i r = _mm_loadu_si128((const __m128i*)(rs + col));
+            __m128i g = _mm_loadu_si128((const __m128i*)(gs + col));
+            __m128i b = _mm_loadu_si128((const __m128i*)(bs + col));
+            __m128i a = _mm_max_epu8(_mm_max_epu8(r, g), b);
+            __m128i rg_lo = _mm_unpacklo_epi8(r, g);
+            __m128i rg_hi = _mm_unpackhi_epi8(r, g);
+            __m128i ba_lo = _mm_unpacklo_epi8(b, a);
+            __m128i ba_hi = _mm_unpackhi_epi8(b, a);
+            _mm_storeu_si128((__m128i*)(d + col * 4), _mm_unpacklo_epi16(rg_lo, ba_lo));
+            _mm_storeu_si128((__m128i*)(d + col * 4 + 16), _mm_unpackhi_epi16(rg_lo, ba_lo));
+            _mm_storeu_si128((__m128i*)(d + col * 4 + 32), _mm_unpacklo_epi16(rg_hi, ba_hi));
+            _mm_storeu_si128((__m128i*)(d + col * 4 + 48), _mm_unpackhi_epi16(rg_hi, ba_hi));
+        }
+#endif
+        for (; col < width; ++col) {
+            d[col * 4] = rs[col];
+            d[col * 4 + 1] = gs[col];
+            d[col * 4 + 2] = bs[col];
+            d[col * 4 + 3] = Max3(rs[col], gs[col], bs[col]);
+        }
+    }
+}
+
+static inline uint32_t Div255(uint32_t value) { return (value + 128 + ((value + 128) >> 8)) >> 8; }
+
+#ifdef FONT_SSE2
+// Exact x / 255 for the 16-bit products of two bytes.
+static inline __m128i Div255Epu16(__m128i value) {
+    value = _mm_add_epi16(value, _mm_set1_epi16(128));
+    return _mm_srli_epi16(_mm_add_epi16(value, _mm_srli_epi16(value, 8)), 8);
+}
+#endif
+
+void BlendCoverageOver(uint8_t* dst, size_t dst_pitch, const uint8_t* coverage, size_t coverage_pitch, uint32_t width, uint32_t height, const uint8_t color[4]) {
+    const uint32_t premultiplied[4] = {Div255(color[0] * color[3]), Div255(color[1] * color[3]), Div255(color[2] * color[3]), color[3]};
+#ifdef FONT_SSE2
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i max = _mm_set1_epi16(255);
+    const __m128i source = _mm_setr_epi16(static_cast<short>(premultiplied[0]), static_cast<short>(premultiplied[1]), static_cast<short>(premultiplied[2]), static_cast<short>(premultiplied[3]), static_cast<short>(premultiplied[0]), static_cast<short>(premultiplied[1]), static_cast<short>(premultiplied[2]), static_cast<short>(premultiplied[3]));
+#endif
+    for (uint32_t row = 0; row < height; ++row) {
+        const uint8_t* c = coverage + row * coverage_pitch;
+        uint8_t* d = dst + row * dst_pitch;
+        uint32_t col = 0;
+#ifdef FONT_SSE2
+        for (; col + 4 <= width; col += 4) {
+            int mask;
+            memcpy(&mask, c + col, sizeof(mask));
+            if (mask == 0) {
+                continue;
+            }
+            // Replicate each pixel's coverage over its four channels.
+            __m128i cov = _mm_cvtsi32_si128(mask);
+            cov = _mm_unpacklo_epi8(cov, cov);
+            cov = _mm_unpacklo_epi16(cov, cov);
+            __m128i pixels = _mm_loadu_si128((__m128i*)(d + col * 4));
+            __m128i result[2];
+            for (int half = 0; half < 2; ++half) {
+                __m128i cov16 = half ? _mm_unpackhi_epi8(cov, zero) : _mm_unpacklo_epi8(cov, zero);
+                __m128i dst16 = half ? _mm_unpackhi_epi8(pixels, zero) : _mm_unpacklo_epi8(pixels, zero);
+                __m128i src16 = Div255Epu16(_mm_mullo_epi16(source, cov16));
+                __m128i alpha = _mm_shufflehi_epi16(_mm_shufflelo_epi16(src16, _MM_SHUFFLE(3, 3, 3, 3)), _MM_SHUFFLE(3, 3, 3, 3));
+                result[half] = _mm_add_epi16(src16, Div255Epu16(_mm_mullo_epi16(dst16, _mm_sub_epi16(max, alpha))));
+            }
+            _mm_storeu_si128((__m128i*)(d + col * 4), _mm_packus_epi16(result[0], result[1]));
+        }
+#endif
+        for (; col < width; ++col) {
+            const uint32_t cov = c[col];
+            if (!cov) {
+                continue;
+            }
+            const uint32_t alpha = Div255(premultiplied[3] * cov);
+            for (int channel = 0; channel < 4; ++channel) {
+                d[col * 4 + channel] = static_cast<uint8_t>(Div255(premultiplied[channel] * cov) + Div255(d[col * 4 + channel] * (255 - alpha)));
+            }
+        }
+    }
+}
+
+void BlendTintedOver(uint8_t* dst, size_t dst_pitch, const uint8_t* src, size_t src_pitch, uint32_t width, uint32_t height, const uint8_t tint[4]) {
+#ifdef FONT_SSE2
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i max = _mm_set1_epi16(255);
+    const __m128i tint16 = _mm_setr_epi16(tint[0], tint[1], tint[2], tint[3], tint[0], tint[1], tint[2], tint[3]);
+#endif
+    for (uint32_t row = 0; row < height; ++row) {
+        const uint8_t* s = src + row * src_pitch;
+        uint8_t* d = dst + row * dst_pitch;
+        uint32_t col = 0;
+#ifdef FONT_SSE2
+        for (; col + 4 <= width; col += 4) {
+            __m128i value = _mm_loadu_si128((const __m128i*)(s + col * 4));
+            // Most of a glyph's box is empty.
+            if (_mm_movemask_epi8(_mm_cmpeq_epi8(value, zero)) == 0xffff) {
+                continue;
+            }
+            __m128i pixels = _mm_loadu_si128((__m128i*)(d + col * 4));
+            __m128i result[2];
+            for (int half = 0; half < 2; ++half) {
+                __m128i src16 = half ? _mm_unpackhi_epi8(value, zero) : _mm_unpacklo_epi8(value, zero);
+                __m128i dst16 = half ? _mm_unpackhi_epi8(pixels, zero) : _mm_unpacklo_epi8(pixels, zero);
+                src16 = Div255Epu16(_mm_mullo_epi16(src16, tint16));
+                __m128i alpha = _mm_shufflehi_epi16(_mm_shufflelo_epi16(src16, _MM_SHUFFLE(3, 3, 3, 3)), _MM_SHUFFLE(3, 3, 3, 3));
+                result[half] = _mm_add_epi16(src16, Div255Epu16(_mm_mullo_epi16(dst16, _mm_sub_epi16(max, alpha))));
+            }
+            _mm_storeu_si128((__m128i*)(d + col * 4), _mm_packus_epi16(result[0], result[1]));
+        }
+#endif
+        for (; col < width; ++col) {
+            const uint32_t alpha = Div255(s[col * 4 + 3] * tint[3]);
+            if (!alpha && !s[col * 4] && !s[col * 4 + 1] && !s[col * 4 + 2]) {
+                continue;
+            }
+            for (int channel = 0; channel < 4; ++channel) {
+                d[col * 4 + channel] = static_cast<uint8_t>(std::min<uint32_t>(255, Div255(s[col * 4 + channel] * tint[channel]) + Div255(d[col * 4 + channel] * (255 - alpha))));
+            }
+        }
+    }
+}
+
+void BlendAlphaOver(uint8_t* dst, size_t dst_pitch, const uint8_t* src, size_t src_pitch, uint32_t width, uint32_t height, uint8_t opacity) {
+#ifdef FONT_SSE2
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i max = _mm_set1_epi16(255);
+    const __m128i scale = _mm_set1_epi16(opacity);
+#endif
+    for (uint32_t row = 0; row < height; ++row) {
+        const uint8_t* s = src + row * src_pitch;
+        uint8_t* d = dst + row * dst_pitch;
+        uint32_t col = 0;
+#ifdef FONT_SSE2
+        for (; col + 8 <= width; col += 8) {
+            __m128i lo = _mm_srli_epi32(_mm_loadu_si128((const __m128i*)(s + col * 4)), 24);
+            __m128i hi = _mm_srli_epi32(_mm_loadu_si128((const __m128i*)(s + col * 4 + 16)), 24);
+            __m128i alpha = _mm_packs_epi32(lo, hi);
+            if (_mm_movemask_epi8(_mm_cmpeq_epi16(alpha, zero)) == 0xffff) {
+                continue;
+            }
+            alpha = Div255Epu16(_mm_mullo_epi16(alpha, scale));
+            __m128i coverage = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i*)(d + col)), zero);
+            coverage = _mm_add_epi16(alpha, Div255Epu16(_mm_mullo_epi16(coverage, _mm_sub_epi16(max, alpha))));
+            _mm_storel_epi64((__m128i*)(d + col), _mm_packus_epi16(coverage, zero));
+        }
+#endif
+        for (; col < width; ++col) {
+            const uint32_t alpha = Div255(s[col * 4 + 3] * opacity);
+            if (alpha) {
+                d[col] = static_cast<uint8_t>(alpha + Div255(d[col] * (255 - alpha)));
+            }
+        }
+    }
+}
+
+void ConvertBGRAToRGBA(uint8_t* dst, size_t dst_pitch, const uint8_t* src, size_t src_pitch, uint32_t width, uint32_t height) {
+    for (uint32_t row = 0; row < height; ++row) {
+        const uint8_t* s = src + row * src_pitch;
+        uint8_t* d = dst + row * dst_pitch;
+        uint32_t col = 0;
+#ifdef FONT_SSE2
+        const __m128i keep = _mm_set1_epi32(static_cast<int>(0xff00ff00));
+        const __m128i low = _mm_set1_epi32(0xff);
+        for (; col + 4 <= width; col += 4) {
+            __m128i value = _mm_loadu_si128((const __m128i*)(s + col * 4));
+            __m128i swapped = _mm_or_si128(_mm_and_si128(_mm_srli_epi32(value, 16), low), _mm_slli_epi32(_mm_and_si128(value, low), 16));
+            _mm_storeu_si128((__m128i*)(d + col * 4), _mm_or_si128(_mm_and_si128(value, keep), swapped));
+        }
+#endif
+        for (; col < width; ++col) {
+            d[col * 4] = s[col * 4 + 2];
+            d[col * 4 + 1] = s[col * 4 + 1];
+            d[col * 4 + 2] = s[col * 4];
+            d[col * 4 + 3] = s[col * 4 + 3];
+        }
+    }
+}
+
+static void BoxScaleBGRAToRGBA(uint8_t* dst, size_t dst_pitch, uint32_t dst_width, uint32_t dst_height, const uint8_t* src, size_t src_pitch, uint32_t src_width, uint32_t src_height) {
+    // Source column span of every destination column, shared by all rows.
+    std::vector<uint32_t> x_begin(dst_width), x_end(dst_width);
+    for (uint32_t x = 0; x < dst_width; ++x) {
+        x_begin[x] = static_cast<uint32_t>(uint64_t(x) * src_width / dst_width);
+        x_end[x] = static_cast<uint32_t>((uint64_t(x + 1) * src_width + dst_width - 1) / dst_width);
+    }
+    std::vector<uint32_t> sums(dst_width * 4);
+    for (uint32_t y = 0; y < dst_height; ++y) {
+        const uint32_t y_begin = static_cast<uint32_t>(uint64_t(y) * src_height / dst_height);
+        const uint32_t y_end = static_cast<uint32_t>((uint64_t(y + 1) * src_height + dst_height - 1) / dst_height);
+        std::fill(sums.begin(), sums.end(), 0);
+        for (uint32_t sy = y_begin; sy < y_end; ++sy) {
+            const uint8_t* s = src + sy * src_pitch;
+            for (uint32_t x = 0; x < dst_width; ++x) {
+                uint32_t* sum = &sums[x * 4];
+                for (uint32_t sx = x_begin[x]; sx < x_end[x]; ++sx) {
+                    sum[0] += s[sx * 4 + 2];
+                    sum[1] += s[sx * 4 + 1];
+                    sum[2] += s[sx * 4];
+                    sum[3] += s[sx * 4 + 3];
+                }
+            }
+        }
+        uint8_t* d = dst + y * dst_pitch;
+        for (uint32_t x = 0; x < dst_width; ++x) {
+            const uint32_t count = (x_end[x] - x_begin[x]) * (y_end - y_begin);
+            for (int c = 0; c < 4; ++c) {
+                d[x * 4 + c] = static_cast<uint8_t>((sums[x * 4 + c] + count / 2) / count);
+            }
+        }
+    }
+}
+
+static void BilinearScaleBGRAToRGBA(uint8_t* dst, size_t dst_pitch, uint32_t dst_width, uint32_t dst_height, const uint8_t* src, size_t src_pitch, uint32_t src_width, uint32_t src_height) {
+    // Pixel centers in 16.16 fixed point.
+    const int64_t x_step = (int64_t(src_width) << 16) / dst_width;
+    const int64_t y_step = (int64_t(src_height) << 16) / dst_height;
+    for (uint32_t y = 0; y < dst_height; ++y) {
+        int64_t fy = y * y_step + y_step / 2 - 0x8000;
+        fy = fy < 0 ? 0 : fy;
+        uint32_t y0 = static_cast<uint32_t>(fy >> 16);
+        uint32_t y1 = y0 + 1 < src_height ? y0 + 1 : y0;
+        const uint32_t wy = static_cast<uint32_t>(fy & 0xffff) >> 8;
+        const uint8_t* s0 = src + y0 * src_pitch;
+        const uint8_t* s1 = src + y1 * src_pitch;
+        uint8_t* d = dst + y * dst_pitch;
+        for (uint32_t x = 0; x < dst_width; ++x) {
+            int64_t fx = x * x_step + x_step / 2 - 0x8000;
+            fx = fx < 0 ? 0 : fx;
+            uint32_t x0 = static_cast<uint32_t>(fx >> 16);
+            uint32_t x1 = x0 + 1 < src_width ? x0 + 1 : x0;
+            const uint32_t wx = static_cast<uint32_t>(fx & 0xffff) >> 8;
+            static const int swizzle[4] = {2, 1, 0, 3};
+            for (int c = 0; c < 4; ++c) {
+                const int sc = swizzle[c];
+                uint32_t top = s0[x0 * 4 + sc] * (256 - wx) + s0[x1 * 4 + sc] * wx;
+                uint32_t bottom = s1[x0 * 4 + sc] * (256 - wx) + s1[x1 * 4 + sc] * wx;
+                d[x * 4 + c] = static_cast<uint8_t>((top * (256 - wy) + bottom * wy + 32768) >> 16);
+            }
+        }
+    }
+}
+
+void ScaleBGRAToRGBA(uint8_t* dst, size_t dst_pitch, uint32_t dst_width, uint32_t dst_height, const uint8_t* src, size_t src_pitch, uint32_t src_width, uint32_t src_height) {
+    if (!dst_width || !dst_height || !src_width || !src_height) {
+        return;
+    }
+    if (dst_width == src_width && dst_height == src_height) {
+        ConvertBGRAToRGBA(dst, dst_pitch, src, src_pitch, src_width, src_height);
+    } else if (dst_width <= src_width && dst_height <= src_height) {
+        BoxScaleBGRAToRGBA(dst, dst_pitch, dst_width, dst_height, src, src_pitch, src_width, src_height);
+    } else {
+        BilinearScaleBGRAToRGBA(dst, dst_pitch, dst_width, dst_height, src, src_pitch, src_width, src_height);
+    }
+}
+
+uint32_t EncodeBC4Block(uint8_t block[8], const uint8_t* src, size_t src_pitch, uint32_t channel) {
+    uint8_t values[16];
+    uint8_t levels[16];
+    uint32_t low = 255, high = 0;
+#ifdef FONT_SSE2
+    const __m128i mask = _mm_set1_epi32(0xff);
+    const __m128i shift = _mm_cvtsi32_si128(static_cast<int>(channel * 8));
+    __m128i rows[4];
+    for (int row = 0; row < 4; ++row) {
+        rows[row] = _mm_and_si128(_mm_srl_epi32(_mm_loadu_si128((const __m128i*)(src + row * src_pitch)), shift), mask);
+    }
+    const __m128i value = _mm_packus_epi16(_mm_packs_epi32(rows[0], rows[1]), _mm_packs_epi32(rows[2], rows[3]));
+    __m128i min_value = _mm_min_epu8(value, _mm_srli_si128(value, 8));
+    __m128i max_value = _mm_max_epu8(value, _mm_srli_si128(value, 8));
+    min_value = _mm_min_epu8(min_value, _mm_srli_si128(min_value, 4));
+    max_value = _mm_max_epu8(max_value, _mm_srli_si128(max_value, 4));
+    min_value = _mm_min_epu8(min_value, _mm_srli_si128(min_value, 2));
+    max_value = _mm_max_epu8(max_value, _mm_srli_si128(max_value, 2));
+    min_value = _mm_min_epu8(min_value, _mm_srli_si128(min_value, 1));
+    max_value = _mm_max_epu8(max_value, _mm_srli_si128(max_value, 1));
+    low = _mm_cvtsi128_si32(min_value) & 0xff;
+    high = _mm_cvtsi128_si32(max_value) & 0xff;
+    _mm_storeu_si128((__m128i*)values, value);
+#else
+    for (int i = 0; i < 16; ++i) {
+        values[i] = src[(i >> 2) * src_pitch + (i & 3) * 4 + channel];
+        low = std::min<uint32_t>(low, values[i]);
+        high = std::max<uint32_t>(high, values[i]);
+    }
+#endif
+    block[0] = static_cast<uint8_t>(high);
+    block[1] = static_cast<uint8_t>(low);
+    if (low == high) {
+        memset(block + 2, 0, 6);
+        return 0;
+    }
+    // The eight levels in ascending order. Level t is stored as index 1 (t = 0), 0 (t = 7) or 8 - t.
+    uint8_t level[8];
+    for (uint32_t t = 0; t < 8; ++t) {
+        level[t] = static_cast<uint8_t>((t * high + (7 - t) * low + 3) / 7);
+    }
+    uint8_t indices[16];
+#ifdef FONT_SSE2
+    // Count the midpoints between neighbouring levels at or below each value.
+    __m128i steps = _mm_setzero_si128();
+    for (uint32_t t = 1; t < 8; ++t) {
+        const __m128i threshold = _mm_set1_epi8(static_cast<char>((level[t - 1] + level[t] + 1) >> 1));
+        steps = _mm_sub_epi8(steps, _mm_cmpeq_epi8(_mm_max_epu8(value, threshold), value));
+    }
+    _mm_storeu_si128((__m128i*)levels, steps);
+    __m128i index = _mm_and_si128(_mm_sub_epi8(_mm_set1_epi8(8), steps), _mm_set1_epi8(7));
+    const __m128i one = _mm_set1_epi8(1);
+    index = _mm_xor_si128(index, _mm_and_si128(_mm_cmpeq_epi8(_mm_min_epu8(index, one), index), one));
+    _mm_storeu_si128((__m128i*)indices, index);
+#else
+    for (int i = 0; i < 16; ++i) {
+        uint8_t t = 0;
+        while (t < 7 && values[i] >= ((level[t] + level[t + 1] + 1) >> 1)) {
+            ++t;
+        }
+        levels[i] = t;
+        indices[i] = t == 0 ? 1 : t == 7 ? 0 : static_cast<uint8_t>(8 - t);
+    }
+#endif
+    uint64_t bits = 0;
+    uint32_t error = 0;
+    for (int i = 0; i < 16; ++i) {
+        bits |= uint64_t(indices[i]) << (i * 3);
+        const int difference = int(values[i]) - level[levels[i]];
+        error += difference * difference;
+    }
+    for (int i = 0; i < 6; ++i) {
+        block[2 + i] = static_cast<uint8_t>(bits >> (i * 8));
+    }
+    return error;
+}
+
+int32_t SumAdvances(const int32_t* values, size_t count) {
+    size_t i = 0;
+    int32_t sum = 0;
+#ifdef FONT_SSE2
+    __m128i sums[2] = {_mm_setzero_si128(), _mm_setzero_si128()};
+    for (; i + 8 <= count; i += 8) {
+        sums[0] = _mm_add_epi32(sums[0], _mm_loadu_si128((const __m128i*)(values + i)));
+        sums[1] = _mm_add_epi32(sums[1], _mm_loadu_si128((const __m128i*)(values + i + 4)));
+    }
+    __m128i total = _mm_add_epi32(sums[0], sums[1]);
+    total = _mm_add_epi32(total, _mm_srli_si128(total, 8));
+    total = _mm_add_epi32(total, _mm_srli_si128(total, 4));
+    sum = _mm_cvtsi128_si32(total);
+#endif
+    for (; i < count; ++i) {
+        sum += values[i];
+    }
+    return sum;
+}
+
+}  // namespace Font
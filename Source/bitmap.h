@@ -0,0 +1,45 @@
+﻿#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+namespace Font {
+
+// Pixel conversion kernels shared by the glyph backends. Destinations are 8-bit
+// RGBA, pitches are in bytes and source and destination must not overlap.
+
+// Replicate 8-bit coverage into all four channels.
+void ExpandGrayToRGBA(uint8_t* dst, size_t dst_pitch, const uint8_t* src, size_t src_pitch, uint32_t width, uint32_t height);
+
+// Convert FreeType LCD output (three coverage bytes per pixel) into RGBA, alpha is the
+// strongest of the three subpixels. `bgr` swaps the red and blue subpixels.
+void ConvertLcdToRGBA(uint8_t* dst, size_t dst_pitch, const uint8_t* src, size_t src_pitch, uint32_t width, uint32_t height, bool bgr);
+
+// Same for FreeType LCD_V output, where each pixel spans three consecutive source rows.
+void ConvertLcdVerticalToRGBA(uint8_t* dst, size_t dst_pitch, const uint8_t* src, size_t src_pitch, uint32_t width, uint32_t height, bool bgr);
+
+// Swap the red and blue channels of premultiplied BGRA pixels, also works in place.
+void ConvertBGRAToRGBA(uint8_t* dst, size_t dst_pitch, const uint8_t* src, size_t src_pitch, uint32_t width, uint32_t height);
+
+// Composite `color` (straight RGBA) masked by 8-bit coverage over premultiplied RGBA in place.
+void BlendCoverageOver(uint8_t* dst, size_t dst_pitch, const uint8_t* coverage, size_t coverage_pitch, uint32_t width, uint32_t height, const uint8_t color[4]);
+
+// Composite premultiplied RGBA, multiplied channel by channel with the premultiplied `tint`, over
+// premultiplied RGBA in place. Coverage glyphs take the text color as tint, color glyphs its alpha.
+void BlendTintedOver(uint8_t* dst, size_t dst_pitch, const uint8_t* src, size_t src_pitch, uint32_t width, uint32_t height, const uint8_t tint[4]);
+
+// Composite the alpha of premultiplied RGBA, scaled by `opacity`, over 8-bit coverage in place.
+void BlendAlphaOver(uint8_t* dst, size_t dst_pitch, const uint8_t* src, size_t src_pitch, uint32_t width, uint32_t height, uint8_t opacity);
+
+// Resample premultiplied BGRA into RGBA of a different size. Shrinking averages every
+// source pixel under the destination pixel, enlarging interpolates bilinearly.
+void ScaleBGRAToRGBA(uint8_t* dst, size_t dst_pitch, uint32_t dst_width, uint32_t dst_height, const uint8_t* src, size_t src_pitch, uint32_t src_width, uint32_t src_height);
+
+// Encode one channel of a 4x4 block of RGBA pixels as an 8 byte BC4 block. The endpoints are the
+// block's extremes, so fully covered and empty pixels stay exact. Returns the summed squared error.
+uint32_t EncodeBC4Block(uint8_t block[8], const uint8_t* src, size_t src_pitch, uint32_t channel);
+
+// Sum of `count` 26.6 advances, four at a time.
+int32_t SumAdvances(const int32_t* values, size_t count);
+
+}  // namespace Font
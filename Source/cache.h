@@ -0,0 +1,215 @@
+﻿#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <iterator>
+#include <list>
+#include <unordered_map>
+
+namespace Font {
+
+// Byte budgeted cache with 2Q replacement. New entries enter a FIFO (A1in) holding a
+// quarter of the budget. Entries reaching its end move on to the main LRU (Am) if they
+// were requested again meanwhile; the others are dropped but leave their key in a ghost
+// list (A1out), and a key requested again while remembered there goes straight to Am.
+// A single pass over many new keys therefore cycles through A1in without displacing
+// the entries that are used over and over.
+template <typename Key, typename Value, typename Hash = std::hash<Key>>
+class TwoQueueCache {
+public:
+    typedef std::function<void(const Key&, Value&)> EvictCallback;
+
+    // 0 disables the budget.
+    explicit TwoQueueCache(size_t budget = 0) : budget_(budget) {}
+
+    // 0 disables the budget.
+    void SetBudget(size_t bytes) {
+        budget_ = bytes;
+        Trim();
+    }
+    size_t budget() const { return budget_; }
+    size_t bytes() const { return in_bytes_ + main_bytes_; }
+    size_t size() const { return entries_.size(); }
+    uint64_t hits() const { return hits_; }
+    uint64_t misses() const { return misses_; }
+    uint64_t evictions() const { return evictions_; }
+    // Called for every entry removed by the budget or EvictOne, not for Erase and Clear.
+    void SetEvictCallback(const EvictCallback& callback) { on_evict_ = callback; }
+
+    // Returns null on a miss, the pointer stays valid until the entry is removed.
+    Value* Find(const Key& key) {
+        auto iter = entries_.find(key);
+        if (iter == entries_.end()) {
+            ++misses_;
+            return nullptr;
+        }
+        ++hits_;
+        if (iter->second.main) {
+            main_.splice(main_.begin(), main_, iter->second.order);
+        } else {
+            iter->second.referenced = true;
+        }
+        return &iter->second.value;
+    }
+    // Look an entry up without counting it as a request.
+    Value* Peek(const Key& key) {
+        auto iter = entries_.find(key);
+        return iter == entries_.end() ? nullptr : &iter->second.value;
+    }
+    Value* Insert(const Key& key, const Value& value, size_t cost) {
+        Erase(key);
+        auto ghost = ghosts_.find(key);
+        const bool main = ghost != ghosts_.end();
+        if (main) {
+            ghost_order_.erase(ghost->second);
+            ghosts_.erase(ghost);
+        }
+        auto iter = entries_.emplace(key, Entry()).first;
+        Entry& entry = iter->second;
+        entry.value = value;
+        entry.cost = cost;
+        entry.main = main;
+        if (main) {
+            main_.push_front(&iter->first);
+            entry.order = main_.begin();
+            main_bytes_ += cost;
+        } else {
+            in_.push_front(&iter->first);
+            entry.order = in_.begin();
+            in_bytes_ += cost;
+        }
+        Trim(&iter->first);
+        return &entry.value;
+    }
+    bool Erase(const Key& key) {
+        auto iter = entries_.find(key);
+        if (iter == entries_.end()) {
+            return false;
+        }
+        Unlink(iter->second);
+        entries_.erase(iter);
+        return true;
+    }
+    // Evict the entry the policy would drop next, returns false when the cache is empty.
+    bool EvictOne() {
+        bool from_in = false;
+        const Key* victim = Victim(&from_in);
+        if (!victim) {
+            return false;
+        }
+        Evict(*victim, from_in);
+        return true;
+    }
+    void Clear() {
+        entries_.clear();
+        in_.clear();
+        main_.clear();
+        ghosts_.clear();
+        ghost_order_.clear();
+        in_bytes_ = main_bytes_ = 0;
+    }
+    template <typename Function>
+    void ForEach(Function function) {
+        for (auto& entry : entries_) {
+            function(entry.first, entry.second.value);
+        }
+    }
+
+private:
+    struct Entry {
+        Value value;
+        size_t cost = 0;
+        bool main = false;
+        // Requested again while in A1in.
+        bool referenced = false;
+        typename std::list<const Key*>::iterator order;
+    };
+    void Unlink(Entry& entry) {
+        if (entry.main) {
+            main_.erase(entry.order);
+            main_bytes_ -= entry.cost;
+        } else {
+            in_.erase(entry.order);
+            in_bytes_ -= entry.cost;
+        }
+    }
+    // A1in gives up entries while it is above its share of the budget, or when Am has nothing to give.
+    const Key* Victim(bool* from_in) {
+        while (!in_.empty() && (in_bytes_ * 4 > budget_ || main_.empty())) {
+            Entry& entry = entries_.find(*in_.back())->second;
+            if (!entry.referenced) {
+                *from_in = true;
+                return in_.back();
+            }
+            main_.splice(main_.begin(), in_, entry.order);
+            entry.main = true;
+            in_bytes_ -= entry.cost;
+            main_bytes_ += entry.cost;
+        }
+        *from_in = false;
+        return main_.empty() ? nullptr : main_.back();
+    }
+    void Evict(Key key, bool remember) {
+        if (remember) {
+            Remember(key);
+        }
+        auto iter = entries_.find(key);
+        Unlink(iter->second);
+        ++evictions_;
+        if (on_evict_) {
+            on_evict_(iter->first, iter->second.value);
+        }
+        entries_.erase(iter);
+    }
+    void Remember(const Key& key) {
+        ghost_order_.push_front(key);
+        ghosts_[key] = ghost_order_.begin();
+        // Remember about as many evicted keys as there are live entries.
+        const size_t limit = entries_.size() < 1024 ? 1024 : entries_.size();
+        while (ghost_order_.size() > limit) {
+            ghosts_.erase(ghost_order_.back());
+            ghost_order_.pop_back();
+        }
+    }
+    // `keep` is the entry being inserted, it is only evicted by a later insert. When the policy picks it,
+    // the next entry in line goes instead: the end of Am for an entry in A1in, the one in front of it in
+    // Am for an entry that came back from A1out and had referenced A1in entries promoted ahead of it.
+    void Trim(const Key* keep = nullptr) {
+        while (budget_ && bytes() > budget_) {
+            bool from_in = false;
+            const Key* victim = Victim(&from_in);
+            if (victim && victim == keep) {
+                if (from_in && !main_.empty()) {
+                    victim = main_.back();
+                    from_in = false;
+                } else if (!from_in && main_.size() > 1) {
+                    victim = *std::prev(main_.end(), 2);
+                } else if (!from_in && !in_.empty()) {
+                    victim = in_.back();
+                    from_in = true;
+                }
+            }
+            if (!victim || victim == keep) {
+                break;
+            }
+            Evict(*victim, from_in);
+        }
+    }
+
+    std::unordered_map<Key, Entry, Hash> entries_;
+    // Front is the most recent.
+    std::list<const Key*> in_;
+    std::list<const Key*> main_;
+    std::list<Key> ghost_order_;
+    std::unordered_map<Key, typename std::list<Key>::iterator, Hash> ghosts_;
+    size_t in_bytes_ = 0;
+    size_t main_bytes_ = 0;
+    size_t budget_ = 0;
+    uint64_t hits_ = 0;
+    uint64_t misses_ = 0;
+    uint64_t evictions_ = 0;
+    EvictCallback on_evict_;
+};
+
+}  // namespace Font
@@ -1,9 +1,88 @@
-﻿#include "font.h"
+﻿#include <atomic>
+#include <new>
+
+#include "font.h"
+#include "async.h"
+#include "atlas.h"
+#include "text.h"
+#include "paragraph.h"
 #include "freetype.h"
 #include "system.h"
 
 namespace Font {
 
+class GlyphBitmapBuffer {
+public:
+    static GlyphBitmapBuffer* Create(size_t size) {
+        void* memory = malloc(sizeof(GlyphBitmapBuffer) + size);
+        if (!memory) {
+            return nullptr;
+        }
+        return new (memory) GlyphBitmapBuffer();
+    }
+    void* data() { return this + 1; }
+    void Retain() { refs_.fetch_add(1, std::memory_order_relaxed); }
+    void Release() {
+        if (refs_.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+            this->~GlyphBitmapBuffer();
+            free(this);
+        }
+    }
+
+private:
+    GlyphBitmapBuffer() : refs_(1) {}
+    alignas(16) std::atomic<int> refs_;
+};
+
+GlyphBitmapInfo::GlyphBitmapInfo() {}
+GlyphBitmapInfo::GlyphBitmapInfo(const GlyphBitmapInfo& info)
+    : error_code(info.error_code),
+      data(info.data),
+      bearing_x(info.bearing_x),
+      bearing_y(info.bearing_y),
+      advance(info.advance),
+      advance_26_6(info.advance_26_6),
+      width(info.width),
+      height(info.height),
+      emoji(info.emoji),
+      buffer_(info.buffer_) {
+    if (buffer_) {
+        buffer_->Retain();
+    }
+}
+GlyphBitmapInfo::~GlyphBitmapInfo() { Release(); }
+GlyphBitmapInfo& GlyphBitmapInfo::operator=(const GlyphBitmapInfo& info) {
+    if (this == &info) return *this;
+    if (info.buffer_) {
+        info.buffer_->Retain();
+    }
+    Release();
+    error_code = info.error_code;
+    data = info.data;
+    bearing_x = info.bearing_x;
+    bearing_y = info.bearing_y;
+    advance = info.advance;
+    advance_26_6 = info.advance_26_6;
+    width = info.width;
+    height = info.height;
+    emoji = info.emoji;
+    buffer_ = info.buffer_;
+    return *this;
+}
+void* GlyphBitmapInfo::Allocate(size_t size) {
+    Release();
+    buffer_ = GlyphBitmapBuffer::Create(size);
+    data = buffer_ ? buffer_->data() : 0;
+    return data;
+}
+void GlyphBitmapInfo::Release() {
+    if (buffer_) {
+        buffer_->Release();
+        buffer_ = nullptr;
+        data = 0;
+    }
+}
+
 String::String() {
     m_data = new char[1];
     m_data[0] = '\0';
@@ -40,14 +119,38 @@ const char* String::data() const { return m_data; }
 const size_t String::size() const { return m_size; }
 
 FontInfo* CreateFont(const String& name, uint32_t size) { return GetFreetypeFontInstance().Create(name.data(), size); }
-void DestroyFont(FontInfo* font) { GetFreetypeFontInstance().Destroy(font); }
+void DestroyFont(FontInfo* font) {
+    GetGlyphRequestQueue().Cancel(font);
+    RemoveTextCaches(font);
+    GetFreetypeFontInstance().Destroy(font);
+}
+void SetFontVariation(FontInfo* font, uint32_t tag, float value) {
+    for (size_t i = 0; i < font->variations.size(); i++) {
+        if (font->variations[i].tag == tag) {
+            font->variations[i].value = value;
+            return;
+        }
+    }
+    font->variations.add({tag, value});
+}
 String LoadTTFFont(void* ttf_data, uint32_t size) {
     std::string name = GetFreetypeFontInstance().Load(ttf_data, size);
+    // New faces of a family can take over characters of cached runs and words.
+    ClearTextCaches();
     return String(name.c_str());
 }
+void SetLcdFilter(LcdFilter filter) {
+    GetFreetypeFontInstance().SetLcdFilter(filter);
+    ClearTextCaches();
+}
+void SetMaxOpenFaces(uint32_t count) { GetFreetypeFontInstance().SetMaxOpenFaces(count); }
+void SetMaxFreetypeMemory(size_t bytes) { GetFreetypeFontInstance().SetMaxFreetypeMemory(bytes); }
+FacePoolStats GetFacePoolStats() { return GetFreetypeFontInstance().GetFacePoolStats(); }
+void SetGlyphCacheBudget(size_t bytes) { GetFreetypeFontInstance().SetGlyphCacheBudget(bytes); }
+GlyphCacheStats GetGlyphCacheStats() { return GetFreetypeFontInstance().GetGlyphCacheStats(); }
 
-LinkedList<GlyphBitmapInfo> GetGlyphBitmapInfoFreetype(FontInfo* font, uint32_t char_code) {
-    auto freetype = GetFreetypeFontInstance().GetGlyphBitmap(font, char_code);
+LinkedList<GlyphBitmapInfo> GetGlyphBitmapInfoFreetype(FontInfo* font, uint32_t char_code, float origin_x) {
+    auto freetype = GetFreetypeFontInstance().GetGlyphBitmap(font, char_code, origin_x);
     if (freetype.size()) {
         return freetype;
     }
@@ -63,8 +166,8 @@ LinkedList<GlyphBitmapInfo> GetGlyphBitmapInfoSystem(FontInfo* font, uint32_t ch
     return result;
 }
 
-LinkedList<GlyphBitmapInfo> GetGlyphBitmapInfo(FontInfo* font, uint32_t char_code) {
-    auto res = GetGlyphBitmapInfoFreetype(font, char_code);
+LinkedList<GlyphBitmapInfo> GetGlyphBitmapInfo(FontInfo* font, uint32_t char_code, float origin_x) {
+    auto res = GetGlyphBitmapInfoFreetype(font, char_code, origin_x);
     if (res.size()) {
         return res;
     }
@@ -72,4 +175,87 @@ LinkedList<GlyphBitmapInfo> GetGlyphBitmapInfo(FontInfo* font, uint32_t char_cod
     newFont.size = -newFont.size;
     return GetGlyphBitmapInfoSystem(&newFont, char_code, true, true);
 }
+
+void ReleaseGlyph(GlyphBitmapInfo& glyph) { glyph.Release(); }
+
+bool RenderGlyphBitmap(FontInfo* font, uint32_t char_code, float origin_x, GlyphPixelFormat format, GlyphTargetCallback target, void* user_data, GlyphBitmapInfo* glyph) {
+    return GetFreetypeFontInstance().RenderGlyphBitmap(font, char_code, origin_x, format, target, user_data, glyph);
+}
+int32_t GetKerning(FontInfo* font, uint32_t left, uint32_t right) { return GetFreetypeFontInstance().GetKerning(*font, left, right); }
+GlyphBitmapInfo RenderTextRun(FontInfo* font, const char* utf8, const TextRunOptions& options) { return GetTextRunCache().Render(font, utf8, options); }
+void SetTextRunCacheBudget(size_t bytes) { GetTextRunCache().SetBudget(bytes); }
+TextRunCacheStats GetTextRunCacheStats() { return GetTextRunCache().GetStats(); }
+void SetWordCacheBudget(size_t bytes) { GetWordLayoutCache().SetBudget(bytes); }
+WordCacheStats GetWordCacheStats() { return GetWordLayoutCache().GetStats(); }
+TextMetrics MeasureText(FontInfo* font, const char* utf8, bool kerning) {
+    std::vector<uint32_t> chars = DecodeUtf8(utf8);
+    return MeasureChars(font, chars.data(), chars.size(), kerning);
+}
+TextMetrics MeasureText(FontInfo* font, const uint32_t* chars, size_t count, bool kerning) { return MeasureChars(font, chars, count, kerning); }
+
+ParagraphLayout* CreateParagraphLayout(FontInfo* font, int32_t width_26_6, bool kerning) { return new ParagraphLayout(font, width_26_6, kerning); }
+void DestroyParagraphLayout(ParagraphLayout* paragraph) { delete paragraph; }
+void SetParagraphText(ParagraphLayout* paragraph, const char* utf8) { paragraph->SetText(DecodeUtf8(utf8)); }
+void EditParagraphText(ParagraphLayout* paragraph, uint32_t start, uint32_t remove, const char* utf8) { paragraph->Edit(start, remove, DecodeUtf8(utf8)); }
+void SetParagraphWidth(ParagraphLayout* paragraph, int32_t width_26_6) { paragraph->SetWidth(width_26_6); }
+const LineBox* GetParagraphLines(ParagraphLayout* paragraph, uint32_t* count) {
+    *count = static_cast<uint32_t>(paragraph->GetLines().size());
+    return paragraph->GetLines().data();
+}
+const ParagraphGlyph* GetParagraphGlyphs(ParagraphLayout* paragraph, uint32_t* count) {
+    *count = static_cast<uint32_t>(paragraph->GetGlyphs().size());
+    return paragraph->GetGlyphs().data();
+}
+ParagraphStats GetParagraphStats(ParagraphLayout* paragraph) { return paragraph->GetStats(); }
+CaretPosition GetParagraphCaret(ParagraphLayout* paragraph, uint32_t index) { return paragraph->GetCaret(index); }
+uint32_t HitTestParagraph(ParagraphLayout* paragraph, int32_t x_26_6, int32_t y_26_6) { return paragraph->HitTest(x_26_6, y_26_6); }
+LinkedList<SelectionRect> GetParagraphSelection(ParagraphLayout* paragraph, uint32_t start, uint32_t end) { return paragraph->GetSelection(start, end); }
+
+DocumentLayout* LayoutDocument(FontInfo* font, const char* utf8, int32_t width_26_6, uint32_t threads, bool kerning) { return new DocumentLayout(font, DecodeUtf8(utf8), width_26_6, threads, kerning); }
+void DestroyDocumentLayout(DocumentLayout* document) { delete document; }
+const LineBox* GetDocumentLines(DocumentLayout* document, uint32_t* count) {
+    *count = static_cast<uint32_t>(document->GetLines().size());
+    return document->GetLines().data();
+}
+const ParagraphGlyph* GetDocumentGlyphs(DocumentLayout* document, uint32_t* count) {
+    *count = static_cast<uint32_t>(document->GetGlyphs().size());
+    return document->GetGlyphs().data();
+}
+DocumentStats GetDocumentStats(DocumentLayout* document) { return document->GetStats(); }
+
+GlyphRequest* RequestGlyphBitmapInfo(FontInfo* font, uint32_t char_code, float origin_x, GlyphRequestCallback callback, void* user_data) { return GetGlyphRequestQueue().Submit(font, char_code, origin_x, callback, user_data); }
+GlyphRequestState PollGlyphRequest(GlyphRequest* request, LinkedList<GlyphBitmapInfo>* glyphs) { return GetGlyphRequestQueue().Poll(request, glyphs); }
+LinkedList<GlyphBitmapInfo> WaitGlyphRequest(GlyphRequest* request) { return GetGlyphRequestQueue().Wait(request); }
+void ReleaseGlyphRequest(GlyphRequest* request) { GetGlyphRequestQueue().Release(request); }
+void SetGlyphWorkers(uint32_t count, uint64_t affinity_mask) { GetGlyphRequestQueue().SetWorkers(count, affinity_mask); }
+
+GlyphPrewarm* PrewarmGlyphs(FontInfo* font, const LinkedList<CharRange>& ranges, const LinkedList<uint32_t>& sizes) {
+    std::vector<uint32_t> char_codes;
+    for (size_t i = 0; i < ranges.size(); i++) {
+        for (uint64_t char_code = ranges[i].first; char_code <= ranges[i].last; char_code++) {
+            char_codes.push_back(static_cast<uint32_t>(char_code));
+        }
+    }
+    std::vector<uint32_t> size_list;
+    for (size_t i = 0; i < sizes.size(); i++) {
+        size_list.push_back(sizes[i]);
+    }
+    return GetFreetypeFontInstance().Prewarm(font, char_codes, size_list);
+}
+PrewarmProgress GetPrewarmProgress(GlyphPrewarm* prewarm) { return prewarm->GetProgress(); }
+void WaitPrewarm(GlyphPrewarm* prewarm) { prewarm->Wait(); }
+void ReleasePrewarm(GlyphPrewarm* prewarm) { delete prewarm; }
+bool SetUsageProfile(const String& path, uint32_t warm_count) { return GetFreetypeFontInstance().SetUsageProfile(path.data(), warm_count); }
+bool SaveUsageProfile() { return GetFreetypeFontInstance().SaveUsageProfile(); }
+
+GlyphAtlas* CreateGlyphAtlas(uint32_t page_width, uint32_t page_height, uint32_t max_pages, AtlasFormat format) { return new GlyphAtlas(page_width, page_height, max_pages, format); }
+void DestroyGlyphAtlas(GlyphAtlas* atlas) { delete atlas; }
+bool GetAtlasGlyph(GlyphAtlas* atlas, FontInfo* font, uint32_t char_code, float origin_x, AtlasGlyph* glyph) { return atlas->GetGlyph(font, char_code, origin_x, glyph); }
+void SetAtlasInvalidateCallback(GlyphAtlas* atlas, AtlasInvalidateCallback callback, void* user_data) { atlas->SetInvalidateCallback(callback, user_data); }
+uint32_t GetAtlasPageCount(GlyphAtlas* atlas) { return atlas->GetPageCount(); }
+const void* GetAtlasPageData(GlyphAtlas* atlas, uint32_t page) { return atlas->GetPageData(page); }
+AtlasStats GetAtlasStats(GlyphAtlas* atlas) { return atlas->GetStats(); }
+LinkedList<AtlasUpload> CollectAtlasUploads(GlyphAtlas* atlas, uint32_t row_alignment) { return atlas->CollectUploads(row_alignment); }
+bool SetAtlasCompression(GlyphAtlas* atlas, AtlasCompression compression) { return atlas->SetCompression(compression); }
+bool CompactAtlas(GlyphAtlas* atlas, double time_budget_ms, LinkedList<AtlasRemap>* remaps) { return atlas->Compact(time_budget_ms, remaps); }
 }  // namespace Font
\ No newline at end of file
@@ -145,7 +145,9 @@ public:
             node->_next = nullptr;
             node->_prev = nullptr;
             --_size;
-            return node->_value;
+            T value = node->_value;
+            delete node;
+            return value;
         } else {
             throw ListNodeException("LinkedList :: remove(index)");
         }
@@ -263,11 +265,45 @@ struct FONT_PORT SystemFontInfo {
 template class FONT_PORT LinkedList<SystemFontInfo>;
 FONT_PORT LinkedList<SystemFontInfo>& GetSystemFonts(bool refresh = false);
 
+enum class FONT_PORT GlyphRenderMode {
+    Gray = 0,
+    // Subpixel coverage for horizontal stripe panels, red/green/blue land in the RGB channels.
+    LcdRGB,
+    LcdBGR,
+    // Subpixel coverage for vertical stripe panels.
+    LcdVerticalRGB,
+    LcdVerticalBGR,
+};
+
+enum class FONT_PORT LcdFilter {
+    None = 0,
+    Default,
+    Light,
+    Legacy,
+};
+
+// OpenType tag such as the 'wght', 'wdth' or 'opsz' variation axes.
+constexpr uint32_t MakeFontTag(char a, char b, char c, char d) { return (uint32_t(uint8_t(a)) << 24) | (uint32_t(uint8_t(b)) << 16) | (uint32_t(uint8_t(c)) << 8) | uint32_t(uint8_t(d)); }
+
+struct FONT_PORT FontVariation {
+    uint32_t tag;
+    // Design coordinate, clamped to the axis range of the face.
+    float value;
+};
+
+template class FONT_PORT LinkedList<FontVariation>;
 struct FONT_PORT FontInfo {
     String name;
     int size;
     bool bold;
     bool italic;
+    // Number of horizontal subpixel positions glyphs are rendered at, 1 renders at integer origins only.
+    uint32_t subpixel_phases = 1;
+    GlyphRenderMode render_mode = GlyphRenderMode::Gray;
+    // CPAL palette used for layered (COLR) color glyphs, out of range indices use the first palette.
+    uint32_t palette_index = 0;
+    // Axis coordinates for variable fonts, axes not listed keep their default (or bold/italic) value.
+    LinkedList<FontVariation> variations;
 };
 
 enum class FONT_PORT GlyphErrorCode {
@@ -276,25 +312,416 @@ enum class FONT_PORT GlyphErrorCode {
     NoBitmapData,
 };
 
+class GlyphBitmapBuffer;
+
+// Glyph pixels are reference counted: copying a GlyphBitmapInfo only shares the
+// pixel buffer, and the buffer is freed when the last copy is destroyed or released.
 struct FONT_PORT GlyphBitmapInfo {
+    GlyphBitmapInfo();
+    GlyphBitmapInfo(const GlyphBitmapInfo& info);
+    ~GlyphBitmapInfo();
+    GlyphBitmapInfo& operator=(const GlyphBitmapInfo& info);
+
+    // Replace the pixel buffer with a new one of `size` bytes owned by this glyph.
+    void* Allocate(size_t size);
+    // Drop this glyph's reference to its pixels, `data` is null afterwards.
+    void Release();
+
     GlyphErrorCode error_code = GlyphErrorCode::Success;
     void* data = 0;
     int bearing_x = 0;
     int bearing_y = 0;
     int advance = 0;
+    // Unrounded advance in 26.6 fixed point, accumulate this to avoid rounding drift.
+    int advance_26_6 = 0;
     unsigned int width = 0;
     unsigned int height = 0;
     bool emoji = false;
+
+private:
+    GlyphBitmapBuffer* buffer_ = nullptr;
 };
 
 FONT_PORT FontInfo* CreateFont(const String& name, uint32_t size);
+// Cancels the font's pending glyph requests.
 FONT_PORT void DestroyFont(FontInfo* font);
+// Set or replace one variation axis coordinate of the font.
+FONT_PORT void SetFontVariation(FontInfo* font, uint32_t tag, float value);
 FONT_PORT String LoadTTFFont(void* ttf_data, uint32_t size);
+// Filter applied to LCD render modes to reduce color fringes, shared by all fonts.
+FONT_PORT void SetLcdFilter(LcdFilter filter);
+struct FONT_PORT FacePoolStats {
+    uint32_t open_faces = 0;
+    // Bytes currently allocated by FreeType, open faces and their glyph slots included.
+    size_t freetype_memory = 0;
+    // Faces opened so far, reopening an evicted face counts again.
+    uint64_t opened = 0;
+    // Faces closed to stay within the limits.
+    uint64_t evicted = 0;
+};
+
+// Faces are opened on first use, keep at most this many open and close the least recently used ones, 0 is unlimited.
+FONT_PORT void SetMaxOpenFaces(uint32_t count);
+// Close least recently used faces while FreeType holds more than `bytes`, 0 is unlimited.
+FONT_PORT void SetMaxFreetypeMemory(size_t bytes);
+FONT_PORT FacePoolStats GetFacePoolStats();
+
+struct FONT_PORT GlyphCacheStats {
+    uint32_t glyphs = 0;
+    size_t bytes = 0;
+    uint64_t hits = 0;
+    uint64_t misses = 0;
+    uint64_t evictions = 0;
+};
+
+// Byte budget of the FreeType glyph cache (64 MiB by default, 0 is unlimited). Eviction uses 2Q, so glyphs
+// seen once (a pass over a long document) are dropped before glyphs that keep being requested.
+FONT_PORT void SetGlyphCacheBudget(size_t bytes);
+FONT_PORT GlyphCacheStats GetGlyphCacheStats();
 
 template class FONT_PORT LinkedList<GlyphBitmapInfo>;
 
-FONT_PORT LinkedList<GlyphBitmapInfo> GetGlyphBitmapInfoFreetype(FontInfo* font, uint32_t char_code);
+// `origin_x` is the pen position in pixels, its fractional part selects one of the font's subpixel phases.
+// The glyph is drawn at floor(origin_x) + bearing_x.
+FONT_PORT LinkedList<GlyphBitmapInfo> GetGlyphBitmapInfoFreetype(FontInfo* font, uint32_t char_code, float origin_x = 0.0f);
 FONT_PORT LinkedList<GlyphBitmapInfo> GetGlyphBitmapInfoSystem(FontInfo* font, uint32_t char_code, bool enbaleRemap, bool enableFallback);
-FONT_PORT LinkedList<GlyphBitmapInfo> GetGlyphBitmapInfo(FontInfo* font, uint32_t char_code);
+FONT_PORT LinkedList<GlyphBitmapInfo> GetGlyphBitmapInfo(FontInfo* font, uint32_t char_code, float origin_x = 0.0f);
+FONT_PORT void ReleaseGlyph(GlyphBitmapInfo& glyph);
+
+enum class FONT_PORT GlyphPixelFormat {
+    // Premultiplied, as GetGlyphBitmapInfo returns them.
+    RGBA = 0,
+    BGRA,
+    // Coverage only, one byte per pixel. Color glyphs are reduced to their alpha.
+    Alpha8,
+};
+
+// Asked for the destination of a `width` x `height` glyph: returns where its top left pixel goes and sets
+// `pitch` to the bytes between rows, or returns null to skip the pixels. A pitch below a row of the
+// glyph in the target format fails the render.
+typedef void* (*GlyphTargetCallback)(void* user_data, uint32_t width, uint32_t height, uint32_t* pitch);
+
+// Like GetGlyphBitmapInfoFreetype, but the pixels are written straight into memory `target` hands out
+// (an atlas page, a texture mapping) and the glyph cache is bypassed. Plain grayscale outlines are rasterized
+// directly into the destination, in RGBA and BGRA straight from the rasterizer's spans. `glyph` receives
+// the metrics, its data stays null.
+FONT_PORT bool RenderGlyphBitmap(FontInfo* font, uint32_t char_code, float origin_x, GlyphPixelFormat format, GlyphTargetCallback target, void* user_data, GlyphBitmapInfo* glyph);
+
+// Horizontal kerning between two characters in 26.6, from the GPOS 'kern' feature or the legacy kern table.
+// 0 unless one face of the font has both. Each face's pairs are read once, a lookup is a hash probe.
+FONT_PORT int32_t GetKerning(FontInfo* font, uint32_t left, uint32_t right);
+
+struct FONT_PORT TextRunOptions {
+    // Straight RGBA text color. Grayscale glyphs are drawn in it, color glyphs only take its alpha.
+    uint8_t color[4] = {255, 255, 255, 255};
+    // Straight RGBA fill behind the text, transparent by default.
+    uint8_t background[4] = {0, 0, 0, 0};
+    // Alpha8 returns the coverage of the text, color and background then only contribute their alpha.
+    GlyphPixelFormat format = GlyphPixelFormat::RGBA;
+    bool kerning = true;
+};
+
+// Lay out one line of UTF-8 text with the font's advances and kerning and draw it into a single bitmap,
+// glyphs come through the glyph cache. Like a glyph, the bitmap is drawn at the origin plus bearing_x and
+// minus bearing_y, and advance_26_6 is the pen movement of the whole run.
+FONT_PORT GlyphBitmapInfo RenderTextRun(FontInfo* font, const char* utf8, const TextRunOptions& options = TextRunOptions());
+
+struct FONT_PORT TextRunCacheStats {
+    uint32_t runs = 0;
+    size_t bytes = 0;
+    uint64_t hits = 0;
+    uint64_t misses = 0;
+    uint64_t evictions = 0;
+};
+
+// Keep up to `bytes` of RenderTextRun results (2Q eviction), so a repeated label costs one lookup and shares
+// the pixels of the first call. Off (0) by default. Runs are keyed by font, string, size and options.
+FONT_PORT void SetTextRunCacheBudget(size_t bytes);
+FONT_PORT TextRunCacheStats GetTextRunCacheStats();
+
+struct FONT_PORT WordCacheStats {
+    uint32_t words = 0;
+    size_t bytes = 0;
+    uint64_t hits = 0;
+    uint64_t misses = 0;
+    uint64_t evictions = 0;
+};
+
+// Text is laid out word by word, words seen before reuse their character positions instead of looking up
+// every advance and kerning pair again. Byte budget of those layouts, 1 MiB by default, 0 turns them off.
+FONT_PORT void SetWordCacheBudget(size_t bytes);
+FONT_PORT WordCacheStats GetWordCacheStats();
+
+struct FONT_PORT TextMetrics {
+    // Pen advance of the text, as RenderTextRun would lay it out.
+    int32_t width_26_6 = 0;
+    int width = 0;
+    // Of the font's first face at its size, all positive: ascent above the baseline, descent below it and the
+    // extra gap between lines.
+    int32_t ascent_26_6 = 0;
+    int32_t descent_26_6 = 0;
+    int32_t line_gap_26_6 = 0;
+};
+
+// Measure one line of text without rendering it. Advances and kerning pairs are looked up once per font
+// setup and size and then read from a table, line metrics are read once per size.
+FONT_PORT TextMetrics MeasureText(FontInfo* font, const char* utf8, bool kerning = true);
+FONT_PORT TextMetrics MeasureText(FontInfo* font, const uint32_t* chars, size_t count, bool kerning = true);
+
+struct FONT_PORT LineBox {
+    // Characters of the line in the paragraph text, trailing spaces and the line break included.
+    uint32_t start = 0;
+    uint32_t length = 0;
+    // The line's glyphs in GetParagraphGlyphs.
+    uint32_t glyph_start = 0;
+    uint32_t glyph_count = 0;
+    // Advance up to the trailing spaces, 26.6.
+    int32_t width_26_6 = 0;
+    // Down from the top of the paragraph, 26.6.
+    int32_t top_26_6 = 0;
+    int32_t baseline_26_6 = 0;
+};
+
+struct FONT_PORT ParagraphGlyph {
+    uint32_t char_code = 0;
+    // Character index relative to the start of its line.
+    uint32_t offset = 0;
+    // Pen position of the glyph's origin right of the line's left edge, 26.6.
+    int32_t x_26_6 = 0;
+};
+
+struct FONT_PORT ParagraphStats {
+    uint32_t lines = 0;
+    uint32_t glyphs = 0;
+    int32_t height_26_6 = 0;
+    // Lines filled anew and lines taken over unchanged by the last change of text or width.
+    uint32_t lines_laid_out = 0;
+    uint32_t lines_reused = 0;
+};
+
+// A paragraph of editable text broken into lines of at most `width_26_6` (0 only breaks at line breaks),
+// following the UAX #14 line breaking rules. Edits re-flow the lines they affect and keep the others, so
+// a keystroke costs about a line. Break characters again with SetParagraphText after loading fonts.
+// Destroy it before its font, it is not thread safe.
+class ParagraphLayout;
+FONT_PORT ParagraphLayout* CreateParagraphLayout(FontInfo* font, int32_t width_26_6, bool kerning = true);
+FONT_PORT void DestroyParagraphLayout(ParagraphLayout* paragraph);
+FONT_PORT void SetParagraphText(ParagraphLayout* paragraph, const char* utf8);
+// Replace `remove` characters (code points) at `start` with `utf8`.
+FONT_PORT void EditParagraphText(ParagraphLayout* paragraph, uint32_t start, uint32_t remove, const char* utf8);
+FONT_PORT void SetParagraphWidth(ParagraphLayout* paragraph, int32_t width_26_6);
+// The lines and glyphs as arrays, valid until the paragraph next changes.
+FONT_PORT const LineBox* GetParagraphLines(ParagraphLayout* paragraph, uint32_t* count);
+FONT_PORT const ParagraphGlyph* GetParagraphGlyphs(ParagraphLayout* paragraph, uint32_t* count);
+FONT_PORT ParagraphStats GetParagraphStats(ParagraphLayout* paragraph);
+
+struct FONT_PORT CaretPosition {
+    uint32_t index = 0;
+    uint32_t line = 0;
+    // Left edge of the caret from the line's left edge, and the line's box, 26.6.
+    int32_t x_26_6 = 0;
+    int32_t top_26_6 = 0;
+    int32_t height_26_6 = 0;
+};
+
+struct FONT_PORT SelectionRect {
+    uint32_t line = 0;
+    int32_t left_26_6 = 0;
+    int32_t right_26_6 = 0;
+    int32_t top_26_6 = 0;
+    int32_t bottom_26_6 = 0;
+};
+
+template class FONT_PORT LinkedList<SelectionRect>;
+// Paragraphs keep a prefix sum index of their advances, so carets, hit tests and selections take O(log n)
+// however long the line, and edits replacing as many characters as they remove update it in O(log n).
+// Caret before character `index`; an index where a line wraps is placed at the start of the next line.
+FONT_PORT CaretPosition GetParagraphCaret(ParagraphLayout* paragraph, uint32_t index);
+// Character index of the caret position nearest to a point, relative to the paragraph's top left, 26.6.
+FONT_PORT uint32_t HitTestParagraph(ParagraphLayout* paragraph, int32_t x_26_6, int32_t y_26_6);
+// A rectangle per line covered by the characters [start, end).
+FONT_PORT LinkedList<SelectionRect> GetParagraphSelection(ParagraphLayout* paragraph, uint32_t start, uint32_t end);
+
+struct FONT_PORT DocumentStats {
+    uint32_t paragraphs = 0;
+    uint32_t lines = 0;
+    uint32_t glyphs = 0;
+    int32_t height_26_6 = 0;
+    uint32_t threads = 0;
+    // Paragraphs a worker took from another worker's share.
+    uint32_t steals = 0;
+    // Wall time of laying out the paragraphs and of joining their lines.
+    double layout_ms = 0;
+    double stitch_ms = 0;
+};
+
+// Lay out a whole document at once, paragraphs (text between line breaks) concurrently on `threads` threads
+// (0 uses every hardware thread). The lines and glyphs come out as from one ParagraphLayout of the whole
+// text, in document order.
+class DocumentLayout;
+FONT_PORT DocumentLayout* LayoutDocument(FontInfo* font, const char* utf8, int32_t width_26_6, uint32_t threads = 0, bool kerning = true);
+FONT_PORT void DestroyDocumentLayout(DocumentLayout* document);
+FONT_PORT const LineBox* GetDocumentLines(DocumentLayout* document, uint32_t* count);
+FONT_PORT const ParagraphGlyph* GetDocumentGlyphs(DocumentLayout* document, uint32_t* count);
+FONT_PORT DocumentStats GetDocumentStats(DocumentLayout* document);
+
+enum class FONT_PORT GlyphRequestState {
+    Pending = 0,
+    Ready,
+    // The font was destroyed before the glyph was rendered.
+    Cancelled,
+};
+
+// Handle to a glyph rendered on a worker thread, release it with ReleaseGlyphRequest.
+class GlyphRequest;
+// Runs on the worker thread that finished (or the thread that cancelled) the request.
+typedef void (*GlyphRequestCallback)(void* user_data, GlyphRequestState state, const LinkedList<GlyphBitmapInfo>& glyphs);
+
+// Queue GetGlyphBitmapInfo on the worker pool, requests for a glyph already in flight share its work.
+// `font` is copied, changes made to it afterwards do not affect the request.
+FONT_PORT GlyphRequest* RequestGlyphBitmapInfo(FontInfo* font, uint32_t char_code, float origin_x = 0.0f, GlyphRequestCallback callback = nullptr, void* user_data = nullptr);
+// Never blocks, `glyphs` is filled in once the request is Ready.
+FONT_PORT GlyphRequestState PollGlyphRequest(GlyphRequest* request, LinkedList<GlyphBitmapInfo>* glyphs);
+// Block until the request is Ready or Cancelled, cancelled requests return no glyphs.
+FONT_PORT LinkedList<GlyphBitmapInfo> WaitGlyphRequest(GlyphRequest* request);
+// The request's callback will not run after this returns.
+FONT_PORT void ReleaseGlyphRequest(GlyphRequest* request);
+// Number of worker threads (0 is one less than the hardware threads) and the CPUs they may run on (0 is any).
+FONT_PORT void SetGlyphWorkers(uint32_t count, uint64_t affinity_mask = 0);
+
+struct FONT_PORT CharRange {
+    uint32_t first;
+    // Inclusive.
+    uint32_t last;
+};
+
+template class FONT_PORT LinkedList<CharRange>;
+template class FONT_PORT LinkedList<uint32_t>;
+
+struct FONT_PORT PrewarmProgress {
+    // Characters rendered so far, counted once per size and subpixel phase.
+    uint32_t done = 0;
+    uint32_t total = 0;
+    bool finished = false;
+    // A rendering thread could not create its FreeType library. The others take over its share,
+    // if none could, `done` stops short of `total`.
+    bool failed = false;
+};
+
+// Handle to glyphs being rendered ahead of use, release it with ReleasePrewarm.
+class GlyphPrewarm;
+// Render every character of `ranges` at each of `sizes` and every subpixel phase of `font` into the
+// FreeType glyph cache, spread across all cores. Returns immediately.
+FONT_PORT GlyphPrewarm* PrewarmGlyphs(FontInfo* font, const LinkedList<CharRange>& ranges, const LinkedList<uint32_t>& sizes);
+FONT_PORT PrewarmProgress GetPrewarmProgress(GlyphPrewarm* prewarm);
+FONT_PORT void WaitPrewarm(GlyphPrewarm* prewarm);
+// Stops unfinished work, glyphs already rendered stay cached.
+FONT_PORT void ReleasePrewarm(GlyphPrewarm* prewarm);
+
+// Count glyph requests per font and size, merge in the counts an earlier run saved to `path` and render
+// the `warm_count` most requested glyphs in the background as soon as their fonts are loaded.
+// The counts are written back to `path` by SaveUsageProfile and when the library shuts down.
+// Returns whether a saved profile was read, an empty path stops recording.
+FONT_PORT bool SetUsageProfile(const String& path, uint32_t warm_count = 4096);
+FONT_PORT bool SaveUsageProfile();
+
+struct FONT_PORT AtlasRect {
+    uint32_t page = 0;
+    uint32_t x = 0;
+    uint32_t y = 0;
+    uint32_t width = 0;
+    uint32_t height = 0;
+    // Channel (0 red to 3 alpha) holding the glyph's coverage in a ChannelPacked atlas, 0 otherwise.
+    uint32_t channel = 0;
+};
+
+struct FONT_PORT AtlasGlyph {
+    GlyphErrorCode error_code = GlyphErrorCode::Success;
+    // Empty for glyphs without pixels such as spaces.
+    AtlasRect rect;
+    int bearing_x = 0;
+    int bearing_y = 0;
+    int advance = 0;
+    int advance_26_6 = 0;
+    bool emoji = false;
+};
+
+struct FONT_PORT AtlasStats {
+    uint32_t glyphs = 0;
+    uint32_t pages = 0;
+    // Page area taken by glyphs and their padding, in bytes.
+    size_t used_bytes = 0;
+    uint64_t evictions = 0;
+    // Block compression work done by CollectAtlasUploads: 4x4 blocks encoded (per channel), the time
+    // it took and the mean squared error per encoded pixel.
+    uint64_t encoded_blocks = 0;
+    double encode_ms = 0;
+    double encode_error = 0;
+};
+
+// Called with the area of every glyph evicted from an atlas, quads sampling it must be rebuilt.
+typedef void (*AtlasInvalidateCallback)(void* user_data, const AtlasRect& rect);
+
+enum class FONT_PORT AtlasFormat {
+    // Glyphs are stored as the premultiplied RGBA bitmaps GetGlyphBitmapInfo returns.
+    RGBA = 0,
+    // Every channel of the RGBA pages is a separate plane holding the coverage of different glyphs,
+    // four times the glyphs per page. Only grayscale glyphs fit, color and LCD glyphs are refused.
+    ChannelPacked,
+};
+
+enum class FONT_PORT AtlasCompression {
+    // Uploads carry RGBA pixels.
+    None = 0,
+    // Uploads carry BC4 blocks (8 bytes per 4x4 pixels), one upload per channel plane of a ChannelPacked
+    // atlas, the alpha channel of an RGBA atlas.
+    BC4,
+    // Uploads carry BC5 blocks (16 bytes per 4x4 pixels) of a ChannelPacked atlas, red and green
+    // planes in the upload of channel 0, blue and alpha in that of channel 2.
+    BC5,
+};
+
+// Glyphs packed into RGBA pages of a fixed size, at most `max_pages` of them. Once they are full the
+// least valuable glyphs (2Q, like the glyph cache) are evicted and their slots reused.
+class GlyphAtlas;
+FONT_PORT GlyphAtlas* CreateGlyphAtlas(uint32_t page_width = 2048, uint32_t page_height = 2048, uint32_t max_pages = 4, AtlasFormat format = AtlasFormat::RGBA);
+FONT_PORT void DestroyGlyphAtlas(GlyphAtlas* atlas);
+// Find the glyph in the atlas, rendering and packing it first if needed. `origin_x` works as for GetGlyphBitmapInfo.
+// Returns false if the font has no such glyph, it is larger than a page or the atlas format cannot hold it.
+FONT_PORT bool GetAtlasGlyph(GlyphAtlas* atlas, FontInfo* font, uint32_t char_code, float origin_x, AtlasGlyph* glyph);
+FONT_PORT void SetAtlasInvalidateCallback(GlyphAtlas* atlas, AtlasInvalidateCallback callback, void* user_data);
+FONT_PORT uint32_t GetAtlasPageCount(GlyphAtlas* atlas);
+// Premultiplied RGBA pixels of a page, rows are page_width * 4 bytes apart.
+FONT_PORT const void* GetAtlasPageData(GlyphAtlas* atlas, uint32_t page);
+FONT_PORT AtlasStats GetAtlasStats(GlyphAtlas* atlas);
+
+struct FONT_PORT AtlasUpload {
+    // Aligned to 4x4 blocks with compression, `channel` names the plane (the first of the two with BC5).
+    AtlasRect rect;
+    // rect.height rows of rect.width pixels, `pitch` bytes apart, in the page's pixel format. With
+    // compression the rows are rows of blocks.
+    const void* data = nullptr;
+    uint32_t pitch = 0;
+};
+
+template class FONT_PORT LinkedList<AtlasUpload>;
+// The areas of every page changed since the last call, merged into a few rectangles and copied out
+// (e.g. for glTexSubImage2D). Pitches are multiples of `row_alignment`, 4 matches the default
+// GL_UNPACK_ALIGNMENT. The data stays valid until the next call. New pages start out transparent.
+FONT_PORT LinkedList<AtlasUpload> CollectAtlasUploads(GlyphAtlas* atlas, uint32_t row_alignment = 4);
+// Have CollectAtlasUploads encode the changed blocks for compressed textures, the next call hands out
+// every page in full. Returns false if the atlas format cannot be stored that way.
+FONT_PORT bool SetAtlasCompression(GlyphAtlas* atlas, AtlasCompression compression);
+
+struct FONT_PORT AtlasRemap {
+    AtlasRect from;
+    AtlasRect to;
+};
+
+template class FONT_PORT LinkedList<AtlasRemap>;
+// Move glyphs off the last pages into free space on earlier ones for about `time_budget_ms`, and drop pages
+// left empty. Every move is appended to `remaps` (may be null) so cached quads can be patched, the moved
+// pixels also show up in CollectAtlasUploads. Returns true once the pages cannot be reduced any further.
+FONT_PORT bool CompactAtlas(GlyphAtlas* atlas, double time_budget_ms, LinkedList<AtlasRemap>* remaps);
 
 }  // namespace Font
\ No newline at end of file
@@ -1,4 +1,5 @@
 ﻿#include <algorithm>
+#include <atomic>
 #include <cctype>
 #include <sstream>
 #include <cmath>
@@ -6,6 +7,8 @@
 #include <iterator>
 
 #include "freetype.h"
+#include "bitmap.h"
+#include FT_MODULE_H
 
 namespace Font {
 
@@ -43,108 +46,805 @@ static inline std::string trim_copy(std::string s) {
     return s;
 }
 
+// FreeType allocations carry their size in a header so the library's footprint can be
+// measured and held to a budget. Each wrapper counts its own library, only the shared one
+// is budgeted.
+static const size_t FreetypeBlockHeader = 16;
+
 struct FreetypeLibraryWrapper {
-    FT_Library ftlib_;
+    FT_Library ftlib_ = NULL;
+    FT_MemoryRec_ memory_;
+    std::atomic<size_t> allocated_;
+
+    static void* Alloc(FT_Memory memory, long size) {
+        char* block = static_cast<char*>(malloc(size + FreetypeBlockHeader));
+        if (!block) {
+            return NULL;
+        }
+        *reinterpret_cast<size_t*>(block) = size;
+        static_cast<FreetypeLibraryWrapper*>(memory->user)->allocated_ += size;
+        return block + FreetypeBlockHeader;
+    }
+
+    static void Free(FT_Memory memory, void* block) {
+        if (!block) {
+            return;
+        }
+        char* base = static_cast<char*>(block) - FreetypeBlockHeader;
+        static_cast<FreetypeLibraryWrapper*>(memory->user)->allocated_ -= *reinterpret_cast<size_t*>(base);
+        free(base);
+    }
+
+    static void* Realloc(FT_Memory memory, long, long new_size, void* block) {
+        if (!block) {
+            return Alloc(memory, new_size);
+        }
+        char* base = static_cast<char*>(block) - FreetypeBlockHeader;
+        const size_t old_size = *reinterpret_cast<size_t*>(base);
+        char* resized = static_cast<char*>(realloc(base, new_size + FreetypeBlockHeader));
+        if (!resized) {
+            return NULL;
+        }
+        *reinterpret_cast<size_t*>(resized) = new_size;
+        FreetypeLibraryWrapper* wrapper = static_cast<FreetypeLibraryWrapper*>(memory->user);
+        wrapper->allocated_ += new_size;
+        wrapper->allocated_ -= old_size;
+        return resized + FreetypeBlockHeader;
+    }
 
-    FreetypeLibraryWrapper() {
-        FT_Error error = FT_Init_FreeType(&ftlib_);
+    FreetypeLibraryWrapper() : allocated_(0) {
+        memory_.user = this;
+        memory_.alloc = Alloc;
+        memory_.free = Free;
+        memory_.realloc = Realloc;
+        FT_Error error = FT_New_Library(&memory_, &ftlib_);
         if (error) {
             throw(std::exception("Initialize Freetype library failed!"));
         }
+        FT_Add_Default_Modules(ftlib_);
+        FT_Set_Default_Properties(ftlib_);
     }
 
     ~FreetypeLibraryWrapper() {
         if (ftlib_) {
-            FT_Done_FreeType(ftlib_);
+            FT_Done_Library(ftlib_);
         }
     }
 };
 
 static FreetypeLibraryWrapper FreetypeLibrary;
 
-FreetypeFontFaceInfo::FreetypeFontFaceInfo(FT_Long _face_idx, FT_Long _instance_idx, FT_Long _id, FT_Face _face)
+FreetypeFacePool::~FreetypeFacePool() {
+    while (!open_faces_.empty()) {
+        open_faces_.front()->Close();
+    }
+}
+
+void FreetypeFacePool::SetMaxOpenFaces(size_t max_open_faces) {
+    max_open_faces_ = max_open_faces;
+    Trim(nullptr);
+}
+
+void FreetypeFacePool::SetMaxMemory(size_t max_memory) {
+    max_memory_ = max_memory;
+    Trim(nullptr);
+}
+
+FacePoolStats FreetypeFacePool::GetStats() const {
+    FacePoolStats stats;
+    stats.open_faces = static_cast<uint32_t>(open_faces_.size());
+    stats.freetype_memory = FreetypeLibrary.allocated_;
+    stats.opened = opened_;
+    stats.evicted = evicted_;
+    return stats;
+}
+
+void FreetypeFacePool::Touch(FreetypeFontFaceInfo* face) {
+    if (face->pooled_) {
+        open_faces_.splice(open_faces_.begin(), open_faces_, face->pool_entry_);
+    } else {
+        open_faces_.push_front(face);
+        face->pooled_ = true;
+        ++opened_;
+    }
+    face->pool_entry_ = open_faces_.begin();
+    Trim(face);
+}
+
+void FreetypeFacePool::Remove(FreetypeFontFaceInfo* face) {
+    if (face->pooled_) {
+        open_faces_.erase(face->pool_entry_);
+        face->pooled_ = false;
+    }
+}
+
+void FreetypeFacePool::Trim(FreetypeFontFaceInfo* keep) {
+    while (!open_faces_.empty() && ((max_open_faces_ && open_faces_.size() > max_open_faces_) || (max_memory_ && FreetypeLibrary.allocated_ > max_memory_))) {
+        FreetypeFontFaceInfo* victim = open_faces_.back();
+        if (victim == keep) {
+            break;
+        }
+        victim->Close();
+        ++evicted_;
+    }
+}
+
+FreetypeFontFaceInfo::FreetypeFontFaceInfo(const FT_Byte* data, FT_Long size, FT_Long _face_idx, const SfntFaceDescription& description, FreetypeFacePool* pool, GlyphCache* cache)
     : face_idx(_face_idx),
-      instance_idx(_instance_idx),
-      id(_id),
-      face(_face)
+      data_(data),
+      size_(size),
+      pool_(pool),
+      cache_(cache),
+      axes_(description.axes)
 
-{}
+{
+    style_flags = (description.bold ? FT_STYLE_FLAG_BOLD : 0) | (description.italic ? FT_STYLE_FLAG_ITALIC : 0);
+}
 
-FreetypeFontFaceInfo::~FreetypeFontFaceInfo() { FT_Done_Face(face); }
+FreetypeFontFaceInfo::~FreetypeFontFaceInfo() { Close(); }
 
-std::shared_ptr<GlyphBitmapInfo> FreetypeFontFaceInfo::GetGlyphBitmapInfo(uint32_t char_code, uint32_t size) {
-    FT_Set_Pixel_Sizes(face, size, 0);
-    FT_UInt glyph_index = FT_Get_Char_Index(face, char_code);
-    if (glyph_index == 0) {
+// Bytes a cached glyph holds: its RGBA pixels and the cache bookkeeping.
+static size_t GlyphCacheCost(const GlyphBitmapInfo& glyph) { return size_t(glyph.width) * glyph.height * 4 + sizeof(GlyphCacheKey) + sizeof(GlyphBitmapInfo) + 64; }
+
+FT_Face FreetypeFontFaceInfo::Open() {
+    if (!face) {
+        FT_Open_Args args;
+        args.flags = FT_OPEN_MEMORY;
+        args.memory_base = data_;
+        args.memory_size = size_;
+        if (FT_Open_Face(FreetypeLibrary.ftlib_, &args, face_idx, &face)) {
+            face = nullptr;
+            return nullptr;
+        }
+        // A freshly opened face is at its default instance.
+        applied_variation_ = SfntVariationKey();
+    }
+    pool_->Touch(this);
+    return face;
+}
+
+void FreetypeFontFaceInfo::Close() {
+    if (face) {
+        pool_->Remove(this);
+        FT_Done_Face(face);
+        face = nullptr;
+    }
+}
+
+FT_Face FreetypeFontFaceInfo::OpenPrivate(FT_Library library, const GlyphRenderOptions& options) const {
+    FT_Open_Args args;
+    args.flags = FT_OPEN_MEMORY;
+    args.memory_base = data_;
+    args.memory_size = size_;
+    FT_Face private_face = nullptr;
+    if (FT_Open_Face(library, &args, face_idx, &private_face)) {
         return nullptr;
     }
-    FT_Long error = FT_Load_Glyph(face, glyph_index, FT_LOAD_RENDER);
-    if (error) {
+    if (!axes_.empty() && !options.variation.IsDefault()) {
+        ApplyVariation(private_face, options);
+    }
+    return private_face;
+}
+
+std::shared_ptr<GlyphBitmapInfo> FreetypeFontFaceInfo::FindGlyph(FT_UInt glyph_index, uint32_t size, const GlyphRenderOptions& options) {
+    GlyphCacheKey key = {this, glyph_index, size, options.x_offset, options.subpixel, options.render_mode, options.palette_index, options.variation};
+    GlyphBitmapInfo* cached = cache_->Find(key);
+    return cached ? std::make_shared<GlyphBitmapInfo>(*cached) : nullptr;
+}
+
+bool FreetypeFontFaceInfo::KnownGlyphIndex(uint32_t char_code, FT_UInt* glyph_index) const {
+    auto iter = glyph_indices_.find(char_code);
+    if (iter == glyph_indices_.end()) {
+        return false;
+    }
+    *glyph_index = iter->second;
+    return true;
+}
+
+bool FreetypeFontFaceInfo::HasGlyph(FT_UInt glyph_index, uint32_t size, const GlyphRenderOptions& options) const {
+    GlyphCacheKey key = {this, glyph_index, size, options.x_offset, options.subpixel, options.render_mode, options.palette_index, options.variation};
+    return cache_->Peek(key) != nullptr;
+}
+
+void FreetypeFontFaceInfo::StoreGlyph(FT_UInt glyph_index, uint32_t size, const GlyphRenderOptions& options, const GlyphBitmapInfo& glyph) {
+    GlyphCacheKey key = {this, glyph_index, size, options.x_offset, options.subpixel, options.render_mode, options.palette_index, options.variation};
+    cache_->Insert(key, glyph, GlyphCacheCost(glyph));
+}
+
+bool FreetypeFontFaceInfo::MatchStyle(const FontInfo& info, bool strict, GlyphRenderOptions& options) const {
+    options.coordinates.clear();
+    options.variation = SfntVariationKey();
+    if (axes_.empty()) {
+        if (strict && info.bold && !(style_flags & FT_STYLE_FLAG_BOLD)) {
+            return false;
+        }
+        if (strict && info.italic && !(style_flags & FT_STYLE_FLAG_ITALIC)) {
+            return false;
+        }
+        return true;
+    }
+    bool bold = !info.bold || (style_flags & FT_STYLE_FLAG_BOLD);
+    bool italic = !info.italic || (style_flags & FT_STYLE_FLAG_ITALIC);
+    SfntVariationKey key;
+    bool is_default = true;
+    options.coordinates.resize(axes_.size());
+    for (size_t i = 0; i < axes_.size(); ++i) {
+        const SfntVariationAxis& axis = axes_[i];
+        FT_Fixed value = axis.def;
+        if (info.bold && axis.tag == FT_MAKE_TAG('w', 'g', 'h', 't') && axis.maximum >= (600 << 16)) {
+            value = std::min<FT_Fixed>(700 << 16, axis.maximum);
+            bold = true;
+        }
+        if (info.italic && axis.tag == FT_MAKE_TAG('i', 't', 'a', 'l') && axis.maximum >= (1 << 16)) {
+            value = 1 << 16;
+            italic = true;
+        }
+        if (info.italic && axis.tag == FT_MAKE_TAG('s', 'l', 'n', 't') && axis.minimum < 0 && !italic) {
+            // slnt is counter-clockwise, a forward lean is negative.
+            value = axis.minimum;
+            italic = true;
+        }
+        for (size_t j = 0; j < info.variations.size(); j++) {
+            if (info.variations[j].tag == axis.tag) {
+                value = static_cast<FT_Fixed>(info.variations[j].value * 65536.0f);
+            }
+        }
+        value = std::max<FT_Fixed>(axis.minimum, std::min<FT_Fixed>(axis.maximum, value));
+        // Axes past what a key holds stay at their default.
+        if (i >= SfntVariationKey::MaxAxes) {
+            value = axis.def;
+        }
+        // Quantize to 1/1023 of the axis range so nearby animation frames share cached glyphs.
+        uint32_t step = 0;
+        if (axis.maximum > axis.minimum && i < SfntVariationKey::MaxAxes) {
+            const double range = static_cast<double>(axis.maximum - axis.minimum);
+            step = static_cast<uint32_t>(std::floor((value - axis.minimum) * SfntVariationKey::MaxStep / range + 0.5));
+            value = axis.minimum + static_cast<FT_Fixed>(step * range / SfntVariationKey::MaxStep + 0.5);
+            key.SetStep(i, step);
+        }
+        is_default = is_default && value == axis.def;
+        options.coordinates[i] = value;
+    }
+    if (!is_default) {
+        key.MarkInstance();
+        options.variation = key;
+    }
+    return !strict || (bold && italic);
+}
+
+// Prefer the smallest strike that is at least as large as requested so it only needs
+// to be scaled down, fall back to the largest one.
+static int SelectNearestStrike(FT_Face face, uint32_t size) {
+    int best = -1;
+    for (int i = 0; i < face->num_fixed_sizes; ++i) {
+        FT_Pos ppem = face->available_sizes[i].y_ppem;
+        if (best < 0) {
+            best = i;
+            continue;
+        }
+        FT_Pos best_ppem = face->available_sizes[best].y_ppem;
+        FT_Pos wanted = static_cast<FT_Pos>(size) << 6;
+        if (best_ppem < wanted ? ppem > best_ppem : (ppem >= wanted && ppem < best_ppem)) {
+            best = i;
+        }
+    }
+    return best;
+}
+
+// Load the nearest color bitmap strike and scale it to `size`.
+static std::shared_ptr<GlyphBitmapInfo> RenderColorStrikeGlyph(FT_Face face, FT_UInt glyph_index, uint32_t size) {
+    int strike = SelectNearestStrike(face, size);
+    if (strike < 0 || FT_Select_Size(face, strike)) {
+        return nullptr;
+    }
+    if (FT_Load_Glyph(face, glyph_index, FT_LOAD_COLOR) || face->glyph->bitmap.pixel_mode != FT_PIXEL_MODE_BGRA) {
         return nullptr;
     }
+    const FT_Bitmap& bitmap = face->glyph->bitmap;
+    const double scale = static_cast<double>(size) * 64.0 / face->available_sizes[strike].y_ppem;
     std::shared_ptr<GlyphBitmapInfo> glyph_result = std::make_shared<GlyphBitmapInfo>();
-    glyph_result->error_code = (face->glyph->bitmap.width && face->glyph->bitmap.rows) ? GlyphErrorCode::Success : GlyphErrorCode::NoBitmapData;
-    glyph_result->width = face->glyph->bitmap.width;
-    glyph_result->height = face->glyph->bitmap.rows;
-    glyph_result->bearing_x = face->glyph->bitmap_left;
-    glyph_result->bearing_y = face->glyph->bitmap_top;
+    glyph_result->width = bitmap.width ? std::max(1u, static_cast<unsigned int>(bitmap.width * scale + 0.5)) : 0;
+    glyph_result->height = bitmap.rows ? std::max(1u, static_cast<unsigned int>(bitmap.rows * scale + 0.5)) : 0;
+    glyph_result->error_code = (glyph_result->width && glyph_result->height) ? GlyphErrorCode::Success : GlyphErrorCode::NoBitmapData;
+    glyph_result->bearing_x = static_cast<int>(std::floor(face->glyph->bitmap_left * scale + 0.5));
+    glyph_result->bearing_y = static_cast<int>(std::floor(face->glyph->bitmap_top * scale + 0.5));
+    glyph_result->advance_26_6 = static_cast<int>(face->glyph->advance.x * scale + 0.5);
+    glyph_result->advance = glyph_result->advance_26_6 >> 6;
+    glyph_result->emoji = true;
+    unsigned char* pixels = (unsigned char*)glyph_result->Allocate(glyph_result->width * glyph_result->height * 4 * sizeof(char));
+    ScaleBGRAToRGBA(pixels, glyph_result->width * 4, glyph_result->width, glyph_result->height, bitmap.buffer, bitmap.pitch, bitmap.width, bitmap.rows);
+    return glyph_result;
+}
+
+// Rasterize the COLR layers of a glyph and composite them with their CPAL colors.
+static std::shared_ptr<GlyphBitmapInfo> RenderColorLayerGlyph(FT_Face face, FT_UInt glyph_index, uint32_t size, const GlyphRenderOptions& options) {
+    FT_LayerIterator iterator;
+    iterator.p = NULL;
+    FT_UInt layer_glyph = 0;
+    FT_UInt color_index = 0;
+    if (!FT_Get_Color_Glyph_Layer(face, glyph_index, &layer_glyph, &color_index, &iterator)) {
+        return nullptr;
+    }
+    FT_Palette_Data palette_data;
+    FT_Color* palette = NULL;
+    if (FT_Palette_Data_Get(face, &palette_data) || FT_Palette_Select(face, static_cast<FT_UShort>(options.palette_index < palette_data.num_palettes ? options.palette_index : 0), &palette)) {
+        return nullptr;
+    }
+    FT_Set_Pixel_Sizes(face, size, 0);
+    const FT_Int32 load_flags = options.subpixel ? FT_LOAD_TARGET_LIGHT : FT_LOAD_DEFAULT;
+
+    struct Layer {
+        std::vector<uint8_t> coverage;
+        int left;
+        int top;
+        unsigned int width;
+        unsigned int height;
+        uint8_t color[4];
+    };
+    std::vector<Layer> layers;
+    int left = 0, top = 0, right = 0, bottom = 0;
+    do {
+        if (FT_Load_Glyph(face, layer_glyph, load_flags)) {
+            return nullptr;
+        }
+        if (face->glyph->format == FT_GLYPH_FORMAT_OUTLINE && options.x_offset) {
+            FT_Outline_Translate(&face->glyph->outline, options.x_offset, 0);
+        }
+        if (FT_Render_Glyph(face->glyph, FT_RENDER_MODE_NORMAL)) {
+            return nullptr;
+        }
+        const FT_Bitmap& bitmap = face->glyph->bitmap;
+        if (!bitmap.width || !bitmap.rows) {
+            continue;
+        }
+        Layer layer;
+        layer.left = face->glyph->bitmap_left;
+        layer.top = face->glyph->bitmap_top;
+        layer.width = bitmap.width;
+        layer.height = bitmap.rows;
+        layer.coverage.resize(bitmap.width * bitmap.rows);
+        for (unsigned int row = 0; row < bitmap.rows; ++row) {
+            memcpy(&layer.coverage[row * bitmap.width], bitmap.buffer + row * bitmap.pitch, bitmap.width);
+        }
+        // 0xFFFF is the text foreground, which stays white like plain coverage glyphs so it can be tinted.
+        const FT_Color foreground = {0xff, 0xff, 0xff, 0xff};
+        const FT_Color& color = (color_index == 0xFFFF || color_index >= palette_data.num_palette_entries) ? foreground : palette[color_index];
+        layer.color[0] = color.red;
+        layer.color[1] = color.green;
+        layer.color[2] = color.blue;
+        layer.color[3] = color.alpha;
+        if (layers.empty()) {
+            left = layer.left;
+            top = layer.top;
+            right = layer.left + static_cast<int>(layer.width);
+            bottom = layer.top - static_cast<int>(layer.height);
+        } else {
+            left = std::min(left, layer.left);
+            top = std::max(top, layer.top);
+            right = std::max(right, layer.left + static_cast<int>(layer.width));
+            bottom = std::min(bottom, layer.top - static_cast<int>(layer.height));
+        }
+        layers.emplace_back(std::move(layer));
+    } while (FT_Get_Color_Glyph_Layer(face, glyph_index, &layer_glyph, &color_index, &iterator));
+
+    // Metrics come from the base glyph, the layers share its advance.
+    if (FT_Load_Glyph(face, glyph_index, load_flags)) {
+        return nullptr;
+    }
+    std::shared_ptr<GlyphBitmapInfo> glyph_result = std::make_shared<GlyphBitmapInfo>();
+    glyph_result->width = layers.empty() ? 0 : static_cast<unsigned int>(right - left);
+    glyph_result->height = layers.empty() ? 0 : static_cast<unsigned int>(top - bottom);
+    glyph_result->error_code = (glyph_result->width && glyph_result->height) ? GlyphErrorCode::Success : GlyphErrorCode::NoBitmapData;
+    glyph_result->bearing_x = left;
+    glyph_result->bearing_y = top;
     glyph_result->advance = static_cast<int32_t>(face->glyph->advance.x >> 6);
-    glyph_result->emoji = false;
-    glyph_result->data = malloc(face->glyph->bitmap.width * face->glyph->bitmap.rows * 4 * sizeof(char));
-    unsigned char* pixels = (unsigned char*)(glyph_result->data);
-    for (unsigned int row = 0; row < face->glyph->bitmap.rows; ++row) {
-        for (unsigned int col = 0; col < face->glyph->bitmap.width; ++col) {
-            auto value = face->glyph->bitmap.buffer[row * face->glyph->bitmap.pitch + col];
-            auto pixel_offest = row * face->glyph->bitmap.width * 4 + col * 4;
-            pixels[pixel_offest] = value;
-            pixels[pixel_offest + 1] = value;
-            pixels[pixel_offest + 2] = value;
-            pixels[pixel_offest + 3] = value;
+    glyph_result->advance_26_6 = static_cast<int32_t>(options.subpixel ? (face->glyph->linearHoriAdvance + 512) >> 10 : face->glyph->advance.x);
+    glyph_result->emoji = true;
+    const size_t pitch = glyph_result->width * 4;
+    unsigned char* pixels = (unsigned char*)glyph_result->Allocate(pitch * glyph_result->height);
+    if (pixels) {
+        memset(pixels, 0, pitch * glyph_result->height);
+    }
+    for (auto& layer : layers) {
+        unsigned char* origin = pixels + (top - layer.top) * pitch + (layer.left - left) * 4;
+        BlendCoverageOver(origin, pitch, layer.coverage.data(), layer.width, layer.width, layer.height, layer.color);
+    }
+    return glyph_result;
+}
+
+FT_UInt FreetypeFontFaceInfo::GlyphIndex(uint32_t char_code) {
+    auto known_index = glyph_indices_.find(char_code);
+    if (known_index != glyph_indices_.end()) {
+        return known_index->second;
+    }
+    if (!Open()) {
+        return 0;
+    }
+    FT_UInt glyph_index = FT_Get_Char_Index(face, char_code);
+    glyph_indices_.emplace(char_code, glyph_index);
+    return glyph_index;
+}
+
+bool FreetypeFontFaceInfo::Prepare(const GlyphRenderOptions& options) {
+    if (!Open()) {
+        return false;
+    }
+    if (!axes_.empty() && options.variation != applied_variation_) {
+        ApplyVariation(face, options);
+        applied_variation_ = options.variation;
+    }
+    return true;
+}
+
+bool FreetypeFontFaceInfo::GetAdvance(uint32_t char_code, uint32_t size, const GlyphRenderOptions& options, int32_t* advance) {
+    FT_UInt glyph_index = GlyphIndex(char_code);
+    if (glyph_index == 0 || !Prepare(options)) {
+        return false;
+    }
+    // Color glyphs measure their scaled strikes or layers, take the advance they are rendered with.
+    if (FT_HAS_COLOR(face) || !FT_IS_SCALABLE(face)) {
+        std::shared_ptr<GlyphBitmapInfo> glyph = GetGlyphBitmapInfo(char_code, size, options);
+        if (!glyph) {
+            return false;
         }
+        *advance = glyph->advance_26_6;
+        return true;
+    }
+    FT_Int32 load_flags = FT_LOAD_DEFAULT;
+    switch (options.render_mode) {
+        case GlyphRenderMode::LcdRGB:
+        case GlyphRenderMode::LcdBGR: load_flags = FT_LOAD_TARGET_LCD; break;
+        case GlyphRenderMode::LcdVerticalRGB:
+        case GlyphRenderMode::LcdVerticalBGR: load_flags = FT_LOAD_TARGET_LCD_V; break;
+        default: break;
+    }
+    // Subpixel positioned glyphs advance by the linear width, which needs no hinting.
+    if (options.subpixel) {
+        load_flags = FT_LOAD_NO_HINTING;
+    }
+    FT_Fixed value;
+    FT_Set_Pixel_Sizes(face, size, 0);
+    if (FT_Get_Advance(face, glyph_index, load_flags, &value)) {
+        return false;
+    }
+    *advance = static_cast<int32_t>(options.subpixel ? (value + 512) >> 10 : value >> 10);
+    return true;
+}
+
+FT_Pos FreetypeFontFaceInfo::GetKerning(FT_UInt left, FT_UInt right, uint32_t size, const GlyphRenderOptions& options) {
+    if (!kerning_) {
+        kerning_.reset(new SfntKerning(ReadSfntKerning(data_, static_cast<size_t>(size_), static_cast<uint32_t>(face_idx & 0xFFFF))));
+    }
+    if (kerning_->units_per_em) {
+        if (kerning_->empty()) {
+            return 0;
+        }
+        if (kerning_size_ != size) {
+            kerning_size_ = size;
+            kerning_scale_ = FT_DivFix(static_cast<FT_Long>(size) << 6, kerning_->units_per_em);
+        }
+        FT_Pos kerning = FT_MulFix(kerning_->Lookup(static_cast<uint16_t>(left), static_cast<uint16_t>(right)), kerning_scale_);
+        if (options.subpixel) {
+            return kerning;
+        }
+        // Fitted like FT_Get_Kerning: damped below 25 pixels, where it would close up small text, and rounded.
+        if (size < 25) {
+            kerning = FT_MulDiv(kerning, size, 25);
+        }
+        return (kerning + 32) & ~63;
+    }
+    if (!Prepare(options) || !FT_HAS_KERNING(face)) {
+        return 0;
+    }
+    FT_Vector kerning;
+    FT_Set_Pixel_Sizes(face, size, 0);
+    // Subpixel positioned text keeps the fractional kerning like it keeps the linear advances.
+    if (FT_Get_Kerning(face, left, right, options.subpixel ? FT_KERNING_UNFITTED : FT_KERNING_DEFAULT, &kerning)) {
+        return 0;
+    }
+    return kerning.x;
+}
+
+bool FreetypeFontFaceInfo::GetLineMetrics(uint32_t size, const GlyphRenderOptions& options, FT_Size_Metrics* metrics) {
+    if (!Prepare(options) || FT_Set_Pixel_Sizes(face, size, 0)) {
+        return false;
+    }
+    *metrics = face->size->metrics;
+    return true;
+}
+
+std::shared_ptr<GlyphBitmapInfo> FreetypeFontFaceInfo::GetGlyphBitmapInfo(uint32_t char_code, uint32_t size, const GlyphRenderOptions& options) {
+    FT_UInt glyph_index = GlyphIndex(char_code);
+    if (glyph_index == 0) {
+        return nullptr;
+    }
+    GlyphCacheKey key = {this, glyph_index, size, options.x_offset, options.subpixel, options.render_mode, options.palette_index, options.variation};
+    GlyphBitmapInfo* cached = cache_->Find(key);
+    if (cached) {
+        return std::make_shared<GlyphBitmapInfo>(*cached);
+    }
+    if (!Prepare(options)) {
+        return nullptr;
+    }
+    std::shared_ptr<GlyphBitmapInfo> glyph_result = RenderGlyph(face, glyph_index, size, options);
+    if (glyph_result) {
+        cache_->Insert(key, *glyph_result, GlyphCacheCost(*glyph_result));
     }
     return glyph_result;
 }
 
-FreetypeFontFace::FreetypeFontFace(void* ttf_data, uint32_t size) {
-    ttf_data_ = ttf_data;
-    FT_Long num_faces = 0;
-    FT_Long num_instances = 0;
+// Copy a finished RGBA glyph into a target of another format.
+static void CopyGlyphPixels(uint8_t* dst, size_t dst_pitch, const GlyphBitmapInfo& glyph, GlyphPixelFormat format) {
+    const uint8_t* src = static_cast<const uint8_t*>(glyph.data);
+    const size_t src_pitch = size_t(glyph.width) * 4;
+    for (uint32_t row = 0; row < glyph.height; ++row, dst += dst_pitch, src += src_pitch) {
+        if (format == GlyphPixelFormat::RGBA) {
+            memcpy(dst, src, src_pitch);
+            continue;
+        }
+        for (uint32_t x = 0; x < glyph.width; ++x) {
+            if (format == GlyphPixelFormat::Alpha8) {
+                dst[x] = src[x * 4 + 3];
+            } else {
+                dst[x * 4] = src[x * 4 + 2];
+                dst[x * 4 + 1] = src[x * 4 + 1];
+                dst[x * 4 + 2] = src[x * 4];
+                dst[x * 4 + 3] = src[x * 4 + 3];
+            }
+        }
+    }
+}
 
-    FT_Long face_idx = 0;
-    FT_Long instance_idx = 0;
+static uint32_t BytesPerPixel(GlyphPixelFormat format) { return format == GlyphPixelFormat::Alpha8 ? 1 : 4; }
 
-    FT_Open_Args args;
-    args.flags = FT_OPEN_MEMORY;
-    args.memory_base = (FT_Byte*)ttf_data;
-    args.memory_size = size;
+// Destination of the spans FreeType's rasterizer reports for an RGBA or BGRA target.
+struct SpanTarget {
+    uint8_t* pixels;
+    size_t pitch;
+    uint32_t height;
+};
 
-    do {
-        FT_Face face;
-        FT_Long id = (instance_idx << 16) + face_idx;
+// Spans come bottom up. Gray coverage is the same premultiplied white in RGBA and BGRA.
+static void ExpandSpans(int y, int count, const FT_Span* spans, void* user) {
+    const SpanTarget* target = static_cast<const SpanTarget*>(user);
+    uint8_t* row = target->pixels + size_t(target->height - 1 - y) * target->pitch;
+    for (int i = 0; i < count; ++i) {
+        memset(row + size_t(spans[i].x) * 4, spans[i].coverage, size_t(spans[i].len) * 4);
+    }
+}
 
-        FT_Error error = FT_Open_Face(FreetypeLibrary.ftlib_, &args, id, &face);
+bool FreetypeFontFaceInfo::RenderGlyphTo(uint32_t char_code, uint32_t size, const GlyphRenderOptions& options, GlyphPixelFormat format, GlyphTargetCallback target, void* user_data, GlyphBitmapInfo* glyph) {
+    FT_UInt glyph_index = GlyphIndex(char_code);
+    if (glyph_index == 0 || !Prepare(options)) {
+        return false;
+    }
+    // Grayscale outlines are rasterized into the target, everything else takes the usual path and is copied.
+    bool direct = FT_IS_SCALABLE(face) && !FT_HAS_COLOR(face) && options.render_mode == GlyphRenderMode::Gray;
+    if (direct) {
+        FT_Set_Pixel_Sizes(face, size, 0);
+        direct = !FT_Load_Glyph(face, glyph_index, options.subpixel ? FT_LOAD_TARGET_LIGHT : FT_LOAD_DEFAULT) && face->glyph->format == FT_GLYPH_FORMAT_OUTLINE;
+    }
+    if (!direct) {
+        std::shared_ptr<GlyphBitmapInfo> rendered = GetGlyphBitmapInfo(char_code, size, options);
+        if (!rendered) {
+            return false;
+        }
+        *glyph = *rendered;
+        glyph->Release();
+        uint32_t pitch = 0;
+        uint8_t* pixels = (glyph->width && glyph->height) ? static_cast<uint8_t*>(target(user_data, glyph->width, glyph->height, &pitch)) : nullptr;
+        if (pixels) {
+            if (pitch < glyph->width * BytesPerPixel(format)) {
+                return false;
+            }
+            CopyGlyphPixels(pixels, pitch, *rendered, format);
+        }
+        return true;
+    }
+    FT_Outline& outline = face->glyph->outline;
+    if (options.x_offset) {
+        FT_Outline_Translate(&outline, options.x_offset, 0);
+    }
+    // The pixels the outline touches, as FT_Render_Glyph would size its bitmap.
+    FT_BBox box;
+    FT_Outline_Get_CBox(&outline, &box);
+    box.xMin &= ~63;
+    box.yMin &= ~63;
+    box.xMax = (box.xMax + 63) & ~63;
+    box.yMax = (box.yMax + 63) & ~63;
+    const uint32_t width = static_cast<uint32_t>((box.xMax - box.xMin) >> 6);
+    const uint32_t height = static_cast<uint32_t>((box.yMax - box.yMin) >> 6);
+    glyph->Release();
+    glyph->error_code = (width && height) ? GlyphErrorCode::Success : GlyphErrorCode::NoBitmapData;
+    glyph->width = width;
+    glyph->height = height;
+    glyph->bearing_x = static_cast<int>(box.xMin >> 6);
+    glyph->bearing_y = static_cast<int>(box.yMax >> 6);
+    glyph->advance = static_cast<int32_t>(face->glyph->advance.x >> 6);
+    glyph->advance_26_6 = static_cast<int32_t>(options.subpixel ? (face->glyph->linearHoriAdvance + 512) >> 10 : face->glyph->advance.x);
+    glyph->emoji = false;
+    uint32_t pitch = 0;
+    uint8_t* pixels = (width && height) ? static_cast<uint8_t*>(target(user_data, width, height, &pitch)) : nullptr;
+    if (!pixels) {
+        return true;
+    }
+    const size_t row_bytes = size_t(width) * BytesPerPixel(format);
+    if (pitch < row_bytes) {
+        return false;
+    }
+    // The rasterizer only writes covered spans.
+    for (uint32_t row = 0; row < height; ++row) {
+        memset(pixels + size_t(row) * pitch, 0, row_bytes);
+    }
+    FT_Outline_Translate(&outline, -box.xMin, -box.yMin);
+    FT_Raster_Params params;
+    memset(&params, 0, sizeof(params));
+    params.source = &outline;
+    params.flags = FT_RASTER_FLAG_AA;
+    FT_Bitmap bitmap;
+    SpanTarget span_target = {pixels, pitch, height};
+    if (format == GlyphPixelFormat::Alpha8) {
+        memset(&bitmap, 0, sizeof(bitmap));
+        bitmap.rows = height;
+        bitmap.width = width;
+        bitmap.pitch = static_cast<int>(pitch);
+        bitmap.buffer = pixels;
+        bitmap.pixel_mode = FT_PIXEL_MODE_GRAY;
+        bitmap.num_grays = 256;
+        params.target = &bitmap;
+    } else {
+        // Expanded to four channels as the spans come in, with no coverage buffer in between.
+        params.flags |= FT_RASTER_FLAG_DIRECT | FT_RASTER_FLAG_CLIP;
+        params.gray_spans = ExpandSpans;
+        params.user = &span_target;
+        params.clip_box.xMin = 0;
+        params.clip_box.yMin = 0;
+        params.clip_box.xMax = static_cast<FT_Pos>(width);
+        params.clip_box.yMax = static_cast<FT_Pos>(height);
+    }
+    return !FT_Outline_Render(face->glyph->library, &outline, &params);
+}
+
+void FreetypeFontFaceInfo::ApplyVariation(FT_Face target, const GlyphRenderOptions& options) const {
+    if (options.coordinates.size() == axes_.size()) {
+        FT_Set_Var_Design_Coordinates(target, static_cast<FT_UInt>(axes_.size()), const_cast<FT_Fixed*>(options.coordinates.data()));
+    } else {
+        FT_Set_Var_Design_Coordinates(target, 0, NULL);
+    }
+}
+
+std::shared_ptr<GlyphBitmapInfo> FreetypeFontFaceInfo::RenderGlyph(FT_Face face, FT_UInt glyph_index, uint32_t size, const GlyphRenderOptions& options) {
+    // CBDT and sbix fonts carry premultiplied BGRA strikes at a few fixed sizes.
+    if (FT_HAS_COLOR(face) && FT_HAS_FIXED_SIZES(face)) {
+        std::shared_ptr<GlyphBitmapInfo> color_glyph = RenderColorStrikeGlyph(face, glyph_index, size);
+        if (color_glyph) {
+            return color_glyph;
+        }
+        if (!FT_IS_SCALABLE(face)) {
+            return nullptr;
+        }
+    }
+    if (FT_HAS_COLOR(face) && options.render_mode == GlyphRenderMode::Gray) {
+        std::shared_ptr<GlyphBitmapInfo> color_glyph = RenderColorLayerGlyph(face, glyph_index, size, options);
+        if (color_glyph) {
+            return color_glyph;
+        }
+    }
+    FT_Int32 load_flags = FT_LOAD_DEFAULT;
+    FT_Render_Mode render_mode = FT_RENDER_MODE_NORMAL;
+    switch (options.render_mode) {
+        case GlyphRenderMode::LcdRGB:
+        case GlyphRenderMode::LcdBGR:
+            load_flags = FT_LOAD_TARGET_LCD;
+            render_mode = FT_RENDER_MODE_LCD;
+            break;
+        case GlyphRenderMode::LcdVerticalRGB:
+        case GlyphRenderMode::LcdVerticalBGR:
+            load_flags = FT_LOAD_TARGET_LCD_V;
+            render_mode = FT_RENDER_MODE_LCD_V;
+            break;
+        default:
+            // Hinting snaps stems to the pixel grid horizontally, which would undo the subpixel shift.
+            load_flags = options.subpixel ? FT_LOAD_TARGET_LIGHT : FT_LOAD_DEFAULT;
+            break;
+    }
+    FT_Set_Pixel_Sizes(face, size, 0);
+    FT_Long error = FT_Load_Glyph(face, glyph_index, load_flags);
+    if (error) {
+        return nullptr;
+    }
+    if (face->glyph->format == FT_GLYPH_FORMAT_OUTLINE && options.x_offset) {
+        FT_Outline_Translate(&face->glyph->outline, options.x_offset, 0);
+    }
+    if (face->glyph->format != FT_GLYPH_FORMAT_BITMAP) {
+        error = FT_Render_Glyph(face->glyph, render_mode);
         if (error) {
-            continue;
+            return nullptr;
         }
-        faces.emplace_back(std::make_shared<FreetypeFontFaceInfo>(face_idx, instance_idx, id, face));
+    }
+    const FT_Bitmap& bitmap = face->glyph->bitmap;
+    unsigned int width = bitmap.width;
+    unsigned int height = bitmap.rows;
+    if (bitmap.pixel_mode == FT_PIXEL_MODE_LCD) {
+        width /= 3;
+    } else if (bitmap.pixel_mode == FT_PIXEL_MODE_LCD_V) {
+        height /= 3;
+    }
+    std::shared_ptr<GlyphBitmapInfo> glyph_result = std::make_shared<GlyphBitmapInfo>();
+    glyph_result->error_code = (width && height) ? GlyphErrorCode::Success : GlyphErrorCode::NoBitmapData;
+    glyph_result->width = width;
+    glyph_result->height = height;
+    glyph_result->bearing_x = face->glyph->bitmap_left;
+    glyph_result->bearing_y = face->glyph->bitmap_top;
+    glyph_result->advance = static_cast<int32_t>(face->glyph->advance.x >> 6);
+    // The hinted advance is rounded to whole pixels, subpixel layout wants the linear one.
+    glyph_result->advance_26_6 = static_cast<int32_t>(options.subpixel ? (face->glyph->linearHoriAdvance + 512) >> 10 : face->glyph->advance.x);
+    glyph_result->emoji = false;
+    unsigned char* pixels = (unsigned char*)glyph_result->Allocate(width * height * 4 * sizeof(char));
+    const bool bgr = options.render_mode == GlyphRenderMode::LcdBGR || options.render_mode == GlyphRenderMode::LcdVerticalBGR;
+    if (bitmap.pixel_mode == FT_PIXEL_MODE_LCD) {
+        ConvertLcdToRGBA(pixels, width * 4, bitmap.buffer, bitmap.pitch, width, height, bgr);
+    } else if (bitmap.pixel_mode == FT_PIXEL_MODE_LCD_V) {
+        ConvertLcdVerticalToRGBA(pixels, width * 4, bitmap.buffer, bitmap.pitch, width, height, bgr);
+    } else {
+        ExpandGrayToRGBA(pixels, width * 4, bitmap.buffer, bitmap.pitch, width, height);
+    }
+    return glyph_result;
+}
 
-        num_faces = face->num_faces;
-        num_instances = face->style_flags >> 16;
-        if (face->family_name) {
-            font_family = face->family_name;
+// Describe a face FreeType has opened, for formats the sfnt reader does not handle.
+static SfntFaceDescription DescribeFace(FT_Face face) {
+    SfntFaceDescription description;
+    description.family = face->family_name ? face->family_name : "";
+    description.bold = (face->style_flags & FT_STYLE_FLAG_BOLD) != 0;
+    description.italic = (face->style_flags & FT_STYLE_FLAG_ITALIC) != 0;
+    FT_MM_Var* mm_var = NULL;
+    if (FT_HAS_MULTIPLE_MASTERS(face) && !FT_Get_MM_Var(face, &mm_var)) {
+        for (FT_UInt i = 0; i < mm_var->num_axis; ++i) {
+            SfntVariationAxis axis = {static_cast<uint32_t>(mm_var->axis[i].tag), static_cast<int32_t>(mm_var->axis[i].minimum), static_cast<int32_t>(mm_var->axis[i].def), static_cast<int32_t>(mm_var->axis[i].maximum)};
+            description.axes.push_back(axis);
         }
+        FT_Done_MM_Var(FreetypeLibrary.ftlib_, mm_var);
+    }
+    return description;
+}
 
-        if (instance_idx < num_instances)
-            instance_idx++;
-        else {
+FreetypeFontFace::FreetypeFontFace(void* ttf_data, uint32_t size, FreetypeFacePool* pool, GlyphCache* cache) {
+    ttf_data_ = ttf_data;
+    // Reading the tables directly keeps collections cheap to load, faces are only opened
+    // once a glyph is requested from them. Named instances of a variable face are never
+    // opened separately, they are selected through design coordinates.
+    std::vector<SfntFaceDescription> descriptions = ReadSfntFaces((const uint8_t*)ttf_data, size);
+    if (descriptions.empty()) {
+        FT_Open_Args args;
+        args.flags = FT_OPEN_MEMORY;
+        args.memory_base = (FT_Byte*)ttf_data;
+        args.memory_size = size;
+        FT_Long num_faces = 0;
+        FT_Long face_idx = 0;
+        do {
+            FT_Face face;
+            if (!FT_Open_Face(FreetypeLibrary.ftlib_, &args, face_idx, &face)) {
+                descriptions.resize(face_idx + 1);
+                descriptions[face_idx] = DescribeFace(face);
+                num_faces = face->num_faces;
+                FT_Done_Face(face);
+            }
             face_idx++;
-            instance_idx = 0;
+        } while (face_idx < num_faces);
+    }
+    for (size_t face_idx = 0; face_idx < descriptions.size(); ++face_idx) {
+        if (descriptions[face_idx].family.empty()) {
+            continue;
         }
-
-    } while (face_idx < num_faces);
+        faces.emplace_back(std::make_shared<FreetypeFontFaceInfo>((const FT_Byte*)ttf_data, size, static_cast<FT_Long>(face_idx), descriptions[face_idx], pool, cache));
+        font_family = descriptions[face_idx].family;
+    }
 }
 
 FreetypeFontFace ::~FreetypeFontFace() {
+    // Faces read from the font data while closing, release them before it.
+    faces.clear();
     if (ttf_data_) {
         free(ttf_data_);
     }
@@ -198,9 +898,10 @@ FontInfo* FreetypeFont::Create(const std::string& name, uint32_t size) {
 }
 
 std::string FreetypeFont::Load(void* ttf_data, uint32_t size) {
+    std::lock_guard<std::mutex> lock(mutex_);
     void* ttf_data_ = malloc(size * sizeof(char));
     memcpy(ttf_data_, ttf_data, size);
-    std::shared_ptr<FreetypeFontFace> face = std::make_shared<FreetypeFontFace>(ttf_data_, size);
+    std::shared_ptr<FreetypeFontFace> face = std::make_shared<FreetypeFontFace>(ttf_data_, size, &face_pool_, &glyph_cache_);
     if (face->font_family != "") {
         auto iter = font_info_.find(face->font_family);
         if (iter == font_info_.end()) {
@@ -208,43 +909,543 @@ std::string FreetypeFont::Load(void* ttf_data, uint32_t size) {
             iter = font_info_.emplace(face->font_family, faces).first;
         }
         iter->second.emplace_back(face);
+        StartUsageWarmSets();
         return face->font_family;
     }
     return "";
 }
 
-LinkedList<GlyphBitmapInfo> FreetypeFont::GetGlyphBitmap(void* font, uint32_t char_code) {
+void FreetypeFont::SetLcdFilter(LcdFilter filter) {
+    FT_LcdFilter ft_filter = FT_LCD_FILTER_NONE;
+    switch (filter) {
+        case LcdFilter::Default: ft_filter = FT_LCD_FILTER_DEFAULT; break;
+        case LcdFilter::Light: ft_filter = FT_LCD_FILTER_LIGHT; break;
+        case LcdFilter::Legacy: ft_filter = FT_LCD_FILTER_LEGACY; break;
+        default: break;
+    }
+    std::lock_guard<std::mutex> lock(mutex_);
+    // Builds without ClearType-style filtering use Harmony LCD rendering and report this as unimplemented.
+    FT_Library_SetLcdFilter(FreetypeLibrary.ftlib_, ft_filter);
+    lcd_filter_ = ft_filter;
+    ++cache_generation_;
+    glyph_cache_.Clear();
+}
+
+GlyphCacheStats FreetypeFont::GetGlyphCacheStats() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    GlyphCacheStats stats;
+    stats.glyphs = static_cast<uint32_t>(glyph_cache_.size());
+    stats.bytes = glyph_cache_.bytes();
+    stats.hits = glyph_cache_.hits();
+    stats.misses = glyph_cache_.misses();
+    stats.evictions = glyph_cache_.evictions();
+    return stats;
+}
+
+SfntVariationKey MakeVariationKey(const FontInfo& font) { return font.variations.empty() ? SfntVariationKey() : GetFreetypeFontInstance().GetVariationKey(font); }
+
+uint32_t StyleKey(const FontInfo& font) { return (font.bold ? 1u : 0u) | (font.italic ? 2u : 0u) | (static_cast<uint32_t>(font.render_mode) << 2); }
+
+int SnapOrigin(const FontInfo& font, float origin_x, uint32_t* phase) {
+    *phase = 0;
+    if (font.subpixel_phases <= 1) {
+        return 0;
+    }
+    const int phases = static_cast<int>(font.subpixel_phases);
+    const int snapped = static_cast<int>(std::floor(origin_x * phases + 0.5f));
+    const int pixel = static_cast<int>(std::floor(static_cast<float>(snapped) / phases));
+    *phase = static_cast<uint32_t>(snapped - pixel * phases);
+    return pixel - static_cast<int>(std::floor(origin_x));
+}
+
+FontGlyphKey MakeFontGlyphKey(const FontInfo& font, uint32_t char_code, float origin_x, int* origin_carry) {
+    uint32_t phase;
+    *origin_carry = SnapOrigin(font, origin_x, &phase);
+    return {font.name.data(), static_cast<uint32_t>(font.size), StyleKey(font), font.palette_index, MakeVariationKey(font), char_code, phase, std::max(1u, font.subpixel_phases)};
+}
+
+// Set up the render options for `info` with the origin snapped to its subpixel phases.
+// Returns the whole pixels rounding the origin up carried into the next pixel.
+static int SetupOptions(const FontInfo& info, float origin_x, GlyphRenderOptions& options) {
+    options.render_mode = info.render_mode;
+    options.palette_index = info.palette_index;
+    uint32_t phase;
+    const int origin_carry = SnapOrigin(info, origin_x, &phase);
+    if (info.subpixel_phases > 1) {
+        options.x_offset = static_cast<FT_Pos>(phase * 64 / info.subpixel_phases);
+        options.subpixel = true;
+    }
+    return origin_carry;
+}
+
+template <typename Render>
+bool FreetypeFont::ForEachFace(const FontInfo& info, GlyphRenderOptions& options, Render render) {
+    return ForEachFace(font_info_.find(std::string(info.name.data())), info, options, render);
+}
+
+template <typename Render>
+bool FreetypeFont::ForEachFace(FamilyMap::iterator family, const FontInfo& info, GlyphRenderOptions& options, Render render) {
+    if (family == font_info_.end()) {
+        return false;
+    }
+    for (auto& famliy : family->second) {
+        for (auto face : famliy->faces) {
+            if (face->MatchStyle(info, true, options) && render(face.get())) {
+                return true;
+            }
+        }
+    }
+    if (info.bold || info.italic) {
+        for (auto& famliy : family->second) {
+            for (auto face : famliy->faces) {
+                face->MatchStyle(info, false, options);
+                if (render(face.get())) {
+                    return true;
+                }
+            }
+        }
+    }
+    return false;
+}
+
+void FreetypeFont::RecordUsage(FamilyMap::iterator family, const FontInfo& info, uint32_t char_code) {
+    if (record_usage_ && family != font_info_.end()) {
+        usage_profile_.Record(family->first, info, char_code);
+    }
+}
+
+LinkedList<GlyphBitmapInfo> FreetypeFont::GetGlyphBitmap(void* font, uint32_t char_code, float origin_x) {
     FontInfo* info = (FontInfo*)font;
     LinkedList<GlyphBitmapInfo> result;
-    if (font_info_.find(std::string(info->name.data())) != font_info_.end()) {
-        for (auto& famliy : font_info_.find(std::string(info->name.data()))->second) {
-            for (auto face : famliy->faces) {
-                if (info->bold && !(face->face->style_flags & FT_STYLE_FLAG_BOLD)) {
-                    continue;
+    GlyphRenderOptions options;
+    const int origin_carry = SetupOptions(*info, origin_x, options);
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto family = font_info_.find(std::string(info->name.data()));
+    RecordUsage(family, *info, char_code);
+    ForEachFace(family, *info, options, [&](FreetypeFontFaceInfo* face) {
+        auto r = face->GetGlyphBitmapInfo(char_code, info->size, options);
+        if (!r) {
+            return false;
+        }
+        r->bearing_x += origin_carry;
+        result.add(*r);
+        return true;
+    });
+    return result;
+}
+
+LinkedList<GlyphBitmapInfo> FreetypeFont::GetGlyphBitmap(const FontInfo& font, uint32_t char_code, float origin_x, PrivateGlyphRenderer& renderer) {
+    if (!renderer.Valid()) {
+        return GetGlyphBitmap(const_cast<FontInfo*>(&font), char_code, origin_x);
+    }
+    struct Candidate {
+        FreetypeFontFaceInfo* face;
+        GlyphRenderOptions options;
+        FT_UInt glyph_index;
+    };
+    GlyphRenderOptions options;
+    const int origin_carry = SetupOptions(font, origin_x, options);
+    // Faces that have the character but not the glyph cached, up to the first that has it cached.
+    std::vector<Candidate> candidates;
+    std::shared_ptr<GlyphBitmapInfo> glyph;
+    uint32_t generation;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        auto family = font_info_.find(std::string(font.name.data()));
+        RecordUsage(family, font, char_code);
+        generation = cache_generation_;
+        renderer.SetLcdFilter(lcd_filter_);
+        ForEachFace(family, font, options, [&](FreetypeFontFaceInfo* face) {
+            const FT_UInt glyph_index = face->GlyphIndex(char_code);
+            if (!glyph_index) {
+                return false;
+            }
+            glyph = face->FindGlyph(glyph_index, font.size, options);
+            if (!glyph) {
+                candidates.push_back({face, options, glyph_index});
+            }
+            return glyph != nullptr;
+        });
+    }
+    for (auto& candidate : candidates) {
+        FT_Face face = renderer.Open(candidate.face, candidate.options);
+        std::shared_ptr<GlyphBitmapInfo> rendered = face ? FreetypeFontFaceInfo::RenderGlyph(face, candidate.glyph_index, font.size, candidate.options) : nullptr;
+        if (rendered) {
+            std::lock_guard<std::mutex> lock(mutex_);
+            if (generation == cache_generation_) {
+                candidate.face->StoreGlyph(candidate.glyph_index, font.size, candidate.options, *rendered);
+            }
+            glyph = rendered;
+            break;
+        }
+    }
+    LinkedList<GlyphBitmapInfo> result;
+    if (glyph) {
+        glyph->bearing_x += origin_carry;
+        result.add(*glyph);
+    }
+    return result;
+}
+
+bool FreetypeFont::RenderGlyphBitmap(FontInfo* font, uint32_t char_code, float origin_x, GlyphPixelFormat format, GlyphTargetCallback target, void* user_data, GlyphBitmapInfo* glyph) {
+    GlyphRenderOptions options;
+    const int origin_carry = SetupOptions(*font, origin_x, options);
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto family = font_info_.find(std::string(font->name.data()));
+    RecordUsage(family, *font, char_code);
+    if (!ForEachFace(family, *font, options, [&](FreetypeFontFaceInfo* face) { return face->RenderGlyphTo(char_code, font->size, options, format, target, user_data, glyph); })) {
+        return false;
+    }
+    glyph->bearing_x += origin_carry;
+    return true;
+}
+
+bool FreetypeFont::GetAdvance(const FontInfo& font, uint32_t char_code, int32_t* advance) {
+    GlyphRenderOptions options;
+    SetupOptions(font, 0, options);
+    std::lock_guard<std::mutex> lock(mutex_);
+    return ForEachFace(font, options, [&](FreetypeFontFaceInfo* face) { return face->GetAdvance(char_code, font.size, options, advance); });
+}
+
+int32_t FreetypeFont::GetKerning(const FontInfo& font, uint32_t left, uint32_t right) {
+    GlyphRenderOptions options;
+    SetupOptions(font, 0, options);
+    std::lock_guard<std::mutex> lock(mutex_);
+    FT_Pos kerning = 0;
+    ForEachFace(font, options, [&](FreetypeFontFaceInfo* face) {
+        FT_UInt left_index = face->GlyphIndex(left);
+        if (!left_index) {
+            return false;
+        }
+        FT_UInt right_index = face->GlyphIndex(right);
+        if (right_index) {
+            kerning = face->GetKerning(left_index, right_index, font.size, options);
+        }
+        return true;
+    });
+    return static_cast<int32_t>(kerning);
+}
+
+bool FreetypeFont::GetLineMetrics(const FontInfo& font, int32_t* ascent, int32_t* descent, int32_t* line_gap) {
+    GlyphRenderOptions options;
+    SetupOptions(font, 0, options);
+    std::lock_guard<std::mutex> lock(mutex_);
+    return ForEachFace(font, options, [&](FreetypeFontFaceInfo* face) {
+        FT_Size_Metrics metrics;
+        if (!face->GetLineMetrics(font.size, options, &metrics)) {
+            return false;
+        }
+        *ascent = static_cast<int32_t>(metrics.ascender);
+        *descent = static_cast<int32_t>(-metrics.descender);
+        // Bitmap fonts can report a height below ascender plus descender.
+        *line_gap = static_cast<int32_t>(std::max<FT_Pos>(0, metrics.height - metrics.ascender + metrics.descender));
+        return true;
+    });
+}
+
+SfntVariationKey FreetypeFont::GetVariationKey(const FontInfo& font) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto family = font_info_.find(std::string(font.name.data()));
+    if (family == font_info_.end()) {
+        return SfntVariationKey();
+    }
+    for (auto& font_face : family->second) {
+        for (auto& face : font_face->faces) {
+            if (face->IsVariable()) {
+                GlyphRenderOptions options;
+                face->MatchStyle(font, false, options);
+                return options.variation;
+            }
+        }
+    }
+    return SfntVariationKey();
+}
+
+GlyphPrewarm* FreetypeFont::Prewarm(FontInfo* font, const std::vector<uint32_t>& char_codes, const std::vector<uint32_t>& sizes) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return PrewarmLocked(*font, char_codes, sizes);
+}
+
+GlyphPrewarm* FreetypeFont::PrewarmLocked(const FontInfo& font, const std::vector<uint32_t>& char_codes, const std::vector<uint32_t>& sizes) {
+    GlyphRenderOptions options;
+    options.render_mode = font.render_mode;
+    options.palette_index = font.palette_index;
+    options.subpixel = font.subpixel_phases > 1;
+    std::vector<PrewarmCandidate> candidates;
+    auto family = font_info_.find(std::string(font.name.data()));
+    if (family != font_info_.end()) {
+        for (auto& font_face : family->second) {
+            for (auto& face : font_face->faces) {
+                if (face->MatchStyle(font, true, options)) {
+                    candidates.push_back({face.get(), options});
                 }
-                if (info->italic && !(face->face->style_flags & FT_STYLE_FLAG_ITALIC)) {
+            }
+        }
+        if (font.bold || font.italic) {
+            // The faces matching strictly were tried already.
+            const size_t strict_count = candidates.size();
+            for (auto& font_face : family->second) {
+                for (auto& face : font_face->faces) {
+                    auto end = candidates.begin() + strict_count;
+                    if (std::find_if(candidates.begin(), end, [&face](const PrewarmCandidate& candidate) { return candidate.face == face.get(); }) != end) {
+                        continue;
+                    }
+                    face->MatchStyle(font, false, options);
+                    candidates.push_back({face.get(), options});
+                }
+            }
+        }
+    }
+    return new GlyphPrewarm(this, std::move(candidates), char_codes, sizes, std::max(1u, font.subpixel_phases));
+}
+
+FreetypeFont::~FreetypeFont() {
+    SaveUsageProfile();
+    usage_prewarms_.clear();
+}
+
+bool FreetypeFont::SetUsageProfile(const std::string& path, uint32_t warm_count) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    usage_profile_path_ = path;
+    record_usage_ = !path.empty();
+    const bool loaded = record_usage_ && usage_profile_.Load(path);
+    pending_warm_sets_.clear();
+    if (loaded) {
+        pending_warm_sets_ = usage_profile_.TopEntries(warm_count);
+    }
+    StartUsageWarmSets();
+    return loaded;
+}
+
+bool FreetypeFont::SaveUsageProfile() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return record_usage_ && usage_profile_.Save(usage_profile_path_);
+}
+
+void FreetypeFont::StartUsageWarmSets() {
+    usage_prewarms_.erase(std::remove_if(usage_prewarms_.begin(), usage_prewarms_.end(), [](const std::unique_ptr<GlyphPrewarm>& prewarm) { return prewarm->GetProgress().finished; }), usage_prewarms_.end());
+    for (auto iter = pending_warm_sets_.begin(); iter != pending_warm_sets_.end();) {
+        if (font_info_.find(iter->key.family) == font_info_.end()) {
+            ++iter;
+            continue;
+        }
+        FontInfo font;
+        font.name = iter->key.family.c_str();
+        font.size = static_cast<int>(iter->key.size);
+        font.bold = iter->key.bold;
+        font.italic = iter->key.italic;
+        font.render_mode = iter->key.render_mode;
+        font.subpixel_phases = iter->key.subpixel_phases;
+        font.palette_index = iter->key.palette_index;
+        usage_prewarms_.emplace_back(PrewarmLocked(font, iter->char_codes, std::vector<uint32_t>(1, iter->key.size)));
+        iter = pending_warm_sets_.erase(iter);
+    }
+}
+
+// Private faces a glyph request worker keeps open.
+static const size_t MaxPrivateFaces = 8;
+
+PrivateGlyphRenderer::PrivateGlyphRenderer() {
+    try {
+        library_.reset(new FreetypeLibraryWrapper());
+    } catch (const std::exception&) {
+        // Left invalid, GetGlyphBitmap then renders this worker's requests on the shared faces.
+    }
+}
+
+PrivateGlyphRenderer::~PrivateGlyphRenderer() {
+    for (auto& face : faces_) {
+        FT_Done_Face(face.face);
+    }
+}
+
+void PrivateGlyphRenderer::SetLcdFilter(FT_LcdFilter filter) {
+    if (library_ && filter != lcd_filter_) {
+        FT_Library_SetLcdFilter(library_->ftlib_, filter);
+        lcd_filter_ = filter;
+    }
+}
+
+FT_Face PrivateGlyphRenderer::Open(const FreetypeFontFaceInfo* face, const GlyphRenderOptions& options) {
+    auto iter = std::find_if(faces_.begin(), faces_.end(), [face](const PrivateFace& entry) { return entry.source == face; });
+    if (iter == faces_.end()) {
+        FT_Face private_face = face->OpenPrivate(library_->ftlib_, options);
+        if (!private_face) {
+            return nullptr;
+        }
+        if (faces_.size() >= MaxPrivateFaces) {
+            FT_Done_Face(faces_.back().face);
+            faces_.pop_back();
+        }
+        faces_.insert(faces_.begin(), {face, private_face, options.variation});
+        return private_face;
+    }
+    std::rotate(faces_.begin(), iter, iter + 1);
+    if (face->IsVariable() && faces_.front().variation != options.variation) {
+        face->ApplyVariation(faces_.front().face, options);
+        faces_.front().variation = options.variation;
+    }
+    return faces_.front().face;
+}
+
+// Characters rendered between two stores into the glyph caches.
+static const uint32_t PrewarmChunkSize = 64;
+
+GlyphPrewarm::GlyphPrewarm(FreetypeFont* font, std::vector<PrewarmCandidate> candidates, std::vector<uint32_t> char_codes, std::vector<uint32_t> sizes, uint32_t subpixel_phases)
+    : font_(font),
+      candidates_(std::move(candidates)),
+      char_codes_(std::move(char_codes)),
+      sizes_(std::move(sizes)),
+      subpixel_phases_(subpixel_phases),
+      chunks_per_pass_(static_cast<uint32_t>((char_codes_.size() + PrewarmChunkSize - 1) / PrewarmChunkSize)),
+      task_count_(candidates_.empty() ? 0 : chunks_per_pass_ * static_cast<uint32_t>(sizes_.size()) * subpixel_phases_),
+      next_task_(0),
+      done_(0),
+      running_threads_(0),
+      cancelled_(false),
+      failed_(false) {
+    const uint32_t hardware = std::max(1u, std::thread::hardware_concurrency());
+    const uint32_t thread_count = std::min(hardware, task_count_);
+    running_threads_ = thread_count;
+    for (uint32_t i = 0; i < thread_count; ++i) {
+        threads_.emplace_back(&GlyphPrewarm::WorkerLoop, this);
+    }
+}
+
+GlyphPrewarm::~GlyphPrewarm() {
+    cancelled_ = true;
+    Wait();
+}
+
+PrewarmProgress GlyphPrewarm::GetProgress() const {
+    PrewarmProgress progress;
+    progress.total = static_cast<uint32_t>(char_codes_.size() * sizes_.size()) * subpixel_phases_;
+    progress.done = candidates_.empty() ? progress.total : done_.load();
+    progress.finished = running_threads_ == 0;
+    progress.failed = failed_;
+    return progress;
+}
+
+void GlyphPrewarm::Wait() {
+    std::lock_guard<std::mutex> lock(wait_mutex_);
+    for (auto& thread : threads_) {
+        if (thread.joinable()) {
+            thread.join();
+        }
+    }
+}
+
+void GlyphPrewarm::WorkerLoop() {
+    FT_LcdFilter lcd_filter;
+    {
+        std::lock_guard<std::mutex> lock(font_->mutex_);
+        lcd_filter = font_->lcd_filter_;
+    }
+    // A library with a memory record of its own, so prewarming stays out of the face pool's
+    // memory budget instead of making it close the shared faces.
+    std::unique_ptr<FreetypeLibraryWrapper> private_library;
+    try {
+        private_library.reset(new FreetypeLibraryWrapper());
+        FT_Library_SetLcdFilter(private_library->ftlib_, lcd_filter);
+    } catch (const std::exception&) {
+        // Reported through GetProgress, the other threads render this one's share.
+        failed_ = true;
+    }
+    FT_Library library = private_library ? private_library->ftlib_ : NULL;
+    // Private faces are opened the first time a candidate is needed and kept for later chunks.
+    std::vector<FT_Face> faces(candidates_.size(), nullptr);
+    std::vector<bool> unusable(candidates_.size(), false);
+    struct Rendered {
+        size_t candidate;
+        uint32_t char_code;
+        FT_UInt glyph_index;
+        std::shared_ptr<GlyphBitmapInfo> glyph;
+    };
+    std::vector<Rendered> rendered;
+    std::vector<bool> skip;
+    while (library && !cancelled_) {
+        const uint32_t task = next_task_++;
+        if (task >= task_count_) {
+            break;
+        }
+        const uint32_t chunk = task % chunks_per_pass_;
+        const uint32_t phase = (task / chunks_per_pass_) % subpixel_phases_;
+        const uint32_t size = sizes_[task / chunks_per_pass_ / subpixel_phases_];
+        const size_t begin = chunk * PrewarmChunkSize;
+        const size_t end = std::min(char_codes_.size(), begin + PrewarmChunkSize);
+        uint32_t generation;
+        {
+            std::lock_guard<std::mutex> lock(font_->mutex_);
+            generation = font_->cache_generation_;
+            // Skip characters an earlier request or prewarm left nothing to do for: the first face
+            // having them holds the glyph in the cache, or no face has them. A face whose glyph index
+            // is not known yet may still need to render.
+            skip.assign(end - begin, true);
+            for (size_t i = begin; i < end; ++i) {
+                for (auto& candidate : candidates_) {
+                    FT_UInt glyph_index;
+                    if (!candidate.face->KnownGlyphIndex(char_codes_[i], &glyph_index)) {
+                        skip[i - begin] = false;
+                        break;
+                    }
+                    if (glyph_index) {
+                        GlyphRenderOptions options = candidate.options;
+                        options.x_offset = phase * 64 / subpixel_phases_;
+                        skip[i - begin] = candidate.face->HasGlyph(glyph_index, size, options);
+                        break;
+                    }
+                }
+            }
+        }
+        rendered.clear();
+        for (size_t i = begin; i < end; ++i) {
+            if (skip[i - begin]) {
+                continue;
+            }
+            const uint32_t char_code = char_codes_[i];
+            for (size_t candidate = 0; candidate < candidates_.size(); ++candidate) {
+                if (unusable[candidate]) {
                     continue;
                 }
-                auto r = face->GetGlyphBitmapInfo(char_code, info->size);
-                if (r) {
-                    result.add(*r);
-                    return result;
+                if (!faces[candidate]) {
+                    faces[candidate] = candidates_[candidate].face->OpenPrivate(library, candidates_[candidate].options);
+                    if (!faces[candidate]) {
+                        unusable[candidate] = true;
+                        continue;
+                    }
+                }
+                GlyphRenderOptions options = candidates_[candidate].options;
+                options.x_offset = phase * 64 / subpixel_phases_;
+                const FT_UInt glyph_index = FT_Get_Char_Index(faces[candidate], char_code);
+                std::shared_ptr<GlyphBitmapInfo> glyph = glyph_index ? FreetypeFontFaceInfo::RenderGlyph(faces[candidate], glyph_index, size, options) : nullptr;
+                rendered.push_back({candidate, char_code, glyph_index, glyph});
+                if (glyph) {
+                    break;
                 }
             }
         }
-        if (info->bold || info->italic) {
-            for (auto& famliy : font_info_.find(std::string(info->name.data()))->second) {
-                for (auto face : famliy->faces) {
-                    auto r = face->GetGlyphBitmapInfo(char_code, info->size);
-                    if (r) {
-                        result.add(*r);
-                        return result;
+        {
+            std::lock_guard<std::mutex> lock(font_->mutex_);
+            if (generation == font_->cache_generation_) {
+                for (auto& result : rendered) {
+                    PrewarmCandidate& candidate = candidates_[result.candidate];
+                    candidate.face->StoreGlyphIndex(result.char_code, result.glyph_index);
+                    if (result.glyph) {
+                        GlyphRenderOptions options = candidate.options;
+                        options.x_offset = phase * 64 / subpixel_phases_;
+                        candidate.face->StoreGlyph(result.glyph_index, size, options, *result.glyph);
                     }
                 }
             }
         }
+        done_ += static_cast<uint32_t>(end - begin);
     }
-    return result;
+    for (auto face : faces) {
+        if (face) {
+            FT_Done_Face(face);
+        }
+    }
+    --running_threads_;
 }
 
 void FreetypeFont::Destroy(FontInfo* font) { delete font; }
@@ -1,26 +1,158 @@
 ﻿#pragma once
 
 #include "font.h"
+#include "cache.h"
+#include "profile.h"
+#include "sfnt.h"
 #include "ft2build.h"
 #include FT_FREETYPE_H
+#include FT_OUTLINE_H
+#include FT_ADVANCES_H
+#include FT_LCD_FILTER_H
+#include FT_COLOR_H
+#include FT_MULTIPLE_MASTERS_H
 #include <iostream>
+#include <list>
+#include <atomic>
+#include <memory>
+#include <mutex>
 #include <string>
+#include <thread>
 #include <unordered_map>
 #include <vector>
 
 namespace Font {
 
+struct GlyphRenderOptions {
+    // Horizontal origin offset of the subpixel phase, 26.6.
+    FT_Pos x_offset = 0;
+    // Subpixel positioned glyphs are only hinted vertically and keep their linear advance.
+    bool subpixel = false;
+    GlyphRenderMode render_mode = GlyphRenderMode::Gray;
+    uint32_t palette_index = 0;
+    // Design coordinates (16.16) for every axis of a variable face, empty for static faces.
+    std::vector<FT_Fixed> coordinates;
+    // The quantized coordinates, all zero for the default instance.
+    SfntVariationKey variation;
+};
+
+class FreetypeFontFaceInfo;
+
+struct GlyphCacheKey {
+    const FreetypeFontFaceInfo* face;
+    FT_UInt glyph_index;
+    uint32_t size;
+    FT_Pos x_offset;
+    bool subpixel;
+    GlyphRenderMode render_mode;
+    uint32_t palette_index;
+    SfntVariationKey variation;
+    bool operator==(const GlyphCacheKey& other) const {
+        return face == other.face && glyph_index == other.glyph_index && size == other.size && x_offset == other.x_offset && subpixel == other.subpixel && render_mode == other.render_mode && palette_index == other.palette_index &&
+               variation == other.variation;
+    }
+};
+
+struct GlyphCacheKeyHash {
+    size_t operator()(const GlyphCacheKey& key) const {
+        uint64_t value = (uint64_t(key.glyph_index) << 32) ^ (uint64_t(key.size) << 12) ^ (uint64_t(key.x_offset) << 4) ^ (uint64_t(key.render_mode) << 1) ^ uint64_t(key.subpixel) ^ (uint64_t(key.palette_index) << 24) ^ key.variation.Hash();
+        return std::hash<const void*>()(key.face) ^ std::hash<uint64_t>()(value);
+    }
+};
+
+// Rendered glyphs of all faces, held to a byte budget.
+typedef TwoQueueCache<GlyphCacheKey, GlyphBitmapInfo, GlyphCacheKeyHash> GlyphCache;
+static const size_t DefaultGlyphCacheBudget = size_t(64) << 20;
+
+// FT_Faces are opened on first use, once more than the configured number are open or
+// FreeType's allocations exceed the memory budget the least recently used ones are
+// closed again. Closed faces reopen from the retained font data on their next use.
+class FreetypeFacePool {
+public:
+    ~FreetypeFacePool();
+    void SetMaxOpenFaces(size_t max_open_faces);
+    void SetMaxMemory(size_t max_memory);
+    FacePoolStats GetStats() const;
+    // Mark `face` as the most recently used open face, closing idle faces above the cap.
+    void Touch(FreetypeFontFaceInfo* face);
+    void Remove(FreetypeFontFaceInfo* face);
+
+private:
+    void Trim(FreetypeFontFaceInfo* keep);
+    // Most recently used first.
+    std::list<FreetypeFontFaceInfo*> open_faces_;
+    size_t max_open_faces_ = 0;
+    size_t max_memory_ = 0;
+    uint64_t opened_ = 0;
+    uint64_t evicted_ = 0;
+};
+
 class FreetypeFontFaceInfo {
 public:
     FreetypeFontFaceInfo() = delete;
     FreetypeFontFaceInfo(const FreetypeFontFaceInfo&) = delete;
-    FreetypeFontFaceInfo(FT_Long face_idx, FT_Long instance_idx, FT_Long id, FT_Face face);
+    // `data` stays owned by the FreetypeFontFace and outlives this face.
+    FreetypeFontFaceInfo(const FT_Byte* data, FT_Long size, FT_Long face_idx, const SfntFaceDescription& description, FreetypeFacePool* pool, GlyphCache* cache);
     ~FreetypeFontFaceInfo();
-    std::shared_ptr<GlyphBitmapInfo> GetGlyphBitmapInfo(uint32_t char_code, uint32_t size);
+    // Open the FT_Face if needed and mark it as recently used, returns null if FreeType cannot open it.
+    FT_Face Open();
+    void Close();
+    // Check whether this face can render `info`'s style and fill in the variation coordinates for it.
+    // Variable faces reach bold and italic through their wght, ital and slnt axes.
+    bool MatchStyle(const FontInfo& info, bool strict, GlyphRenderOptions& options) const;
+    bool IsVariable() const { return !axes_.empty(); }
+    std::shared_ptr<GlyphBitmapInfo> GetGlyphBitmapInfo(uint32_t char_code, uint32_t size, const GlyphRenderOptions& options = GlyphRenderOptions());
+    // Advance of `char_code` in 26.6 as the rendered glyph would report it, without rendering outline glyphs.
+    bool GetAdvance(uint32_t char_code, uint32_t size, const GlyphRenderOptions& options, int32_t* advance);
+    // Horizontal kerning between two glyphs of this face at `size`, 26.6. Read from the face's
+    // pair table, so it needs no open face; FreeType is only asked for faces that are not sfnt.
+    FT_Pos GetKerning(FT_UInt left, FT_UInt right, uint32_t size, const GlyphRenderOptions& options);
+    // Ascender, descender (negative below the baseline) and line height of the face at `size`, 26.6.
+    bool GetLineMetrics(uint32_t size, const GlyphRenderOptions& options, FT_Size_Metrics* metrics);
+    // Glyph index of `char_code`, 0 if the face has none or cannot be opened.
+    FT_UInt GlyphIndex(uint32_t char_code);
+    // Render into memory handed out by `target` instead of a new buffer, see RenderGlyphBitmap.
+    bool RenderGlyphTo(uint32_t char_code, uint32_t size, const GlyphRenderOptions& options, GlyphPixelFormat format, GlyphTargetCallback target, void* user_data, GlyphBitmapInfo* glyph);
+    // Open a private FT_Face on `library` from the retained font data, set to the variation in `options`.
+    // The caller owns it, so it can render on another thread while this face is in use.
+    FT_Face OpenPrivate(FT_Library library, const GlyphRenderOptions& options) const;
+    // Set the variation in `options` on a face opened through OpenPrivate.
+    void ApplyVariation(FT_Face target, const GlyphRenderOptions& options) const;
+    // The cached glyph `glyph_index` renders to, null if it is not cached.
+    std::shared_ptr<GlyphBitmapInfo> FindGlyph(FT_UInt glyph_index, uint32_t size, const GlyphRenderOptions& options);
+    // Glyph index of `char_code` if it was looked up before, without opening the face.
+    bool KnownGlyphIndex(uint32_t char_code, FT_UInt* glyph_index) const;
+    // Whether glyph `glyph_index` is cached, without counting it as a request.
+    bool HasGlyph(FT_UInt glyph_index, uint32_t size, const GlyphRenderOptions& options) const;
+    // Add a glyph index looked up or a glyph rendered elsewhere (through OpenPrivate) to the caches.
+    void StoreGlyphIndex(uint32_t char_code, FT_UInt glyph_index) { glyph_indices_.emplace(char_code, glyph_index); }
+    void StoreGlyph(FT_UInt glyph_index, uint32_t size, const GlyphRenderOptions& options, const GlyphBitmapInfo& glyph);
+    // Rasterize glyph `glyph_index` of an FT_Face whose variation is already applied.
+    static std::shared_ptr<GlyphBitmapInfo> RenderGlyph(FT_Face face, FT_UInt glyph_index, uint32_t size, const GlyphRenderOptions& options);
     FT_Long face_idx;
-    FT_Long instance_idx;
-    FT_Long id;
-    FT_Face face;
+    // Null while the face is closed.
+    FT_Face face = nullptr;
+    FT_Long style_flags = 0;
+
+private:
+    friend class FreetypeFacePool;
+    const FT_Byte* data_;
+    FT_Long size_;
+    FreetypeFacePool* pool_;
+    GlyphCache* cache_;
+    std::list<FreetypeFontFaceInfo*>::iterator pool_entry_;
+    bool pooled_ = false;
+    // Axes of a variable face, named instances are reached through coordinates on this one face.
+    std::vector<SfntVariationAxis> axes_;
+    SfntVariationKey applied_variation_;
+    // Open the face with the variation in `options` applied.
+    bool Prepare(const GlyphRenderOptions& options);
+    // Character to glyph index lookups, so cache hits and missing characters need no open face.
+    std::unordered_map<uint32_t, FT_UInt> glyph_indices_;
+    // Kerning pairs in font units, read on first use, and their scale for the last size asked for.
+    std::unique_ptr<SfntKerning> kerning_;
+    uint32_t kerning_size_ = 0;
+    FT_Fixed kerning_scale_ = 0;
 };
 
 class FreetypeFontFace {
@@ -28,7 +160,7 @@ public:
     FreetypeFontFace() = delete;
     FreetypeFontFace(const FreetypeFontFace&) = delete;
 
-    FreetypeFontFace(void* ttf_data, uint32_t size);
+    FreetypeFontFace(void* ttf_data, uint32_t size, FreetypeFacePool* pool, GlyphCache* cache);
 
     ~FreetypeFontFace();
 
@@ -39,15 +171,183 @@ private:
     void* ttf_data_;
 };
 
+class FreetypeFont;
+
+// A face to try for a glyph, in the order FreetypeFont::GetGlyphBitmap tries them.
+struct PrewarmCandidate {
+    FreetypeFontFaceInfo* face;
+    GlyphRenderOptions options;
+};
+
+// Renders character ranges at several sizes on threads of its own. Each thread opens the
+// faces it needs on a private FT_Library, so rasterization runs in parallel and only
+// storing a finished chunk into the glyph caches takes the FreetypeFont lock.
+class GlyphPrewarm {
+public:
+    GlyphPrewarm(FreetypeFont* font, std::vector<PrewarmCandidate> candidates, std::vector<uint32_t> char_codes, std::vector<uint32_t> sizes, uint32_t subpixel_phases);
+    // Stops after the chunks being rendered and waits for the threads.
+    ~GlyphPrewarm();
+    PrewarmProgress GetProgress() const;
+    void Wait();
+
+private:
+    void WorkerLoop();
+
+    FreetypeFont* font_;
+    std::vector<PrewarmCandidate> candidates_;
+    std::vector<uint32_t> char_codes_;
+    std::vector<uint32_t> sizes_;
+    uint32_t subpixel_phases_;
+    uint32_t chunks_per_pass_;
+    uint32_t task_count_;
+    std::atomic<uint32_t> next_task_;
+    std::atomic<uint32_t> done_;
+    std::atomic<uint32_t> running_threads_;
+    std::atomic<bool> cancelled_;
+    std::atomic<bool> failed_;
+    std::mutex wait_mutex_;
+    std::vector<std::thread> threads_;
+};
+
+struct FreetypeLibraryWrapper;
+
+// An FT_Library of one thread and the faces it opened on it from the shared faces' data, so
+// glyph request workers rasterize outside the FreetypeFont lock. The most recently used
+// faces are kept open.
+class PrivateGlyphRenderer {
+public:
+    PrivateGlyphRenderer();
+    ~PrivateGlyphRenderer();
+    // False if the library could not be created, callers render on the shared faces instead.
+    bool Valid() const { return library_ != nullptr; }
+    void SetLcdFilter(FT_LcdFilter filter);
+    // The private copy of `face` with the variation in `options` applied, null if it cannot be opened.
+    FT_Face Open(const FreetypeFontFaceInfo* face, const GlyphRenderOptions& options);
+
+private:
+    struct PrivateFace {
+        const FreetypeFontFaceInfo* source;
+        FT_Face face;
+        SfntVariationKey variation;
+    };
+    std::unique_ptr<FreetypeLibraryWrapper> library_;
+    FT_LcdFilter lcd_filter_ = FT_LCD_FILTER_NONE;
+    // Most recently used first.
+    std::vector<PrivateFace> faces_;
+};
+
+// Faces, caches and the FreeType library are shared by every caller, so the public
+// members serialize on one mutex. Glyph request workers only take it to look up and
+// store glyphs, they rasterize on a PrivateGlyphRenderer of their own.
 class FreetypeFont {
 public:
+    // Writes the usage profile back and stops background prewarming.
+    ~FreetypeFont();
     FontInfo* Create(const std::string& name, uint32_t size);
     std::string Load(void* ttf_data, uint32_t size);
-    LinkedList<GlyphBitmapInfo> GetGlyphBitmap(void* font, uint32_t char_code);
+    void SetLcdFilter(LcdFilter filter);
+    void SetMaxOpenFaces(size_t max_open_faces) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        face_pool_.SetMaxOpenFaces(max_open_faces);
+    }
+    void SetMaxFreetypeMemory(size_t max_memory) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        face_pool_.SetMaxMemory(max_memory);
+    }
+    FacePoolStats GetFacePoolStats() {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return face_pool_.GetStats();
+    }
+    void SetGlyphCacheBudget(size_t bytes) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        glyph_cache_.SetBudget(bytes);
+    }
+    GlyphCacheStats GetGlyphCacheStats();
+    LinkedList<GlyphBitmapInfo> GetGlyphBitmap(void* font, uint32_t char_code, float origin_x = 0.0f);
+    // GetGlyphBitmap for glyph request workers: glyphs missing from the cache are rendered on
+    // `renderer` with the lock dropped, then stored unless the caches were cleared meanwhile.
+    LinkedList<GlyphBitmapInfo> GetGlyphBitmap(const FontInfo& font, uint32_t char_code, float origin_x, PrivateGlyphRenderer& renderer);
+    bool RenderGlyphBitmap(FontInfo* font, uint32_t char_code, float origin_x, GlyphPixelFormat format, GlyphTargetCallback target, void* user_data, GlyphBitmapInfo* glyph);
+    // Advance of a character in 26.6, false if no face of the family has it.
+    bool GetAdvance(const FontInfo& font, uint32_t char_code, int32_t* advance);
+    // Kerning between two characters in 26.6, 0 unless the same face renders both.
+    int32_t GetKerning(const FontInfo& font, uint32_t left, uint32_t right);
+    // Line metrics of the first face matching the font's style at its size, 26.6.
+    bool GetLineMetrics(const FontInfo& font, int32_t* ascent, int32_t* descent, int32_t* line_gap);
+    // The variation the family's first variable face renders `font` with, default for static families.
+    SfntVariationKey GetVariationKey(const FontInfo& font);
+    GlyphPrewarm* Prewarm(FontInfo* font, const std::vector<uint32_t>& char_codes, const std::vector<uint32_t>& sizes);
+    bool SetUsageProfile(const std::string& path, uint32_t warm_count);
+    bool SaveUsageProfile();
     void Destroy(FontInfo* font);
 
 private:
-    std::unordered_map<std::string, std::vector<std::shared_ptr<FreetypeFontFace>>> font_info_;
+    friend class GlyphPrewarm;
+    GlyphPrewarm* PrewarmLocked(const FontInfo& font, const std::vector<uint32_t>& char_codes, const std::vector<uint32_t>& sizes);
+    // Prewarm the profile's warm sets whose family has been loaded.
+    void StartUsageWarmSets();
+    typedef std::unordered_map<std::string, std::vector<std::shared_ptr<FreetypeFontFace>>> FamilyMap;
+    // Call `render` with the faces of `info`'s family that match its style, then with all of them for
+    // bold or italic fonts, until it returns true. `options` is filled in for each face.
+    template <typename Render>
+    bool ForEachFace(const FontInfo& info, GlyphRenderOptions& options, Render render);
+    // As above on the family already looked up, font_info_.end() if it is not loaded.
+    template <typename Render>
+    bool ForEachFace(FamilyMap::iterator family, const FontInfo& info, GlyphRenderOptions& options, Render render);
+    // Count a glyph request in the usage profile if it is recorded, fonts of families not loaded are not.
+    void RecordUsage(FamilyMap::iterator family, const FontInfo& info, uint32_t char_code);
+    std::mutex mutex_;
+    FT_LcdFilter lcd_filter_ = FT_LCD_FILTER_NONE;
+    // Bumped whenever the caches are cleared, prewarm results rendered before that are dropped.
+    uint32_t cache_generation_ = 0;
+    // Declared first so they outlive the faces registered with them.
+    FreetypeFacePool face_pool_;
+    GlyphCache glyph_cache_{DefaultGlyphCacheBudget};
+    // Never erased from, so the family names are interned here.
+    FamilyMap font_info_;
+    UsageProfile usage_profile_;
+    std::string usage_profile_path_;
+    bool record_usage_ = false;
+    std::vector<UsageWarmSet> pending_warm_sets_;
+    // Declared last so the threads stop before anything they use is destroyed.
+    std::vector<std::unique_ptr<GlyphPrewarm>> usage_prewarms_;
 };
 FreetypeFont& GetFreetypeFontInstance();
+
+// A font's variation coordinates as the faces quantize them, default without any. Settings that
+// render the same glyphs get the same key, so caches keyed on it agree with the glyph cache.
+SfntVariationKey MakeVariationKey(const FontInfo& font);
+// Bold, italic and the render mode of `font` in one field, as the atlas and text caches key them.
+uint32_t StyleKey(const FontInfo& font);
+// Snap `origin_x` to the nearest of the font's subpixel phases, the phase (0 without subpixel
+// positioning) goes to `phase`. Returns the whole pixels the snapping carried the origin past its floor.
+int SnapOrigin(const FontInfo& font, float origin_x, uint32_t* phase);
+
+// Everything in a font's settings that selects the pixels of a glyph, so glyphs of equal settings
+// are shared whichever FontInfo asks for them. Keys atlas glyphs and glyph requests.
+struct FontGlyphKey {
+    std::string family;
+    uint32_t size;
+    // Bold, italic and the render mode.
+    uint32_t style;
+    uint32_t palette_index;
+    // The quantized variation coordinates, default without any.
+    SfntVariationKey variation;
+    uint32_t char_code;
+    // Subpixel phase out of `phases`.
+    uint32_t phase;
+    uint32_t phases;
+    bool operator==(const FontGlyphKey& other) const {
+        return char_code == other.char_code && size == other.size && style == other.style && palette_index == other.palette_index && variation == other.variation && phase == other.phase && phases == other.phases && family == other.family;
+    }
+};
+
+struct FontGlyphKeyHash {
+    size_t operator()(const FontGlyphKey& key) const {
+        return std::hash<std::string>()(key.family) ^ std::hash<uint64_t>()((uint64_t(key.char_code) << 32) ^ (uint64_t(key.size) << 20) ^ (uint64_t(key.style) << 16) ^ (uint64_t(key.phase) << 8) ^ key.phases ^ (uint64_t(key.palette_index) << 40) ^ key.variation.Hash());
+    }
+};
+
+// Key of `char_code` at `origin_x`, the whole pixels the phase snapping carries over go to `origin_carry`.
+FontGlyphKey MakeFontGlyphKey(const FontInfo& font, uint32_t char_code, float origin_x, int* origin_carry);
 }  // namespace Font
\ No newline at end of file
@@ -0,0 +1,774 @@
+﻿#include "paragraph.h"
+#include "text.h"
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <thread>
+
+namespace Font {
+
+struct BreakRange {
+    uint32_t first;
+    uint32_t last;
+    BreakClass value;
+};
+
+// Ranges outside ASCII whose class is not AL, sorted and disjoint for a binary search. Characters
+// that differ from their block split it.
+static const BreakRange BreakRanges[] = {
+    {0x0085, 0x0085, BreakClass::BK},   {0x00A0, 0x00A0, BreakClass::GL},   {0x00A1, 0x00A1, BreakClass::OP},   {0x00A2, 0x00A2, BreakClass::PO},   {0x00A3, 0x00A5, BreakClass::PR},
+    {0x00AB, 0x00AB, BreakClass::QU},   {0x00AD, 0x00AD, BreakClass::BA},   {0x00B0, 0x00B0, BreakClass::PO},   {0x00B1, 0x00B1, BreakClass::PR},   {0x00BB, 0x00BB, BreakClass::QU},
+    {0x00BF, 0x00BF, BreakClass::OP},   {0x0300, 0x036F, BreakClass::CM},   {0x0483, 0x0489, BreakClass::CM},   {0x0591, 0x05BD, BreakClass::CM},   {0x0610, 0x061A, BreakClass::CM},
+    {0x064B, 0x065F, BreakClass::CM},   {0x0900, 0x0903, BreakClass::CM},   {0x093A, 0x094F, BreakClass::CM},   {0x1AB0, 0x1AFF, BreakClass::CM},   {0x1DC0, 0x1DFF, BreakClass::CM},
+    {0x2000, 0x2006, BreakClass::BA},   {0x2007, 0x2007, BreakClass::GL},   {0x2008, 0x200A, BreakClass::BA},   {0x200B, 0x200B, BreakClass::ZW},   {0x200C, 0x200D, BreakClass::CM},
+    {0x2010, 0x2010, BreakClass::BA},   {0x2011, 0x2011, BreakClass::GL},   {0x2012, 0x2013, BreakClass::BA},   {0x2014, 0x2014, BreakClass::B2},   {0x2018, 0x201F, BreakClass::QU},
+    {0x2027, 0x2027, BreakClass::BA},   {0x2028, 0x2029, BreakClass::BK},   {0x202F, 0x202F, BreakClass::GL},   {0x2030, 0x2037, BreakClass::PO},   {0x2039, 0x203A, BreakClass::QU},
+    {0x2044, 0x2044, BreakClass::IS},   {0x2060, 0x2060, BreakClass::WJ},   {0x20A0, 0x20CF, BreakClass::PR},   {0x20D0, 0x20FF, BreakClass::CM},   {0x2E80, 0x2FFF, BreakClass::ID},
+    {0x3000, 0x3000, BreakClass::BA},   {0x3001, 0x3002, BreakClass::CL},   {0x3003, 0x3004, BreakClass::ID},   {0x3005, 0x3005, BreakClass::NS},   {0x3006, 0x3007, BreakClass::ID},
+    {0x3012, 0x3013, BreakClass::ID},   {0x301C, 0x303A, BreakClass::ID},   {0x303B, 0x303B, BreakClass::NS},   {0x303C, 0x3040, BreakClass::ID},   {0x3041, 0x3041, BreakClass::NS},
+    {0x3042, 0x3042, BreakClass::ID},   {0x3043, 0x3043, BreakClass::NS},   {0x3044, 0x3044, BreakClass::ID},   {0x3045, 0x3045, BreakClass::NS},   {0x3046, 0x3046, BreakClass::ID},
+    {0x3047, 0x3047, BreakClass::NS},   {0x3048, 0x3048, BreakClass::ID},   {0x3049, 0x3049, BreakClass::NS},   {0x304A, 0x3062, BreakClass::ID},   {0x3063, 0x3063, BreakClass::NS},
+    {0x3064, 0x3082, BreakClass::ID},   {0x3083, 0x3083, BreakClass::NS},   {0x3084, 0x3084, BreakClass::ID},   {0x3085, 0x3085, BreakClass::NS},   {0x3086, 0x3086, BreakClass::ID},
+    {0x3087, 0x3087, BreakClass::NS},   {0x3088, 0x308D, BreakClass::ID},   {0x308E, 0x308E, BreakClass::NS},   {0x308F, 0x3094, BreakClass::ID},   {0x3095, 0x3096, BreakClass::NS},
+    {0x3097, 0x3098, BreakClass::ID},   {0x3099, 0x309A, BreakClass::CM},   {0x309B, 0x309E, BreakClass::NS},   {0x309F, 0x309F, BreakClass::ID},   {0x30A0, 0x30A1, BreakClass::NS},
+    {0x30A2, 0x30A2, BreakClass::ID},   {0x30A3, 0x30A3, BreakClass::NS},   {0x30A4, 0x30A4, BreakClass::ID},   {0x30A5, 0x30A5, BreakClass::NS},   {0x30A6, 0x30A6, BreakClass::ID},
+    {0x30A7, 0x30A7, BreakClass::NS},   {0x30A8, 0x30A8, BreakClass::ID},   {0x30A9, 0x30A9, BreakClass::NS},   {0x30AA, 0x30C2, BreakClass::ID},   {0x30C3, 0x30C3, BreakClass::NS},
+    {0x30C4, 0x30E2, BreakClass::ID},   {0x30E3, 0x30E3, BreakClass::NS},   {0x30E4, 0x30E4, BreakClass::ID},   {0x30E5, 0x30E5, BreakClass::NS},   {0x30E6, 0x30E6, BreakClass::ID},
+    {0x30E7, 0x30E7, BreakClass::NS},   {0x30E8, 0x30ED, BreakClass::ID},   {0x30EE, 0x30EE, BreakClass::NS},   {0x30EF, 0x30F4, BreakClass::ID},   {0x30F5, 0x30F6, BreakClass::NS},
+    {0x30F7, 0x30FA, BreakClass::ID},   {0x30FB, 0x30FE, BreakClass::NS},   {0x30FF, 0x31EF, BreakClass::ID},   {0x31F0, 0x31FF, BreakClass::NS},   {0x3200, 0x4DBF, BreakClass::ID},
+    {0x4E00, 0xA4CF, BreakClass::ID},   {0xAC00, 0xD7A3, BreakClass::ID},   {0xF900, 0xFAFF, BreakClass::ID},   {0xFE00, 0xFE0F, BreakClass::CM},   {0xFE20, 0xFE2F, BreakClass::CM},
+    {0xFE30, 0xFE4F, BreakClass::ID},   {0xFEFF, 0xFEFF, BreakClass::WJ},   {0xFF01, 0xFF01, BreakClass::EX},   {0xFF02, 0xFF07, BreakClass::ID},   {0xFF08, 0xFF08, BreakClass::OP},
+    {0xFF09, 0xFF09, BreakClass::CP},   {0xFF0A, 0xFF0B, BreakClass::ID},   {0xFF0C, 0xFF0C, BreakClass::CL},   {0xFF0D, 0xFF0D, BreakClass::ID},   {0xFF0E, 0xFF0E, BreakClass::CL},
+    {0xFF0F, 0xFF19, BreakClass::ID},   {0xFF1A, 0xFF1B, BreakClass::NS},   {0xFF1C, 0xFF1E, BreakClass::ID},   {0xFF1F, 0xFF1F, BreakClass::EX},   {0xFF20, 0xFF3A, BreakClass::ID},
+    {0xFF3B, 0xFF3B, BreakClass::OP},   {0xFF3C, 0xFF3C, BreakClass::ID},   {0xFF3D, 0xFF3D, BreakClass::CP},   {0xFF3E, 0xFF5A, BreakClass::ID},   {0xFF5B, 0xFF5B, BreakClass::OP},
+    {0xFF5C, 0xFF5C, BreakClass::ID},   {0xFF5D, 0xFF5D, BreakClass::CL},   {0xFF5E, 0xFF60, BreakClass::ID},   {0xFF67, 0xFF70, BreakClass::NS},   {0xFFE0, 0xFFE6, BreakClass::ID},
+    {0x1F000, 0x1FAFF, BreakClass::ID}, {0x20000, 0x3FFFD, BreakClass::ID}, {0xE0100, 0xE01EF, BreakClass::CM},
+};
+
+BreakClass GetBreakClass(uint32_t char_code) {
+    if (char_code < 0x80) {
+        switch (char_code) {
+            case '\n': return BreakClass::LF;
+            case '\r': return BreakClass::CR;
+            case 0x0B:
+            case 0x0C: return BreakClass::BK;
+            case ' ': return BreakClass::SP;
+            case '\t':
+            case '|': return BreakClass::BA;
+            case '-': return BreakClass::HY;
+            case '(':
+            case '[':
+            case '{': return BreakClass::OP;
+            case ')':
+            case ']': return BreakClass::CP;
+            case '}': return BreakClass::CL;
+            case '"':
+            case '\'': return BreakClass::QU;
+            case '!':
+            case '?': return BreakClass::EX;
+            case ',':
+            case '.':
+            case ':':
+            case ';': return BreakClass::IS;
+            case '/': return BreakClass::SY;
+            case '$':
+            case '+':
+            case '\\': return BreakClass::PR;
+            case '%': return BreakClass::PO;
+            default: return char_code >= '0' && char_code <= '9' ? BreakClass::NU : char_code < 0x20 ? BreakClass::CM : BreakClass::AL;
+        }
+    }
+    // CJK brackets alternate between opening and closing.
+    if ((char_code >= 0x3008 && char_code <= 0x3011) || (char_code >= 0x3014 && char_code <= 0x301B)) {
+        return (char_code & 1) ? BreakClass::CL : BreakClass::OP;
+    }
+    const BreakRange* end = BreakRanges + sizeof(BreakRanges) / sizeof(BreakRanges[0]);
+    const BreakRange* range = std::upper_bound(BreakRanges, end, char_code, [](uint32_t value, const BreakRange& candidate) { return value < candidate.first; });
+    return range != BreakRanges && char_code <= (range - 1)->last ? (range - 1)->value : BreakClass::AL;
+}
+
+// LB23 to LB30: pairs kept together between letters, numbers and their prefixes and suffixes.
+static bool KeepsTogether(BreakClass before, BreakClass after) {
+    switch (before) {
+        case BreakClass::AL: return after == BreakClass::AL || after == BreakClass::NU || after == BreakClass::PR || after == BreakClass::PO || after == BreakClass::OP;
+        case BreakClass::NU: return after == BreakClass::AL || after == BreakClass::NU || after == BreakClass::PR || after == BreakClass::PO || after == BreakClass::OP;
+        case BreakClass::PR: return after == BreakClass::ID || after == BreakClass::AL || after == BreakClass::NU || after == BreakClass::OP;
+        case BreakClass::PO: return after == BreakClass::AL || after == BreakClass::NU || after == BreakClass::OP;
+        case BreakClass::ID: return after == BreakClass::PO;
+        case BreakClass::CL: return after == BreakClass::PO || after == BreakClass::PR;
+        case BreakClass::CP: return after == BreakClass::PO || after == BreakClass::PR || after == BreakClass::AL || after == BreakClass::NU;
+        case BreakClass::HY:
+        case BreakClass::SY: return after == BreakClass::NU;
+        case BreakClass::IS: return after == BreakClass::NU || after == BreakClass::AL;
+        default: return false;
+    }
+}
+
+// Characters after which the pair rules carry no state from before them: neither spaces, which
+// LB14 to LB17 look across, nor combining marks, which take the class of their base.
+static bool ResetsBreakState(BreakClass value) { return value != BreakClass::SP && value != BreakClass::CM; }
+
+// The pair rules from character `from` on. `before` is the class of the previous character, `base`
+// the class of the last one that is not a space. Stops after the first character at or after `stop`
+// that resets the state, returns the end of the breaks written.
+static size_t ScanLineBreaks(const uint32_t* chars, size_t count, uint8_t* breaks, size_t from, BreakClass before, BreakClass base, size_t stop) {
+    for (size_t i = from; i < count; ++i) {
+        BreakClass after = GetBreakClass(chars[i]);
+        const bool last = i >= stop && ResetsBreakState(after);
+        uint8_t action = AllowBreak;
+        if (before == BreakClass::BK || before == BreakClass::LF || (before == BreakClass::CR && after != BreakClass::LF)) {
+            action = MandatoryBreak;
+        } else if (after == BreakClass::BK || after == BreakClass::CR || after == BreakClass::LF || after == BreakClass::SP || after == BreakClass::ZW) {
+            action = NoBreak;
+        } else if (base == BreakClass::ZW) {
+            action = AllowBreak;
+        } else if (after == BreakClass::CM && before != BreakClass::SP) {
+            // LB9: combining marks take the class of the character they attach to.
+            breaks[i] = NoBreak;
+            continue;
+        } else {
+            if (after == BreakClass::CM) {
+                after = BreakClass::AL;
+            }
+            if (after == BreakClass::WJ || before == BreakClass::WJ || before == BreakClass::GL) {
+                action = NoBreak;
+            } else if (after == BreakClass::GL && before != BreakClass::SP && before != BreakClass::BA && before != BreakClass::HY) {
+                action = NoBreak;
+            } else if (after == BreakClass::CL || after == BreakClass::CP || after == BreakClass::EX || after == BreakClass::IS || after == BreakClass::SY) {
+                action = NoBreak;
+            } else if (base == BreakClass::OP || (base == BreakClass::QU && after == BreakClass::OP) || ((base == BreakClass::CL || base == BreakClass::CP) && after == BreakClass::NS) ||
+                       (base == BreakClass::B2 && after == BreakClass::B2)) {
+                // LB14 to LB17 hold across spaces.
+                action = NoBreak;
+            } else if (before == BreakClass::SP) {
+                action = AllowBreak;
+            } else if (after == BreakClass::QU || before == BreakClass::QU || after == BreakClass::BA || after == BreakClass::HY || after == BreakClass::NS) {
+                action = NoBreak;
+            } else if (KeepsTogether(before, after)) {
+                action = NoBreak;
+            }
+        }
+        breaks[i] = action;
+        before = after;
+        if (after != BreakClass::SP) {
+            base = after;
+        }
+        if (last) {
+            return i + 1;
+        }
+    }
+    return count;
+}
+
+void FindLineBreaks(const uint32_t* chars, size_t count, uint8_t* breaks) {
+    if (!count) {
+        return;
+    }
+    breaks[0] = NoBreak;
+    BreakClass first = GetBreakClass(chars[0]);
+    if (first == BreakClass::CM) {
+        first = BreakClass::AL;
+    }
+    ScanLineBreaks(chars, count, breaks, 1, first, first, SIZE_MAX);
+}
+
+size_t UpdateLineBreaks(const uint32_t* chars, size_t count, uint8_t* breaks, size_t first, size_t last) {
+    size_t from = first;
+    while (from > 0 && !ResetsBreakState(GetBreakClass(chars[from - 1]))) {
+        --from;
+    }
+    if (from == 0) {
+        if (!count) {
+            return 0;
+        }
+        breaks[0] = NoBreak;
+        BreakClass value = GetBreakClass(chars[0]);
+        if (value == BreakClass::CM) {
+            value = BreakClass::AL;
+        }
+        return ScanLineBreaks(chars, count, breaks, 1, value, value, std::max<size_t>(last, 1));
+    }
+    const BreakClass value = GetBreakClass(chars[from - 1]);
+    return ScanLineBreaks(chars, count, breaks, from, value, value, last);
+}
+
+static bool IsLineEnd(uint32_t char_code) {
+    BreakClass value = GetBreakClass(char_code);
+    return value == BreakClass::BK || value == BreakClass::CR || value == BreakClass::LF;
+}
+
+// Characters that hang past the end of a line instead of making it wrap.
+static bool IsHanging(uint32_t char_code) { return char_code == ' ' || char_code == 0x3000 || IsLineEnd(char_code); }
+
+// Weights per block of the advance index, blocks range from half to twice this.
+static const size_t AdvanceBlockSize = 512;
+
+template <typename T>
+static void BuildFenwick(std::vector<int64_t>& tree, const std::vector<T>& values) {
+    tree.assign(values.size() + 1, 0);
+    for (size_t i = 1; i < tree.size(); ++i) {
+        tree[i] += values[i - 1];
+        const size_t parent = i + (i & (0 - i));
+        if (parent < tree.size()) {
+            tree[parent] += tree[i];
+        }
+    }
+}
+
+static void AddFenwick(std::vector<int64_t>& tree, size_t index, int64_t delta) {
+    for (size_t i = index + 1; i < tree.size(); i += i & (0 - i)) {
+        tree[i] += delta;
+    }
+}
+
+static int64_t PrefixFenwick(const std::vector<int64_t>& tree, size_t count) {
+    int64_t sum = 0;
+    for (size_t i = std::min(count, tree.size() - 1); i; i -= i & (0 - i)) {
+        sum += tree[i];
+    }
+    return sum;
+}
+
+// The largest count of values whose sum is at most `value`, `value` is left with what remains of it.
+static size_t FindFenwick(const std::vector<int64_t>& tree, int64_t& value) {
+    size_t step = 1;
+    while (step * 2 < tree.size()) {
+        step *= 2;
+    }
+    size_t count = 0;
+    for (; step; step /= 2) {
+        if (count + step < tree.size() && tree[count + step] <= value) {
+            count += step;
+            value -= tree[count];
+        }
+    }
+    return count;
+}
+
+void AdvanceIndex::Build(const std::vector<int32_t>& weights) {
+    blocks_.clear();
+    for (size_t first = 0; first < weights.size(); first += AdvanceBlockSize) {
+        Block block;
+        block.weights.assign(weights.begin() + first, weights.begin() + std::min(weights.size(), first + AdvanceBlockSize));
+        blocks_.push_back(std::move(block));
+    }
+    size_ = weights.size();
+    Rebalance();
+}
+
+void AdvanceIndex::Rebalance() {
+    std::vector<Block> blocks;
+    for (auto& block : blocks_) {
+        if (block.weights.empty()) {
+            continue;
+        }
+        if (!blocks.empty() && blocks.back().weights.size() + block.weights.size() <= AdvanceBlockSize) {
+            blocks.back().weights.insert(blocks.back().weights.end(), block.weights.begin(), block.weights.end());
+            blocks.back().tree.clear();
+            continue;
+        }
+        if (block.weights.size() <= AdvanceBlockSize * 2) {
+            blocks.push_back(std::move(block));
+            continue;
+        }
+        for (size_t first = 0; first < block.weights.size(); first += AdvanceBlockSize) {
+            Block piece;
+            piece.weights.assign(block.weights.begin() + first, block.weights.begin() + std::min(block.weights.size(), first + AdvanceBlockSize));
+            blocks.push_back(std::move(piece));
+        }
+    }
+    blocks_.swap(blocks);
+    std::vector<int64_t> sizes, sums;
+    for (auto& block : blocks_) {
+        if (block.tree.size() != block.weights.size() + 1) {
+            BuildFenwick(block.tree, block.weights);
+        }
+        sizes.push_back(static_cast<int64_t>(block.weights.size()));
+        sums.push_back(PrefixFenwick(block.tree, block.weights.size()));
+    }
+    BuildFenwick(sizes_, sizes);
+    BuildFenwick(sums_, sums);
+}
+
+size_t AdvanceIndex::BlockOf(size_t index, size_t* offset) const {
+    int64_t rest = static_cast<int64_t>(std::min(index, size_ ? size_ - 1 : 0));
+    const size_t block = FindFenwick(sizes_, rest);
+    *offset = index - static_cast<size_t>(PrefixFenwick(sizes_, block));
+    return block;
+}
+
+void AdvanceIndex::Add(size_t index, int64_t delta) {
+    size_t offset;
+    const size_t block = BlockOf(index, &offset);
+    AddFenwick(blocks_[block].tree, offset, delta);
+    AddFenwick(sums_, block, delta);
+    blocks_[block].weights[offset] = static_cast<int32_t>(blocks_[block].weights[offset] + delta);
+}
+
+void AdvanceIndex::Insert(size_t index, size_t count) {
+    if (!count) {
+        return;
+    }
+    if (blocks_.empty()) {
+        blocks_.emplace_back();
+        blocks_.back().weights.assign(count, 0);
+        size_ = count;
+        Rebalance();
+        return;
+    }
+    size_t offset;
+    const size_t block = BlockOf(index, &offset);
+    std::vector<int32_t>& weights = blocks_[block].weights;
+    weights.insert(weights.begin() + offset, count, 0);
+    size_ += count;
+    if (weights.size() > AdvanceBlockSize * 2) {
+        Rebalance();
+        return;
+    }
+    // Zero weights leave the block's sum as it is.
+    BuildFenwick(blocks_[block].tree, weights);
+    AddFenwick(sizes_, block, static_cast<int64_t>(count));
+}
+
+void AdvanceIndex::Erase(size_t index, size_t count) {
+    count = std::min(count, size_ - std::min(index, size_));
+    if (!count) {
+        return;
+    }
+    size_t offset;
+    size_t block = BlockOf(index, &offset);
+    const size_t first_block = block;
+    size_ -= count;
+    while (count) {
+        std::vector<int32_t>& weights = blocks_[block].weights;
+        const size_t take = std::min(count, weights.size() - offset);
+        weights.erase(weights.begin() + offset, weights.begin() + offset + take);
+        BuildFenwick(blocks_[block].tree, weights);
+        count -= take;
+        offset = 0;
+        ++block;
+    }
+    const size_t last_block = block - 1;
+    // Blocks emptied or shrunk below half are merged into their neighbours.
+    for (size_t i = first_block; i <= last_block; ++i) {
+        if (blocks_[i].weights.size() < AdvanceBlockSize / 2) {
+            Rebalance();
+            return;
+        }
+    }
+    for (size_t i = first_block; i <= last_block; ++i) {
+        AddFenwick(sizes_, i, static_cast<int64_t>(blocks_[i].weights.size()) - (PrefixFenwick(sizes_, i + 1) - PrefixFenwick(sizes_, i)));
+        AddFenwick(sums_, i, PrefixFenwick(blocks_[i].tree, blocks_[i].weights.size()) - (PrefixFenwick(sums_, i + 1) - PrefixFenwick(sums_, i)));
+    }
+}
+
+int64_t AdvanceIndex::Prefix(size_t count) const {
+    if (count >= size_) {
+        return PrefixFenwick(sums_, blocks_.size());
+    }
+    size_t offset;
+    const size_t block = BlockOf(count, &offset);
+    return PrefixFenwick(sums_, block) + PrefixFenwick(blocks_[block].tree, offset);
+}
+
+size_t AdvanceIndex::Find(int64_t value) const {
+    const size_t block = FindFenwick(sums_, value);
+    if (block >= blocks_.size()) {
+        return size_;
+    }
+    return static_cast<size_t>(PrefixFenwick(sizes_, block)) + FindFenwick(blocks_[block].tree, value);
+}
+
+ParagraphLayout::ParagraphLayout(FontInfo* font, int32_t width, bool kerning, std::shared_ptr<AdvanceTable> table) : font_(font), table_(std::move(table)), width_(width), kerning_(kerning) { SetText(std::vector<uint32_t>()); }
+
+std::shared_ptr<AdvanceTable> ParagraphLayout::Table() const { return table_ ? table_ : GetAdvanceTableCache().Find(font_); }
+
+void ParagraphLayout::SetText(const std::vector<uint32_t>& chars) {
+    std::shared_ptr<AdvanceTable> table = Table();
+    ascent_ = table->ascent;
+    line_height_ = table->ascent + table->descent + table->line_gap;
+    text_ = chars;
+    breaks_.resize(text_.size());
+    FindLineBreaks(text_.data(), text_.size(), breaks_.data());
+    advances_.resize(text_.size());
+    kernings_.assign(text_.size(), 0);
+    Measure(0, text_.size());
+    weights_.resize(text_.size());
+    Weigh(0, text_.size(), false);
+    index_.Build(weights_);
+    lines_.clear();
+    glyphs_.clear();
+    laid_out_ = reused_ = 0;
+    Reflow(0, SIZE_MAX, 0, std::vector<LineBox>(), std::vector<ParagraphGlyph>());
+}
+
+void ParagraphLayout::Measure(size_t first, size_t last) {
+    std::shared_ptr<AdvanceTable> table = Table();
+    if (first < last) {
+        table->Advances(font_, text_.data() + first, last - first, AdvanceTable::Missing, advances_.data() + first);
+    }
+    // The range's characters and the one after it against the characters before them, an empty
+    // range still gives the characters either side of it new kerning.
+    const size_t from = first ? first - 1 : 0;
+    const size_t to = std::min(last + 1, text_.size());
+    if (kerning_ && to > from + 1) {
+        table->Kernings(font_, text_.data() + from, to - from, kernings_.data() + from + 1);
+    }
+}
+
+void ParagraphLayout::Edit(uint32_t start, uint32_t remove, const std::vector<uint32_t>& chars) {
+    start = std::min<uint32_t>(start, static_cast<uint32_t>(text_.size()));
+    remove = std::min<uint32_t>(remove, static_cast<uint32_t>(text_.size()) - start);
+    // Refill from the line before the one edited, the edit can pull a word up into it.
+    size_t line = 0;
+    while (line + 1 < lines_.size() && lines_[line + 1].start <= start) {
+        ++line;
+    }
+    line = line ? line - 1 : 0;
+    std::vector<LineBox> old_lines(lines_.begin() + line, lines_.end());
+    std::vector<ParagraphGlyph> old_glyphs(glyphs_.begin() + lines_[line].glyph_start, glyphs_.end());
+    lines_.resize(line);
+    glyphs_.resize(old_lines.front().glyph_start);
+
+    text_.erase(text_.begin() + start, text_.begin() + start + remove);
+    text_.insert(text_.begin() + start, chars.begin(), chars.end());
+    advances_.erase(advances_.begin() + start, advances_.begin() + start + remove);
+    advances_.insert(advances_.begin() + start, chars.size(), 0);
+    kernings_.erase(kernings_.begin() + start, kernings_.begin() + start + remove);
+    kernings_.insert(kernings_.begin() + start, chars.size(), 0);
+    Measure(start, start + chars.size());
+    // The characters before the edit get new kerning. The inserted characters enter the index with no
+    // weight, only the blocks the edit falls in are rebuilt.
+    const size_t weigh_from = start ? start - 1 : 0;
+    const size_t weigh_to = std::min(text_.size(), start + chars.size() + 1);
+    if (chars.size() != remove) {
+        weights_.erase(weights_.begin() + start, weights_.begin() + start + remove);
+        weights_.insert(weights_.begin() + start, chars.size(), 0);
+        index_.Erase(start, remove);
+        index_.Insert(start, chars.size());
+    }
+    Weigh(weigh_from, weigh_to, true);
+    breaks_.erase(breaks_.begin() + start, breaks_.begin() + start + remove);
+    breaks_.insert(breaks_.begin() + start, chars.size(), NoBreak);
+    const size_t breaks_end = UpdateLineBreaks(text_.data(), text_.size(), breaks_.data(), start, start + chars.size());
+
+    laid_out_ = reused_ = 0;
+    // Old lines can be taken over from past the edit on, once the break opportunities after their
+    // first character are the old ones again.
+    const size_t reusable = std::max(start + chars.size(), breaks_end ? breaks_end - 1 : 0);
+    Reflow(old_lines.front().start, reusable, static_cast<int64_t>(chars.size()) - static_cast<int64_t>(remove), old_lines, old_glyphs);
+}
+
+void ParagraphLayout::SetWidth(int32_t width) {
+    if (width == width_) {
+        return;
+    }
+    width_ = width;
+    lines_.clear();
+    glyphs_.clear();
+    laid_out_ = reused_ = 0;
+    Reflow(0, SIZE_MAX, 0, std::vector<LineBox>(), std::vector<ParagraphGlyph>());
+}
+
+ParagraphStats ParagraphLayout::GetStats() const {
+    ParagraphStats stats;
+    stats.lines = static_cast<uint32_t>(lines_.size());
+    stats.glyphs = static_cast<uint32_t>(glyphs_.size());
+    stats.height_26_6 = line_height_ * static_cast<int32_t>(lines_.size());
+    stats.lines_laid_out = laid_out_;
+    stats.lines_reused = reused_;
+    return stats;
+}
+
+void ParagraphLayout::Weigh(size_t first, size_t last, bool update) {
+    for (size_t i = first; i < last; ++i) {
+        int32_t weight = advances_[i] == AdvanceTable::Missing || IsLineEnd(text_[i]) ? 0 : advances_[i];
+        if (i + 1 < text_.size()) {
+            weight += kernings_[i + 1];
+        }
+        if (update) {
+            index_.Add(i, static_cast<int64_t>(weight) - weights_[i]);
+        }
+        weights_[i] = weight;
+    }
+}
+
+size_t ParagraphLayout::LineOf(uint32_t index) const {
+    auto line = std::upper_bound(lines_.begin(), lines_.end(), index, [](uint32_t value, const LineBox& box) { return value < box.start; });
+    return line == lines_.begin() ? 0 : static_cast<size_t>(line - lines_.begin()) - 1;
+}
+
+int32_t ParagraphLayout::CaretX(size_t line, uint32_t index) const {
+    // The kerning of a line's last character with the first of the next line is not applied.
+    int64_t x = index_.Prefix(index) - index_.Prefix(lines_[line].start);
+    if (index == lines_[line].start + lines_[line].length && index < text_.size() && index > lines_[line].start) {
+        x -= kernings_[index];
+    }
+    return static_cast<int32_t>(x);
+}
+
+CaretPosition ParagraphLayout::GetCaret(uint32_t index) const {
+    CaretPosition caret;
+    caret.index = std::min<uint32_t>(index, static_cast<uint32_t>(text_.size()));
+    const size_t line = LineOf(caret.index);
+    caret.line = static_cast<uint32_t>(line);
+    caret.x_26_6 = CaretX(line, caret.index);
+    caret.top_26_6 = lines_[line].top_26_6;
+    caret.height_26_6 = line_height_;
+    return caret;
+}
+
+uint32_t ParagraphLayout::HitTest(int32_t x, int32_t y) const {
+    const size_t line = line_height_ > 0 ? static_cast<size_t>(std::max(0, std::min<int32_t>(y / line_height_, static_cast<int32_t>(lines_.size()) - 1))) : 0;
+    const LineBox& box = lines_[line];
+    // A caret after the last character of a wrapped line would land on the next line, a line break
+    // cannot have one after it either.
+    uint32_t last = box.start + box.length;
+    if (box.length && (line + 1 < lines_.size() || IsLineEnd(text_[last - 1]))) {
+        --last;
+    }
+    const int64_t base = index_.Prefix(box.start);
+    uint32_t index = static_cast<uint32_t>(std::min<size_t>(std::max<size_t>(index_.Find(base + std::max(0, x)), box.start), last));
+    // Closer to the leading edge of the next character than to this one's.
+    if (index < last && x - CaretX(line, index) > CaretX(line, index + 1) - x) {
+        ++index;
+    }
+    return index;
+}
+
+LinkedList<SelectionRect> ParagraphLayout::GetSelection(uint32_t start, uint32_t end) const {
+    LinkedList<SelectionRect> rects;
+    start = std::min<uint32_t>(start, static_cast<uint32_t>(text_.size()));
+    end = std::min<uint32_t>(end, static_cast<uint32_t>(text_.size()));
+    if (start >= end) {
+        return rects;
+    }
+    for (size_t line = LineOf(start); line < lines_.size() && lines_[line].start < end; ++line) {
+        const LineBox& box = lines_[line];
+        SelectionRect rect;
+        rect.line = static_cast<uint32_t>(line);
+        rect.left_26_6 = CaretX(line, std::max(start, box.start));
+        rect.right_26_6 = CaretX(line, std::min(end, box.start + box.length));
+        rect.top_26_6 = box.top_26_6;
+        rect.bottom_26_6 = box.top_26_6 + line_height_;
+        rects.add(rect);
+    }
+    return rects;
+}
+
+void ParagraphLayout::PlaceLine(LineBox& line, size_t index) const {
+    line.top_26_6 = line_height_ * static_cast<int32_t>(index);
+    line.baseline_26_6 = line.top_26_6 + ascent_;
+}
+
+void ParagraphLayout::Reflow(size_t start, size_t reusable, int64_t shift, const std::vector<LineBox>& old_lines, const std::vector<ParagraphGlyph>& old_glyphs) {
+    size_t old_line = 0;
+    while (start < text_.size()) {
+        if (start >= reusable) {
+            while (old_line < old_lines.size() && static_cast<int64_t>(old_lines[old_line].start) + shift < static_cast<int64_t>(start)) {
+                ++old_line;
+            }
+            if (old_line < old_lines.size() && static_cast<int64_t>(old_lines[old_line].start) + shift == static_cast<int64_t>(start)) {
+                // The old lines from here on saw the same characters and break opportunities.
+                const int64_t glyph_shift = static_cast<int64_t>(glyphs_.size()) - old_lines[old_line].glyph_start;
+                glyphs_.insert(glyphs_.end(), old_glyphs.begin() + (old_lines[old_line].glyph_start - old_lines.front().glyph_start), old_glyphs.end());
+                for (size_t i = old_line; i < old_lines.size(); ++i) {
+                    LineBox line = old_lines[i];
+                    line.start = static_cast<uint32_t>(line.start + shift);
+                    line.glyph_start = static_cast<uint32_t>(line.glyph_start + glyph_shift);
+                    PlaceLine(line, lines_.size());
+                    lines_.push_back(line);
+                    ++reused_;
+                }
+                return;
+            }
+        }
+        start = LayoutLine(start);
+        ++laid_out_;
+    }
+    // Empty text and text ending in a line break end with an empty line, for the caret to go on.
+    if (text_.empty() || IsLineEnd(text_.back())) {
+        LayoutLine(text_.size());
+        ++laid_out_;
+    }
+}
+
+size_t ParagraphLayout::LayoutLine(size_t start) {
+    LineBox line;
+    line.start = static_cast<uint32_t>(start);
+    line.glyph_start = static_cast<uint32_t>(glyphs_.size());
+    // Last break opportunity and the line width up to its characters.
+    size_t last_break = 0;
+    int32_t last_break_width = 0;
+    int32_t pen = 0;
+    int32_t width = 0;
+    size_t end = start;
+    for (; end < text_.size(); ++end) {
+        if (end > start) {
+            if (breaks_[end] == MandatoryBreak) {
+                break;
+            }
+            if (breaks_[end] == AllowBreak) {
+                last_break = end;
+                last_break_width = width;
+            }
+        }
+        const int32_t kerning = end > start ? kernings_[end] : 0;
+        const int32_t advance = advances_[end] == AdvanceTable::Missing || IsLineEnd(text_[end]) ? 0 : advances_[end];
+        const bool hanging = IsHanging(text_[end]);
+        if (width_ > 0 && !hanging && end > start && pen + kerning + advance > width_) {
+            if (last_break) {
+                end = last_break;
+                width = last_break_width;
+            }
+            // Without a break opportunity, a word wider than the line is cut where it overflows.
+            break;
+        }
+        pen += kerning;
+        if (advances_[end] != AdvanceTable::Missing && !IsLineEnd(text_[end])) {
+            ParagraphGlyph glyph;
+            glyph.char_code = text_[end];
+            glyph.offset = static_cast<uint32_t>(end - start);
+            glyph.x_26_6 = pen;
+            glyphs_.push_back(glyph);
+        }
+        pen += advance;
+        if (!hanging) {
+            width = pen;
+        }
+    }
+    // Glyphs laid out past a break opportunity the line went back to.
+    while (glyphs_.size() > line.glyph_start && glyphs_.back().offset >= end - start) {
+        glyphs_.pop_back();
+    }
+    line.length = static_cast<uint32_t>(end - start);
+    line.glyph_count = static_cast<uint32_t>(glyphs_.size() - line.glyph_start);
+    line.width_26_6 = width;
+    PlaceLine(line, lines_.size());
+    lines_.push_back(line);
+    return end;
+}
+
+// Run `work` for workers 0 to threads - 1, worker 0 on the calling thread.
+template <typename Work>
+static void RunWorkers(uint32_t threads, Work& work) {
+    std::vector<std::thread> workers;
+    for (uint32_t i = 1; i < threads; ++i) {
+        workers.emplace_back([&work, i]() { work(i); });
+    }
+    work(0);
+    for (auto& worker : workers) {
+        worker.join();
+    }
+}
+
+DocumentLayout::DocumentLayout(FontInfo* font, const std::vector<uint32_t>& text, int32_t width, uint32_t threads, bool kerning) {
+    const auto begin = std::chrono::steady_clock::now();
+    // Paragraphs end after a line break, CR LF counting as one.
+    std::vector<size_t> starts(1, 0);
+    for (size_t i = 0; i + 1 < text.size(); ++i) {
+        if (IsLineEnd(text[i]) && !(text[i] == '\r' && text[i + 1] == '\n')) {
+            starts.push_back(i + 1);
+        }
+    }
+    const size_t count = starts.size();
+    starts.push_back(text.size());
+    if (!threads) {
+        threads = std::max(1u, std::thread::hardware_concurrency());
+    }
+    threads = static_cast<uint32_t>(std::min<size_t>(threads, count));
+    for (uint32_t i = 0; i < threads; ++i) {
+        queues_.emplace_back(new WorkQueue());
+    }
+    for (size_t i = 0; i < count; ++i) {
+        const size_t worker = text.empty() ? 0 : std::min<size_t>(threads - 1, starts[i] * threads / text.size());
+        queues_[worker]->paragraphs.push_back(static_cast<uint32_t>(i));
+    }
+
+    std::shared_ptr<AdvanceTable> shared = GetAdvanceTableCache().Find(font);
+    std::vector<std::unique_ptr<ParagraphLayout>> layouts(count);
+    auto work = [&](size_t worker) {
+        std::shared_ptr<AdvanceTable> table = std::make_shared<AdvanceTable>(shared);
+        uint32_t paragraph;
+        while (TakeParagraph(worker, &paragraph)) {
+            layouts[paragraph].reset(new ParagraphLayout(font, width, kerning, table));
+            layouts[paragraph]->SetText(std::vector<uint32_t>(text.begin() + starts[paragraph], text.begin() + starts[paragraph + 1]));
+        }
+    };
+    RunWorkers(threads, work);
+    const auto laid_out = std::chrono::steady_clock::now();
+    Stitch(layouts, starts, shared->ascent, shared->ascent + shared->descent + shared->line_gap, threads);
+
+    stats_.paragraphs = static_cast<uint32_t>(count);
+    stats_.lines = static_cast<uint32_t>(lines_.size());
+    stats_.glyphs = static_cast<uint32_t>(glyphs_.size());
+    stats_.height_26_6 = lines_.empty() ? 0 : lines_.back().top_26_6 + shared->ascent + shared->descent + shared->line_gap;
+    stats_.threads = threads;
+    stats_.steals = steals_;
+    stats_.layout_ms = std::chrono::duration<double, std::milli>(laid_out - begin).count();
+    stats_.stitch_ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - laid_out).count();
+}
+
+bool DocumentLayout::TakeParagraph(size_t worker, uint32_t* paragraph) {
+    for (size_t i = 0; i < queues_.size(); ++i) {
+        WorkQueue& queue = *queues_[(worker + i) % queues_.size()];
+        std::lock_guard<std::mutex> lock(queue.mutex);
+        if (queue.paragraphs.empty()) {
+            continue;
+        }
+        // Owners work forwards through their share, thieves take from its far end.
+        if (i == 0) {
+            *paragraph = queue.paragraphs.front();
+            queue.paragraphs.pop_front();
+        } else {
+            *paragraph = queue.paragraphs.back();
+            queue.paragraphs.pop_back();
+            ++steals_;
+        }
+        return true;
+    }
+    return false;
+}
+
+void DocumentLayout::Stitch(std::vector<std::unique_ptr<ParagraphLayout>>& layouts, const std::vector<size_t>& starts, int32_t ascent, int32_t line_height, uint32_t threads) {
+    // Where each paragraph's lines and glyphs go, and how many of its lines stay. Every paragraph but the
+    // last ends in a line break, the empty line after it is the next paragraph.
+    const size_t count = layouts.size();
+    std::vector<size_t> line_offsets(count + 1, 0);
+    std::vector<size_t> glyph_offsets(count + 1, 0);
+    for (size_t i = 0; i < count; ++i) {
+        const std::vector<LineBox>& lines = layouts[i]->GetLines();
+        const size_t kept = i + 1 < count && lines.size() > 1 && !lines.back().length ? lines.size() - 1 : lines.size();
+        line_offsets[i + 1] = line_offsets[i] + kept;
+        glyph_offsets[i + 1] = glyph_offsets[i] + layouts[i]->GetGlyphs().size();
+    }
+    lines_.resize(line_offsets[count]);
+    glyphs_.resize(glyph_offsets[count]);
+    // Contiguous shares of about the same number of glyphs.
+    auto boundary = [&](size_t worker) -> size_t {
+        if (!worker || worker == threads) {
+            return worker ? count : 0;
+        }
+        return std::upper_bound(glyph_offsets.begin(), glyph_offsets.end() - 1, glyph_offsets[count] * worker / threads) - glyph_offsets.begin() - 1;
+    };
+    auto copy = [&](size_t worker) {
+        const size_t first = boundary(worker);
+        const size_t last = boundary(worker + 1);
+        for (size_t i = first; i < last; ++i) {
+            const std::vector<LineBox>& lines = layouts[i]->GetLines();
+            for (size_t j = 0; j < line_offsets[i + 1] - line_offsets[i]; ++j) {
+                LineBox& line = lines_[line_offsets[i] + j];
+                line = lines[j];
+                line.start += static_cast<uint32_t>(starts[i]);
+                line.glyph_start += static_cast<uint32_t>(glyph_offsets[i]);
+                line.top_26_6 = line_height * static_cast<int32_t>(line_offsets[i] + j);
+                line.baseline_26_6 = line.top_26_6 + ascent;
+            }
+            std::copy(layouts[i]->GetGlyphs().begin(), layouts[i]->GetGlyphs().end(), glyphs_.begin() + glyph_offsets[i]);
+            layouts[i].reset();
+        }
+    };
+    RunWorkers(threads, copy);
+}
+
+}  // namespace Font
@@ -0,0 +1,154 @@
+﻿#pragma once
+
+#include "font.h"
+#include <atomic>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+namespace Font {
+
+class AdvanceTable;
+
+// Line break classes of UAX #14, the subset the rules below tell apart. Complex context
+// dependent classes (SA, AI, CJ and the like) are resolved to their usual default.
+enum class BreakClass : uint8_t { BK, CR, LF, CM, SP, ZW, WJ, GL, BA, HY, B2, OP, CL, CP, QU, EX, IS, SY, NU, PR, PO, NS, ID, AL };
+
+BreakClass GetBreakClass(uint32_t char_code);
+
+enum LineBreakAction : uint8_t { NoBreak = 0, AllowBreak, MandatoryBreak };
+
+// Break opportunities of `chars` after the pair rules of UAX #14 (LB4 to LB31, without the
+// regional indicator, emoji modifier and Hangul syllable rules). breaks[i] is the action
+// before chars[i], breaks[0] is always NoBreak.
+void FindLineBreaks(const uint32_t* chars, size_t count, uint8_t* breaks);
+// Bring `breaks` up to date after chars[first, last) were replaced, the breaks of the characters
+// outside being those of the old text. Only rescans from the last character before `first` that
+// is neither a space nor a combining mark to the first such character at or after `last`, as the
+// pair rules carry no state across those. Returns the end of the breaks rewritten.
+size_t UpdateLineBreaks(const uint32_t* chars, size_t count, uint8_t* breaks, size_t first, size_t last);
+
+// The pen movement of every character in blocks of a few hundred, each with a Fenwick tree of its
+// own, and Fenwick trees over the blocks' sizes and sums. The pen position before any character
+// and the character under any position take O(log n) even on very long lines, and inserting or
+// erasing characters only rebuilds the blocks it touches.
+class AdvanceIndex {
+public:
+    void Build(const std::vector<int32_t>& weights);
+    void Add(size_t index, int64_t delta);
+    // Insert `count` zero weights before weight `index`.
+    void Insert(size_t index, size_t count);
+    void Erase(size_t index, size_t count);
+    // Sum of the first `count` weights.
+    int64_t Prefix(size_t count) const;
+    // The largest count of weights whose sum is at most `value`, weights are taken to be non-negative.
+    size_t Find(int64_t value) const;
+
+private:
+    struct Block {
+        std::vector<int32_t> weights;
+        // One based, tree[i] sums the weights (i - lowbit(i), i].
+        std::vector<int64_t> tree;
+    };
+    // The block holding weight `index` and the index within it, the last block for the end.
+    size_t BlockOf(size_t index, size_t* offset) const;
+    // Split blocks grown past twice the block size, merge small neighbours and rebuild the block trees.
+    void Rebalance();
+    std::vector<Block> blocks_;
+    // Over the blocks' weight counts and weight sums.
+    std::vector<int64_t> sizes_;
+    std::vector<int64_t> sums_;
+    size_t size_ = 0;
+};
+
+// A paragraph broken into lines of at most `width`, kept up to date through edits. The
+// advances, kerning and break opportunities of the text are stored per character, so an edit
+// only looks up what it inserts. Lines are refilled from the line before the edit until a
+// line ends where one of the old lines after the edit began; those lines and their glyphs are
+// taken over as they are, only moved. Not thread safe, the font must outlive it.
+class ParagraphLayout {
+public:
+    // `table` overrides the font's shared advance table, see DocumentLayout.
+    ParagraphLayout(FontInfo* font, int32_t width, bool kerning, std::shared_ptr<AdvanceTable> table = nullptr);
+    void SetText(const std::vector<uint32_t>& chars);
+    // Replace `remove` characters at `start` by `chars`.
+    void Edit(uint32_t start, uint32_t remove, const std::vector<uint32_t>& chars);
+    void SetWidth(int32_t width);
+    const std::vector<LineBox>& GetLines() const { return lines_; }
+    const std::vector<ParagraphGlyph>& GetGlyphs() const { return glyphs_; }
+    const std::vector<uint32_t>& GetText() const { return text_; }
+    FontInfo* GetFont() const { return font_; }
+    ParagraphStats GetStats() const;
+    // Caret before character `index`, at the start of the next line where a line wraps.
+    CaretPosition GetCaret(uint32_t index) const;
+    // Character whose leading edge is nearest to a point, from the top left of the paragraph.
+    uint32_t HitTest(int32_t x, int32_t y) const;
+    // A rectangle per line the characters [start, end) cover.
+    LinkedList<SelectionRect> GetSelection(uint32_t start, uint32_t end) const;
+
+private:
+    // Advances and kerning of text_[first, last), kerning up to `last` included.
+    void Measure(size_t first, size_t last);
+    // Lay out lines from lines_.size() on, starting at character `start`. Old lines starting at
+    // or after `reusable` are taken over once a new line ends at their start, moved by `shift`.
+    void Reflow(size_t start, size_t reusable, int64_t shift, const std::vector<LineBox>& old_lines, const std::vector<ParagraphGlyph>& old_glyphs);
+    // Fill one line from `start`, returns the start of the next.
+    size_t LayoutLine(size_t start);
+    void PlaceLine(LineBox& line, size_t index) const;
+    // Recompute the pen movement of characters [first, last), updating the index when `update`.
+    void Weigh(size_t first, size_t last, bool update);
+    size_t LineOf(uint32_t index) const;
+    // Pen position before character `index` of line `line`, from the line's left edge.
+    int32_t CaretX(size_t line, uint32_t index) const;
+    std::shared_ptr<AdvanceTable> Table() const;
+    FontInfo* font_;
+    std::shared_ptr<AdvanceTable> table_;
+    int32_t width_;
+    bool kerning_;
+    int32_t ascent_ = 0;
+    int32_t line_height_ = 0;
+    std::vector<uint32_t> text_;
+    std::vector<uint8_t> breaks_;
+    // 26.6 advance of every character, AdvanceTable::Missing for characters no font has.
+    std::vector<int32_t> advances_;
+    // Kerning between each character and the one before it.
+    std::vector<int32_t> kernings_;
+    // The advance of each character plus its kerning with the next, indexed for caret positions.
+    std::vector<int32_t> weights_;
+    AdvanceIndex index_;
+    std::vector<LineBox> lines_;
+    std::vector<ParagraphGlyph> glyphs_;
+    uint32_t laid_out_ = 0;
+    uint32_t reused_ = 0;
+};
+
+// A whole document laid out once, paragraph by paragraph on several threads. Paragraphs are
+// dealt out in document order, a contiguous share of the text to each worker's queue. Workers
+// take from the front of their own queue and, once it is empty, steal from the back of the
+// others'. Each worker reads advances through a private table in front of the shared one, so
+// after the first paragraphs they no longer contend for it. The results are joined in order.
+class DocumentLayout {
+public:
+    DocumentLayout(FontInfo* font, const std::vector<uint32_t>& text, int32_t width, uint32_t threads, bool kerning);
+    const std::vector<LineBox>& GetLines() const { return lines_; }
+    const std::vector<ParagraphGlyph>& GetGlyphs() const { return glyphs_; }
+    DocumentStats GetStats() const { return stats_; }
+
+private:
+    struct WorkQueue {
+        std::mutex mutex;
+        std::deque<uint32_t> paragraphs;
+    };
+    // Next paragraph for `worker`, its own first, returns false when every queue is empty.
+    bool TakeParagraph(size_t worker, uint32_t* paragraph);
+    // Join the paragraphs' lines and glyphs in order, copying on `threads` threads once their offsets are known.
+    void Stitch(std::vector<std::unique_ptr<ParagraphLayout>>& layouts, const std::vector<size_t>& starts, int32_t ascent, int32_t line_height, uint32_t threads);
+    std::vector<std::unique_ptr<WorkQueue>> queues_;
+    std::atomic<uint32_t> steals_{0};
+    std::vector<LineBox> lines_;
+    std::vector<ParagraphGlyph> glyphs_;
+    DocumentStats stats_;
+};
+
+}  // namespace Font
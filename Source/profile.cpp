@@ -0,0 +1,187 @@
+﻿#include "profile.h"
+#include "freetype.h"
+#include <algorithm>
+#include <fstream>
+#include <iterator>
+
+namespace Font {
+
+static const char ProfileMagic[4] = {'W', 'F', 'U', 'P'};
+static const uint8_t ProfileVersion = 1;
+// Characters kept per font when saving, the rest are too rare to be worth warming.
+static const size_t ProfileMaxEntriesPerFont = 8192;
+
+static void WriteVarint(std::vector<uint8_t>& out, uint32_t value) {
+    while (value >= 0x80) {
+        out.push_back(static_cast<uint8_t>(value | 0x80));
+        value >>= 7;
+    }
+    out.push_back(static_cast<uint8_t>(value));
+}
+
+static bool ReadVarint(const uint8_t*& p, const uint8_t* end, uint32_t& value) {
+    value = 0;
+    for (int shift = 0; shift < 35; shift += 7) {
+        if (p == end) {
+            return false;
+        }
+        const uint8_t byte = *p++;
+        value |= uint32_t(byte & 0x7F) << shift;
+        if (!(byte & 0x80)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+void UsageProfile::Record(const std::string& family, const FontInfo& font, uint32_t char_code) {
+    const RecordedFont recorded = {&family, static_cast<uint32_t>(font.size), StyleKey(font), font.subpixel_phases, font.palette_index};
+    if (!last_counts_ || !(recorded == last_font_)) {
+        CharCounts*& counts = recorded_[recorded];
+        if (!counts) {
+            UsageProfileKey key = {family, recorded.size, font.bold, font.italic, font.render_mode, font.subpixel_phases, font.palette_index};
+            counts = &counts_[key];
+        }
+        last_font_ = recorded;
+        last_counts_ = counts;
+    }
+    uint32_t& count = (*last_counts_)[char_code];
+    if (count != UINT32_MAX) {
+        ++count;
+    }
+}
+
+bool UsageProfile::Load(const std::string& path) {
+    if (merged_paths_.count(path)) {
+        return true;
+    }
+    std::ifstream file(path, std::ios::binary);
+    if (!file) {
+        return false;
+    }
+    std::vector<uint8_t> data((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+    if (data.size() < 5 || memcmp(data.data(), ProfileMagic, 4) != 0 || data[4] != ProfileVersion) {
+        return false;
+    }
+    const uint8_t* p = data.data() + 5;
+    const uint8_t* end = data.data() + data.size();
+    uint32_t font_count;
+    if (!ReadVarint(p, end, font_count)) {
+        return false;
+    }
+    // Read into a map of its own, a file broken halfway merges nothing.
+    FontCounts loaded;
+    for (uint32_t i = 0; i < font_count; ++i) {
+        uint32_t name_length, size, flags, render_mode, subpixel_phases, palette_index, entry_count;
+        if (!ReadVarint(p, end, name_length) || uint32_t(end - p) < name_length) {
+            return false;
+        }
+        UsageProfileKey key;
+        key.family.assign(reinterpret_cast<const char*>(p), name_length);
+        p += name_length;
+        if (!ReadVarint(p, end, size) || !ReadVarint(p, end, flags) || !ReadVarint(p, end, render_mode) || !ReadVarint(p, end, subpixel_phases) || !ReadVarint(p, end, palette_index) || !ReadVarint(p, end, entry_count)) {
+            return false;
+        }
+        key.size = size;
+        key.bold = (flags & 1) != 0;
+        key.italic = (flags & 2) != 0;
+        key.render_mode = static_cast<GlyphRenderMode>(std::min(render_mode, static_cast<uint32_t>(GlyphRenderMode::LcdVerticalBGR)));
+        key.subpixel_phases = std::max(1u, subpixel_phases);
+        key.palette_index = palette_index;
+        auto& counts = loaded[key];
+        uint32_t char_code = 0;
+        for (uint32_t j = 0; j < entry_count; ++j) {
+            uint32_t delta, count;
+            if (!ReadVarint(p, end, delta) || !ReadVarint(p, end, count)) {
+                return false;
+            }
+            char_code += delta;
+            uint32_t& saved = counts[char_code];
+            saved = std::max(saved, saved + (count + 1) / 2);
+        }
+    }
+    if (p != end) {
+        return false;
+    }
+    for (auto& font : loaded) {
+        // operator[] keeps the values the recorded fonts point to in place.
+        CharCounts& counts = counts_[font.first];
+        for (auto& entry : font.second) {
+            uint32_t& merged = counts[entry.first];
+            merged = std::max(merged, merged + entry.second);
+        }
+    }
+    merged_paths_.insert(path);
+    return true;
+}
+
+bool UsageProfile::Save(const std::string& path) {
+    std::vector<uint8_t> out(ProfileMagic, ProfileMagic + 4);
+    out.push_back(ProfileVersion);
+    WriteVarint(out, static_cast<uint32_t>(counts_.size()));
+    for (auto& font : counts_) {
+        std::vector<std::pair<uint32_t, uint32_t>> entries(font.second.begin(), font.second.end());
+        if (entries.size() > ProfileMaxEntriesPerFont) {
+            std::nth_element(entries.begin(), entries.begin() + ProfileMaxEntriesPerFont, entries.end(), [](const std::pair<uint32_t, uint32_t>& a, const std::pair<uint32_t, uint32_t>& b) { return a.second > b.second; });
+            entries.resize(ProfileMaxEntriesPerFont);
+        }
+        std::sort(entries.begin(), entries.end());
+        const UsageProfileKey& key = font.first;
+        WriteVarint(out, static_cast<uint32_t>(key.family.size()));
+        out.insert(out.end(), key.family.begin(), key.family.end());
+        WriteVarint(out, key.size);
+        WriteVarint(out, (key.bold ? 1u : 0u) | (key.italic ? 2u : 0u));
+        WriteVarint(out, static_cast<uint32_t>(key.render_mode));
+        WriteVarint(out, key.subpixel_phases);
+        WriteVarint(out, key.palette_index);
+        WriteVarint(out, static_cast<uint32_t>(entries.size()));
+        uint32_t previous = 0;
+        for (auto& entry : entries) {
+            WriteVarint(out, entry.first - previous);
+            WriteVarint(out, entry.second);
+            previous = entry.first;
+        }
+    }
+    std::ofstream file(path, std::ios::binary | std::ios::trunc);
+    if (!file) {
+        return false;
+    }
+    file.write(reinterpret_cast<const char*>(out.data()), out.size());
+    if (!file) {
+        return false;
+    }
+    merged_paths_.insert(path);
+    return true;
+}
+
+std::vector<UsageWarmSet> UsageProfile::TopEntries(uint32_t count) const {
+    struct Entry {
+        const UsageProfileKey* key;
+        uint32_t char_code;
+        uint32_t count;
+    };
+    std::vector<Entry> entries;
+    for (auto& font : counts_) {
+        for (auto& usage : font.second) {
+            entries.push_back({&font.first, usage.first, usage.second});
+        }
+    }
+    if (entries.size() > count) {
+        std::nth_element(entries.begin(), entries.begin() + count, entries.end(), [](const Entry& a, const Entry& b) { return a.count > b.count; });
+        entries.resize(count);
+    }
+    std::sort(entries.begin(), entries.end(), [](const Entry& a, const Entry& b) { return a.count > b.count; });
+    std::vector<UsageWarmSet> sets;
+    std::unordered_map<const UsageProfileKey*, size_t> set_index;
+    for (auto& entry : entries) {
+        auto iter = set_index.find(entry.key);
+        if (iter == set_index.end()) {
+            iter = set_index.emplace(entry.key, sets.size()).first;
+            sets.push_back({*entry.key, {}});
+        }
+        sets[iter->second].char_codes.push_back(entry.char_code);
+    }
+    return sets;
+}
+
+}  // namespace Font
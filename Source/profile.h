@@ -0,0 +1,78 @@
+﻿#pragma once
+
+#include "font.h"
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+namespace Font {
+
+// Fonts are told apart by what selects their glyphs, variation coordinates are not recorded.
+struct UsageProfileKey {
+    std::string family;
+    uint32_t size;
+    bool bold;
+    bool italic;
+    GlyphRenderMode render_mode;
+    uint32_t subpixel_phases;
+    uint32_t palette_index;
+    bool operator==(const UsageProfileKey& other) const {
+        return family == other.family && size == other.size && bold == other.bold && italic == other.italic && render_mode == other.render_mode && subpixel_phases == other.subpixel_phases && palette_index == other.palette_index;
+    }
+};
+
+struct UsageProfileKeyHash {
+    size_t operator()(const UsageProfileKey& key) const {
+        return std::hash<std::string>()(key.family) ^ std::hash<uint64_t>()((uint64_t(key.size) << 32) ^ (uint64_t(key.palette_index) << 12) ^ (uint64_t(key.subpixel_phases) << 4) ^ (uint64_t(key.render_mode) << 2) ^ (uint64_t(key.bold) << 1) ^ uint64_t(key.italic));
+    }
+};
+
+// The characters of one font worth rendering ahead of use, most requested first.
+struct UsageWarmSet {
+    UsageProfileKey key;
+    std::vector<uint32_t> char_codes;
+};
+
+// Counts glyph requests per font and size. Saved as a small binary file: per font its
+// key, then the characters sorted and delta coded with their counts, all as varints.
+class UsageProfile {
+public:
+    // `family` is the font's family name interned by the caller, fonts are told apart by its address
+    // so counting a request builds no key string.
+    void Record(const std::string& family, const FontInfo& font, uint32_t char_code);
+    // Merge a saved profile into the counts, halving the saved counts so old usage fades. Nothing is
+    // merged from a file that does not read back whole, or from one these counts were loaded from or
+    // saved to already.
+    bool Load(const std::string& path);
+    bool Save(const std::string& path);
+    // The `count` most requested characters over all fonts, grouped by font.
+    std::vector<UsageWarmSet> TopEntries(uint32_t count) const;
+
+private:
+    typedef std::unordered_map<uint32_t, uint32_t> CharCounts;
+    // A recorded font by the address of its interned family name and its other key fields.
+    struct RecordedFont {
+        const std::string* family;
+        uint32_t size;
+        // Bold, italic and the render mode.
+        uint32_t style;
+        uint32_t subpixel_phases;
+        uint32_t palette_index;
+        bool operator==(const RecordedFont& other) const { return family == other.family && size == other.size && style == other.style && subpixel_phases == other.subpixel_phases && palette_index == other.palette_index; }
+    };
+    struct RecordedFontHash {
+        size_t operator()(const RecordedFont& font) const { return std::hash<const void*>()(font.family) ^ std::hash<uint64_t>()((uint64_t(font.size) << 32) ^ (uint64_t(font.palette_index) << 12) ^ (uint64_t(font.subpixel_phases) << 6) ^ font.style); }
+    };
+    typedef std::unordered_map<UsageProfileKey, CharCounts, UsageProfileKeyHash> FontCounts;
+    // Map values are never moved, so the recorded fonts point into it.
+    FontCounts counts_;
+    // Files whose counts are part of counts_ already.
+    std::unordered_set<std::string> merged_paths_;
+    std::unordered_map<RecordedFont, CharCounts*, RecordedFontHash> recorded_;
+    // Requests mostly come in runs of one font, its counts are kept at hand.
+    RecordedFont last_font_ = {};
+    CharCounts* last_counts_ = nullptr;
+};
+
+}  // namespace Font
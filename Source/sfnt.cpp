@@ -0,0 +1,480 @@
+﻿#include "sfnt.h"
+#include <algorithm>
+
+namespace Font {
+
+static inline uint16_t ReadU16(const uint8_t* p) { return static_cast<uint16_t>((p[0] << 8) | p[1]); }
+static inline uint32_t ReadU32(const uint8_t* p) { return (uint32_t(p[0]) << 24) | (uint32_t(p[1]) << 16) | (uint32_t(p[2]) << 8) | uint32_t(p[3]); }
+
+static const uint32_t TagTtcf = 0x74746366;  // 'ttcf'
+static const uint32_t TagOtto = 0x4F54544F;  // 'OTTO'
+static const uint32_t TagTrue = 0x74727565;  // 'true'
+static const uint32_t TagName = 0x6E616D65;  // 'name'
+static const uint32_t TagOS2 = 0x4F532F32;   // 'OS/2'
+static const uint32_t TagHead = 0x68656164;  // 'head'
+static const uint32_t TagFvar = 0x66766172;  // 'fvar'
+static const uint32_t TagGpos = 0x47504F53;  // 'GPOS'
+static const uint32_t TagKern = 0x6B65726E;  // 'kern'
+static const uint32_t TagMaxp = 0x6D617870;  // 'maxp'
+
+struct SfntTable {
+    const uint8_t* data = nullptr;
+    uint32_t length = 0;
+};
+
+static SfntTable FindTable(const uint8_t* data, size_t size, uint32_t face_offset, uint32_t tag) {
+    SfntTable table;
+    if (size_t(face_offset) + 12 > size) {
+        return table;
+    }
+    const uint16_t num_tables = ReadU16(data + face_offset + 4);
+    if (size_t(face_offset) + 12 + size_t(num_tables) * 16 > size) {
+        return table;
+    }
+    for (uint16_t i = 0; i < num_tables; ++i) {
+        const uint8_t* record = data + face_offset + 12 + i * 16;
+        if (ReadU32(record) != tag) {
+            continue;
+        }
+        const uint32_t offset = ReadU32(record + 8);
+        const uint32_t length = ReadU32(record + 12);
+        if (size_t(offset) + length <= size) {
+            table.data = data + offset;
+            table.length = length;
+        }
+        break;
+    }
+    return table;
+}
+
+// FreeType reduces names to ASCII and replaces everything else with '?', do the same so the
+// family matches what an opened face reports.
+static std::string DecodeName(const uint8_t* string, uint16_t length, bool utf16) {
+    std::string result;
+    if (utf16) {
+        for (uint16_t i = 0; i + 1 < length; i += 2) {
+            uint16_t code = ReadU16(string + i);
+            result += (code >= 32 && code < 128) ? static_cast<char>(code) : '?';
+        }
+    } else {
+        for (uint16_t i = 0; i < length; ++i) {
+            result += (string[i] >= 32 && string[i] < 128) ? static_cast<char>(string[i]) : '?';
+        }
+    }
+    return result;
+}
+
+// Windows English names first, then any Windows name, then Unicode and Macintosh ones.
+static std::string ReadName(const SfntTable& table, uint16_t name_id) {
+    if (!table.data || table.length < 6) {
+        return "";
+    }
+    const uint16_t count = ReadU16(table.data + 2);
+    const uint16_t string_offset = ReadU16(table.data + 4);
+    int best_rank = 0;
+    std::string best;
+    for (uint16_t i = 0; i < count && 6u + (i + 1u) * 12u <= table.length; ++i) {
+        const uint8_t* record = table.data + 6 + i * 12;
+        const uint16_t platform = ReadU16(record);
+        const uint16_t encoding = ReadU16(record + 2);
+        const uint16_t language = ReadU16(record + 4);
+        const uint16_t length = ReadU16(record + 8);
+        const uint16_t offset = ReadU16(record + 10);
+        if (ReadU16(record + 6) != name_id || !length || uint32_t(string_offset) + offset + length > table.length) {
+            continue;
+        }
+        int rank = 0;
+        bool utf16 = true;
+        if (platform == 3 && (encoding == 0 || encoding == 1 || encoding == 10)) {
+            rank = language == 0x409 ? 4 : 3;
+        } else if (platform == 0) {
+            rank = 2;
+        } else if (platform == 1 && encoding == 0 && language == 0) {
+            rank = 1;
+            utf16 = false;
+        }
+        if (rank > best_rank) {
+            best_rank = rank;
+            best = DecodeName(table.data + string_offset + offset, length, utf16);
+        }
+    }
+    return best;
+}
+
+static bool DescribeFace(const uint8_t* data, size_t size, uint32_t face_offset, SfntFaceDescription& description) {
+    if (size_t(face_offset) + 12 > size) {
+        return false;
+    }
+    const uint32_t version = ReadU32(data + face_offset);
+    if (version != 0x00010000 && version != TagOtto && version != TagTrue) {
+        return false;
+    }
+    SfntTable name = FindTable(data, size, face_offset, TagName);
+    description.family = ReadName(name, 16);
+    if (description.family.empty()) {
+        description.family = ReadName(name, 1);
+    }
+    SfntTable os2 = FindTable(data, size, face_offset, TagOS2);
+    SfntTable head = FindTable(data, size, face_offset, TagHead);
+    if (os2.data && os2.length >= 64) {
+        const uint16_t selection = ReadU16(os2.data + 62);
+        description.italic = (selection & 1) != 0;
+        description.bold = (selection & 32) != 0;
+    } else if (head.data && head.length >= 46) {
+        const uint16_t mac_style = ReadU16(head.data + 44);
+        description.bold = (mac_style & 1) != 0;
+        description.italic = (mac_style & 2) != 0;
+    }
+    SfntTable fvar = FindTable(data, size, face_offset, TagFvar);
+    if (fvar.data && fvar.length >= 16) {
+        const uint16_t axes_offset = ReadU16(fvar.data + 4);
+        const uint16_t axis_count = ReadU16(fvar.data + 8);
+        const uint16_t axis_size = ReadU16(fvar.data + 10);
+        for (uint16_t i = 0; i < axis_count && axis_size >= 20 && axes_offset + (i + 1u) * axis_size <= fvar.length; ++i) {
+            const uint8_t* record = fvar.data + axes_offset + i * axis_size;
+            SfntVariationAxis axis;
+            axis.tag = ReadU32(record);
+            axis.minimum = static_cast<int32_t>(ReadU32(record + 4));
+            axis.def = static_cast<int32_t>(ReadU32(record + 8));
+            axis.maximum = static_cast<int32_t>(ReadU32(record + 12));
+            description.axes.push_back(axis);
+        }
+    }
+    return true;
+}
+
+// Offsets of the faces of a font or collection, empty if the data is too short.
+static std::vector<uint32_t> FaceOffsets(const uint8_t* data, size_t size) {
+    std::vector<uint32_t> offsets;
+    if (!data || size < 12) {
+        return offsets;
+    }
+    if (ReadU32(data) == TagTtcf) {
+        const uint32_t num_fonts = ReadU32(data + 8);
+        if (12 + size_t(num_fonts) * 4 > size) {
+            return offsets;
+        }
+        for (uint32_t i = 0; i < num_fonts; ++i) {
+            offsets.push_back(ReadU32(data + 12 + i * 4));
+        }
+    } else {
+        offsets.push_back(0);
+    }
+    return offsets;
+}
+
+std::vector<SfntFaceDescription> ReadSfntFaces(const uint8_t* data, size_t size) {
+    std::vector<SfntFaceDescription> faces;
+    for (uint32_t offset : FaceOffsets(data, size)) {
+        SfntFaceDescription description;
+        if (!DescribeFace(data, size, offset, description)) {
+            // Not sfnt, or too broken to trust, let FreeType describe it.
+            faces.clear();
+            break;
+        }
+        faces.push_back(description);
+    }
+    return faces;
+}
+
+int32_t SfntKerning::Lookup(uint16_t left, uint16_t right) const {
+    // As in OpenType layout, a pair subtable applies when it lists the pair, a class subtable when
+    // it covers the left glyph, even if its value for the pair is 0.
+    int32_t value = 0;
+    bool applied = false;
+    uint32_t applied_lookup = 0;
+    for (auto& subtable : subtables) {
+        if (applied && subtable.lookup == applied_lookup) {
+            continue;
+        }
+        int32_t adjustment = 0;
+        if (subtable.left_classes.empty()) {
+            auto pair = subtable.pairs.find((uint32_t(left) << 16) | right);
+            if (pair == subtable.pairs.end()) {
+                continue;
+            }
+            adjustment = pair->second;
+        } else {
+            auto left_class = subtable.left_classes.find(left);
+            if (left_class == subtable.left_classes.end()) {
+                continue;
+            }
+            auto right_class = subtable.right_classes.find(right);
+            const uint16_t right_index = right_class == subtable.right_classes.end() ? 0 : right_class->second;
+            adjustment = subtable.values[size_t(left_class->second) * subtable.right_class_count + right_index];
+        }
+        value = subtable.replaces ? adjustment : value + adjustment;
+        applied = true;
+        applied_lookup = subtable.lookup;
+    }
+    return value;
+}
+
+// Bounds checked reads of a table, out of range reads return 0 and mark the table broken.
+class SfntReader {
+public:
+    SfntReader(const uint8_t* data, size_t length) : data_(data), length_(length) {}
+    uint16_t U16(size_t offset) {
+        if (offset + 2 > length_) {
+            broken_ = true;
+            return 0;
+        }
+        return ReadU16(data_ + offset);
+    }
+    uint32_t U32(size_t offset) {
+        if (offset + 4 > length_) {
+            broken_ = true;
+            return 0;
+        }
+        return ReadU32(data_ + offset);
+    }
+    bool broken() const { return broken_; }
+    size_t length() const { return length_; }
+
+private:
+    const uint8_t* data_;
+    size_t length_;
+    bool broken_ = false;
+};
+
+// Glyphs of a coverage table in coverage index order. Ranges must be sorted and end before
+// `glyph_count`, so a broken table cannot list more glyphs than the font has.
+static std::vector<uint16_t> ReadCoverage(SfntReader& table, size_t offset, uint32_t glyph_count) {
+    std::vector<uint16_t> glyphs;
+    const uint16_t format = table.U16(offset);
+    const uint16_t count = table.U16(offset + 2);
+    if (format == 1) {
+        for (uint16_t i = 0; i < count && !table.broken(); ++i) {
+            glyphs.push_back(table.U16(offset + 4 + i * 2));
+        }
+    } else if (format == 2) {
+        uint32_t next = 0;
+        for (uint16_t i = 0; i < count && !table.broken(); ++i) {
+            const uint16_t start = table.U16(offset + 4 + i * 6);
+            const uint32_t end = std::min<uint32_t>(table.U16(offset + 4 + i * 6 + 2), glyph_count - 1);
+            if (start < next) {
+                break;
+            }
+            for (uint32_t glyph = start; glyph <= end; ++glyph) {
+                glyphs.push_back(static_cast<uint16_t>(glyph));
+            }
+            next = end + 1;
+        }
+    }
+    return glyphs;
+}
+
+// Classes of a class definition table, glyphs of class 0 left out. Ranges are bounded like those of coverage tables.
+static std::unordered_map<uint16_t, uint16_t> ReadClassDef(SfntReader& table, size_t offset, uint32_t glyph_count) {
+    std::unordered_map<uint16_t, uint16_t> classes;
+    const uint16_t format = table.U16(offset);
+    if (format == 1) {
+        const uint16_t start = table.U16(offset + 2);
+        const uint16_t count = table.U16(offset + 4);
+        for (uint16_t i = 0; i < count && !table.broken(); ++i) {
+            const uint16_t value = table.U16(offset + 6 + i * 2);
+            if (value) {
+                classes[static_cast<uint16_t>(start + i)] = value;
+            }
+        }
+    } else if (format == 2) {
+        const uint16_t count = table.U16(offset + 2);
+        uint32_t next = 0;
+        for (uint16_t i = 0; i < count && !table.broken(); ++i) {
+            const uint16_t start = table.U16(offset + 4 + i * 6);
+            const uint32_t end = std::min<uint32_t>(table.U16(offset + 4 + i * 6 + 2), glyph_count - 1);
+            const uint16_t value = table.U16(offset + 4 + i * 6 + 4);
+            if (start < next) {
+                break;
+            }
+            for (uint32_t glyph = start; value && glyph <= end; ++glyph) {
+                classes[static_cast<uint16_t>(glyph)] = value;
+            }
+            next = end + 1;
+        }
+    }
+    return classes;
+}
+
+static uint32_t PopCount16(uint16_t value) {
+    uint32_t count = 0;
+    for (; value; value &= value - 1) {
+        ++count;
+    }
+    return count;
+}
+
+// Offset of XAdvance in a value record of `format` (after XPlacement and YPlacement), -1 without one.
+static int XAdvanceOffset(uint16_t format) { return (format & 4) ? static_cast<int>(PopCount16(format & 3) * 2) : -1; }
+
+static void ReadPairPos(SfntReader& table, size_t offset, uint32_t glyph_count, uint16_t lookup, SfntKerning& kerning) {
+    const uint16_t format = table.U16(offset);
+    const std::vector<uint16_t> coverage = ReadCoverage(table, offset + table.U16(offset + 2), glyph_count);
+    const uint16_t value_format1 = table.U16(offset + 4);
+    const uint16_t value_format2 = table.U16(offset + 6);
+    const size_t value_size1 = PopCount16(value_format1) * 2;
+    const size_t value_size2 = PopCount16(value_format2) * 2;
+    // Only the first glyph's advance adjustment is horizontal kerning.
+    const int advance = XAdvanceOffset(value_format1);
+    if (advance < 0) {
+        return;
+    }
+    SfntKerningSubtable subtable;
+    subtable.lookup = lookup;
+    if (format == 1) {
+        const uint16_t set_count = table.U16(offset + 8);
+        for (uint16_t i = 0; i < set_count && i < coverage.size() && !table.broken(); ++i) {
+            const size_t set = offset + table.U16(offset + 10 + i * 2);
+            const uint16_t pair_count = table.U16(set);
+            const size_t record_size = 2 + value_size1 + value_size2;
+            for (uint16_t j = 0; j < pair_count && !table.broken(); ++j) {
+                const size_t record = set + 2 + j * record_size;
+                const uint32_t key = (uint32_t(coverage[i]) << 16) | table.U16(record);
+                subtable.pairs.emplace(key, static_cast<int16_t>(table.U16(record + 2 + advance)));
+            }
+        }
+        if (!subtable.pairs.empty() && !table.broken()) {
+            kerning.subtables.push_back(std::move(subtable));
+        }
+    } else if (format == 2) {
+        const uint16_t left_class_count = table.U16(offset + 12);
+        const uint16_t right_class_count = table.U16(offset + 14);
+        const size_t record_size = value_size1 + value_size2;
+        const size_t value_count = size_t(left_class_count) * right_class_count;
+        // The class counts of a broken table could ask for gigabytes of values, skip it.
+        if (offset + 16 + value_count * record_size > table.length()) {
+            return;
+        }
+        const std::unordered_map<uint16_t, uint16_t> left_classes = ReadClassDef(table, offset + table.U16(offset + 8), glyph_count);
+        subtable.right_classes = ReadClassDef(table, offset + table.U16(offset + 10), glyph_count);
+        subtable.right_class_count = right_class_count;
+        bool any = false;
+        subtable.values.resize(value_count);
+        for (size_t i = 0; i < subtable.values.size() && !table.broken(); ++i) {
+            subtable.values[i] = static_cast<int16_t>(table.U16(offset + 16 + i * record_size + advance));
+            any = any || subtable.values[i];
+        }
+        for (uint16_t glyph : coverage) {
+            auto left_class = left_classes.find(glyph);
+            const uint16_t value = left_class == left_classes.end() ? 0 : left_class->second;
+            if (value < left_class_count) {
+                subtable.left_classes[glyph] = value;
+            }
+        }
+        for (auto& right_class : subtable.right_classes) {
+            if (right_class.second >= subtable.right_class_count) {
+                right_class.second = 0;
+            }
+        }
+        if (any && !subtable.left_classes.empty() && !table.broken()) {
+            kerning.subtables.push_back(std::move(subtable));
+        }
+    }
+}
+
+// Pair adjustment lookups of every 'kern' feature, regardless of script and language.
+static bool ReadGposKerning(const SfntTable& gpos, uint32_t glyph_count, SfntKerning& kerning) {
+    static const uint32_t TagKernFeature = 0x6B65726E;  // 'kern'
+    static const uint16_t LookupPairPos = 2;
+    static const uint16_t LookupExtension = 9;
+    SfntReader table(gpos.data, gpos.length);
+    const size_t feature_list = table.U16(6);
+    const size_t lookup_list = table.U16(8);
+    std::vector<uint16_t> lookups;
+    const uint16_t feature_count = table.U16(feature_list);
+    for (uint16_t i = 0; i < feature_count && !table.broken(); ++i) {
+        if (table.U32(feature_list + 2 + i * 6) != TagKernFeature) {
+            continue;
+        }
+        const size_t feature = feature_list + table.U16(feature_list + 2 + i * 6 + 4);
+        const uint16_t lookup_count = table.U16(feature + 2);
+        for (uint16_t j = 0; j < lookup_count; ++j) {
+            lookups.push_back(table.U16(feature + 4 + j * 2));
+        }
+    }
+    if (lookups.empty()) {
+        return false;
+    }
+    // Lookups apply in lookup list order.
+    std::sort(lookups.begin(), lookups.end());
+    lookups.erase(std::unique(lookups.begin(), lookups.end()), lookups.end());
+    const uint16_t lookup_total = table.U16(lookup_list);
+    for (uint16_t index : lookups) {
+        if (index >= lookup_total || table.broken()) {
+            continue;
+        }
+        const size_t lookup = lookup_list + table.U16(lookup_list + 2 + index * 2);
+        const uint16_t type = table.U16(lookup);
+        const uint16_t subtable_count = table.U16(lookup + 4);
+        for (uint16_t j = 0; j < subtable_count && !table.broken(); ++j) {
+            size_t subtable = lookup + table.U16(lookup + 6 + j * 2);
+            if (type == LookupExtension) {
+                if (table.U16(subtable + 2) != LookupPairPos) {
+                    continue;
+                }
+                subtable += table.U32(subtable + 4);
+            } else if (type != LookupPairPos) {
+                continue;
+            }
+            ReadPairPos(table, subtable, glyph_count, index, kerning);
+        }
+    }
+    return !table.broken();
+}
+
+// Format 0 subtables of the Microsoft kern table.
+static void ReadKernTable(const SfntTable& kern, SfntKerning& kerning) {
+    SfntReader table(kern.data, kern.length);
+    if (table.U16(0) != 0) {
+        return;
+    }
+    const uint16_t subtable_count = table.U16(2);
+    // Values of the subtables listing a pair add up, an override subtable replaces the sum so far.
+    size_t subtable = 4;
+    for (uint16_t i = 0; i < subtable_count && !table.broken(); ++i) {
+        const uint16_t length = table.U16(subtable + 2);
+        const uint16_t coverage = table.U16(subtable + 4);
+        // Horizontal kerning values, not minimums or cross-stream adjustments.
+        if ((coverage >> 8) == 0 && (coverage & 7) == 1) {
+            SfntKerningSubtable pairs;
+            pairs.lookup = i;
+            pairs.replaces = (coverage & 8) != 0;
+            const uint16_t pair_count = table.U16(subtable + 6);
+            for (uint16_t j = 0; j < pair_count && !table.broken(); ++j) {
+                const size_t pair = subtable + 14 + j * 6;
+                pairs.pairs.emplace(table.U32(pair), static_cast<int16_t>(table.U16(pair + 4)));
+            }
+            if (!pairs.pairs.empty()) {
+                kerning.subtables.push_back(std::move(pairs));
+            }
+        }
+        subtable += length;
+    }
+}
+
+SfntKerning ReadSfntKerning(const uint8_t* data, size_t size, uint32_t face_index) {
+    SfntKerning kerning;
+    std::vector<uint32_t> offsets = FaceOffsets(data, size);
+    if (face_index >= offsets.size()) {
+        return kerning;
+    }
+    SfntTable head = FindTable(data, size, offsets[face_index], TagHead);
+    if (!head.data || head.length < 20) {
+        return kerning;
+    }
+    kerning.units_per_em = ReadU16(head.data + 18);
+    SfntTable maxp = FindTable(data, size, offsets[face_index], TagMaxp);
+    const uint32_t glyph_count = maxp.data && maxp.length >= 6 ? ReadU16(maxp.data + 4) : 0;
+    SfntTable gpos = FindTable(data, size, offsets[face_index], TagGpos);
+    if (glyph_count && gpos.data && gpos.length >= 10 && ReadGposKerning(gpos, glyph_count, kerning) && !kerning.empty()) {
+        return kerning;
+    }
+    kerning.subtables.clear();
+    SfntTable kern = FindTable(data, size, offsets[face_index], TagKern);
+    if (kern.data) {
+        ReadKernTable(kern, kerning);
+    }
+    return kerning;
+}
+
+}  // namespace Font
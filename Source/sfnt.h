@@ -0,0 +1,79 @@
+﻿#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace Font {
+
+struct SfntVariationAxis {
+    uint32_t tag;
+    // 16.16 design coordinates.
+    int32_t minimum;
+    int32_t def;
+    int32_t maximum;
+};
+
+// Quantized coordinates of a variable face instance, exact so instances never share cached glyphs.
+// Axis steps take 10 bits each, six to a word; the top bit of the last word marks a non-default
+// instance, so the default instance is all zero.
+struct SfntVariationKey {
+    static const size_t MaxAxes = 12;
+    static const uint32_t MaxStep = 1023;
+    uint64_t words[2] = {0, 0};
+    void SetStep(size_t axis, uint32_t step) { words[axis / 6] |= uint64_t(step) << (axis % 6 * 10); }
+    void MarkInstance() { words[1] |= uint64_t(1) << 63; }
+    bool IsDefault() const { return !words[0] && !words[1]; }
+    uint64_t Hash() const { return (words[0] * 0x9E3779B97F4A7C15ull) ^ (words[1] * 0xC2B2AE3D27D4EB4Full); }
+    bool operator==(const SfntVariationKey& other) const { return words[0] == other.words[0] && words[1] == other.words[1]; }
+    bool operator!=(const SfntVariationKey& other) const { return !(*this == other); }
+};
+
+// What face matching needs to know about one face, read straight from the font tables
+// without creating an FT_Face.
+struct SfntFaceDescription {
+    std::string family;
+    bool bold = false;
+    bool italic = false;
+    std::vector<SfntVariationAxis> axes;
+};
+
+// Read the face directory of a TrueType/OpenType font or collection (.ttc/.otc) and
+// describe each face from its name, OS/2, head and fvar tables. Returns an empty list
+// for data that is not sfnt based.
+std::vector<SfntFaceDescription> ReadSfntFaces(const uint8_t* data, size_t size);
+
+// One pair adjustment subtable, either glyph pairs (GPOS PairPos format 1, the kern table) or
+// classes (PairPos format 2), the latter left as classes instead of being expanded into every pair.
+struct SfntKerningSubtable {
+    // Glyph pairs, left glyph in the high 16 bits.
+    std::unordered_map<uint32_t, int16_t> pairs;
+    // Class of every glyph a class subtable covers on the left, empty in pair subtables.
+    std::unordered_map<uint16_t, uint16_t> left_classes;
+    // Right glyphs not listed are class 0.
+    std::unordered_map<uint16_t, uint16_t> right_classes;
+    uint16_t right_class_count = 0;
+    // Left class * right_class_count + right class.
+    std::vector<int16_t> values;
+    // GPOS lookup (or kern subtable) this belongs to, within one only the first subtable that applies counts.
+    uint32_t lookup = 0;
+    // A kern table override subtable replaces the value of earlier subtables instead of adding to it.
+    bool replaces = false;
+};
+
+// Horizontal kerning of one face in font units, from the GPOS 'kern' feature or, without one,
+// the legacy kern table.
+struct SfntKerning {
+    uint16_t units_per_em = 0;
+    // In lookup order. Each lookup adds the value of its first subtable that applies to a pair.
+    std::vector<SfntKerningSubtable> subtables;
+    bool empty() const { return subtables.empty(); }
+    int32_t Lookup(uint16_t left, uint16_t right) const;
+};
+
+// Read the kerning of face `face_index` of a font or collection, empty if it has none or is not sfnt based.
+SfntKerning ReadSfntKerning(const uint8_t* data, size_t size, uint32_t face_index);
+
+}  // namespace Font
@@ -410,6 +410,7 @@ std::shared_ptr<GlyphBitmapInfo> SystemFont(FontInfo* ttffont, const std::wstrin
                     result->bearing_x = metrics.gmptGlyphOrigin.x;
                     result->bearing_y = metrics.gmptGlyphOrigin.y;
                     result->advance = metrics.gmCellIncX;
+                    result->advance_26_6 = metrics.gmCellIncX << 6;
                     result->emoji = false;
                 } else {
                     success = false;
@@ -422,6 +423,7 @@ std::shared_ptr<GlyphBitmapInfo> SystemFont(FontInfo* ttffont, const std::wstrin
             result->bearing_x = 0;
             result->bearing_y = 0;
             result->advance = metrics.gmCellIncX;
+            result->advance_26_6 = metrics.gmCellIncX << 6;
             result->emoji = false;
         }
     }
@@ -430,12 +432,11 @@ std::shared_ptr<GlyphBitmapInfo> SystemFont(FontInfo* ttffont, const std::wstrin
         if (glyphData.size() && result->width && result->height) {
             const uint32_t glyphDataRowPitch = AlignUp<uint32_t>(result->width, sizeof(DWORD));
             result->height = static_cast<uint32_t>(glyphData.size()) / glyphDataRowPitch;
-            unsigned char* textureData = static_cast<unsigned char*>(malloc(result->width * result->height * 4 * sizeof(char)));
+            unsigned char* textureData = static_cast<unsigned char*>(result->Allocate(result->width * result->height * 4 * sizeof(char)));
             BlitGray8Bitmap(textureData, result->width, glyphData.data(), glyphDataRowPitch, result->width, result->height);
-            result->data = textureData;
             result->error_code = GlyphErrorCode::Success;
         } else {
-            result->data = 0;
+            result->Release();
             result->error_code = GlyphErrorCode::NoBitmapData;
         }
     } else {
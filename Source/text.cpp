@@ -0,0 +1,467 @@
+﻿#include "text.h"
+#include "bitmap.h"
+#include "freetype.h"
+#include <algorithm>
+#include <climits>
+#include <cstring>
+
+namespace Font {
+
+std::vector<uint32_t> DecodeUtf8(const char* text) {
+    std::vector<uint32_t> chars;
+    const uint8_t* s = reinterpret_cast<const uint8_t*>(text);
+    while (*s) {
+        uint32_t lead = *s++;
+        uint32_t length = lead < 0x80 ? 0 : lead < 0xC2 ? 4 : lead < 0xE0 ? 1 : lead < 0xF0 ? 2 : lead < 0xF5 ? 3 : 4;
+        if (length == 4) {
+            chars.push_back(0xFFFD);
+            continue;
+        }
+        uint32_t code = length ? lead & (0x3F >> length) : lead;
+        uint32_t i = 0;
+        for (; i < length && (s[i] & 0xC0) == 0x80; ++i) {
+            code = (code << 6) | (s[i] & 0x3F);
+        }
+        // Truncated, overlong (the lead byte check covers two byte forms), surrogate or out of range sequences.
+        static const uint32_t minimum[4] = {0, 0x80, 0x800, 0x10000};
+        if (i < length || code < minimum[length] || (code >= 0xD800 && code < 0xE000) || code > 0x10FFFF) {
+            code = 0xFFFD;
+        }
+        s += i;
+        chars.push_back(code);
+    }
+    return chars;
+}
+
+static const size_t DefaultWordCacheBudget = size_t(1) << 20;
+
+static AdvanceKey MakeAdvanceKey(const FontInfo& font) {
+    AdvanceKey key;
+    key.family = font.name.data();
+    key.size = font.size;
+    key.style = StyleKey(font);
+    key.subpixel_phases = font.subpixel_phases;
+    key.variation = MakeVariationKey(font);
+    return key;
+}
+
+AdvanceTable::AdvanceTable(FontInfo* font) { GetFreetypeFontInstance().GetLineMetrics(*font, &ascent, &descent, &line_gap); }
+
+AdvanceTable::AdvanceTable(std::shared_ptr<AdvanceTable> shared) : ascent(shared->ascent), descent(shared->descent), line_gap(shared->line_gap), shared_(std::move(shared)) {}
+
+int32_t AdvanceTable::Resolve(FontInfo* font, uint32_t char_code) {
+    int32_t advance = 0;
+    if (shared_) {
+        shared_->Advances(font, &char_code, 1, Missing, &advance);
+        return advance;
+    }
+    if (GetFreetypeFontInstance().GetAdvance(*font, char_code, &advance)) {
+        return advance;
+    }
+    // Characters only the system fonts have.
+    LinkedList<GlyphBitmapInfo> glyph = GetGlyphBitmapInfo(font, char_code, 0.0f);
+    return glyph.size() ? glyph[0].advance_26_6 : Missing;
+}
+
+void AdvanceTable::Advances(FontInfo* font, const uint32_t* chars, size_t count, int32_t missing, int32_t* advances) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    for (size_t i = 0; i < count; ++i) {
+        const uint32_t char_code = chars[i];
+        int32_t advance;
+        if (char_code < 0x10000) {
+            std::unique_ptr<int32_t[]>& page = pages_[char_code >> 8];
+            if (!page) {
+                page.reset(new int32_t[256]);
+                std::fill(page.get(), page.get() + 256, Unknown);
+            }
+            advance = page[char_code & 0xFF];
+            if (advance == Unknown) {
+                advance = page[char_code & 0xFF] = Resolve(font, char_code);
+            }
+        } else {
+            auto found = supplementary_.find(char_code);
+            advance = found != supplementary_.end() ? found->second : supplementary_[char_code] = Resolve(font, char_code);
+        }
+        advances[i] = advance == Missing ? missing : advance;
+    }
+}
+
+void AdvanceTable::Kernings(FontInfo* font, const uint32_t* chars, size_t count, int32_t* kernings) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    for (size_t i = 0; i + 1 < count; ++i) {
+        const uint64_t pair = (uint64_t(chars[i]) << 32) | chars[i + 1];
+        auto found = kerning_.find(pair);
+        if (found != kerning_.end()) {
+            kernings[i] = found->second;
+            continue;
+        }
+        if (kerning_.size() >= MaxKerningPairs) {
+            kerning_.clear();
+        }
+        if (shared_) {
+            shared_->Kernings(font, chars + i, 2, kernings + i);
+        } else {
+            kernings[i] = GetFreetypeFontInstance().GetKerning(*font, chars[i], chars[i + 1]);
+        }
+        kerning_[pair] = kernings[i];
+    }
+}
+
+AdvanceTableCache::AdvanceTableCache() : tables_(MaxTables) {}
+
+std::shared_ptr<AdvanceTable> AdvanceTableCache::Find(FontInfo* font) {
+    AdvanceKey key = MakeAdvanceKey(*font);
+    std::lock_guard<std::mutex> lock(mutex_);
+    std::shared_ptr<AdvanceTable>* table = tables_.Find(key);
+    if (table) {
+        return *table;
+    }
+    std::shared_ptr<AdvanceTable> created = std::make_shared<AdvanceTable>(font);
+    tables_.Insert(key, created, 1);
+    return created;
+}
+
+void AdvanceTableCache::Clear() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    tables_.Clear();
+}
+
+AdvanceTableCache& GetAdvanceTableCache() {
+    static AdvanceTableCache cache;
+    return cache;
+}
+
+TextMetrics MeasureChars(FontInfo* font, const uint32_t* chars, size_t count, bool kerning) {
+    std::shared_ptr<AdvanceTable> table = GetAdvanceTableCache().Find(font);
+    TextMetrics metrics;
+    metrics.ascent_26_6 = table->ascent;
+    metrics.descent_26_6 = table->descent;
+    metrics.line_gap_26_6 = table->line_gap;
+    // Measured in chunks, so long strings need no allocation.
+    static const size_t Chunk = 256;
+    int32_t values[Chunk];
+    for (size_t start = 0; start < count; start += Chunk) {
+        const size_t length = std::min(Chunk, count - start);
+        table->Advances(font, chars + start, length, 0, values);
+        metrics.width_26_6 += SumAdvances(values, length);
+        if (kerning) {
+            // Pairs from the last character of the previous chunk on.
+            const size_t first = start ? start - 1 : 0;
+            const size_t pairs = start + length - first;
+            table->Kernings(font, chars + first, pairs, values);
+            metrics.width_26_6 += SumAdvances(values, pairs - 1);
+        }
+    }
+    metrics.width = (metrics.width_26_6 + 32) >> 6;
+    return metrics;
+}
+
+// The uncached path: one advance and, between neighbours, one kerning from the advance table per character.
+static void LayoutWord(FontInfo* font, const uint32_t* word, size_t length, bool kerning, WordLayout* layout) {
+    std::shared_ptr<AdvanceTable> table = GetAdvanceTableCache().Find(font);
+    std::vector<int32_t> advances(length);
+    std::vector<int32_t> kernings(length, 0);
+    table->Advances(font, word, length, AdvanceTable::Missing, advances.data());
+    if (kerning) {
+        table->Kernings(font, word, length, kernings.data());
+    }
+    layout->glyphs.clear();
+    int32_t pen = 0;
+    for (size_t i = 0; i < length; ++i) {
+        if (i) {
+            pen += kernings[i - 1];
+        }
+        if (advances[i] == AdvanceTable::Missing) {
+            continue;
+        }
+        GlyphPosition position = {word[i], pen};
+        layout->glyphs.push_back(position);
+        pen += advances[i];
+    }
+    layout->advance = pen;
+}
+
+int32_t PositionText(FontInfo* font, const std::vector<uint32_t>& chars, bool kerning, std::vector<GlyphPosition>* positions) {
+    WordLayoutCache& cache = GetWordLayoutCache();
+    std::shared_ptr<AdvanceTable> table = kerning ? GetAdvanceTableCache().Find(font) : nullptr;
+    WordLayout layout;
+    int32_t pen = 0;
+    for (size_t start = 0; start < chars.size();) {
+        // Words are runs of anything but spaces, each space is a word of its own.
+        size_t end = start + 1;
+        if (chars[start] != ' ') {
+            while (end < chars.size() && chars[end] != ' ') {
+                ++end;
+            }
+        }
+        if (kerning && start) {
+            int32_t boundary;
+            table->Kernings(font, chars.data() + start - 1, 2, &boundary);
+            pen += boundary;
+        }
+        cache.Layout(font, chars.data() + start, end - start, kerning, &layout);
+        for (auto& glyph : layout.glyphs) {
+            GlyphPosition position = {glyph.char_code, pen + glyph.x};
+            positions->push_back(position);
+        }
+        pen += layout.advance;
+        start = end;
+    }
+    return pen;
+}
+
+int32_t LayoutTextRun(FontInfo* font, const std::vector<uint32_t>& chars, bool kerning, std::vector<PositionedGlyph>* glyphs) {
+    std::vector<GlyphPosition> positions;
+    const int32_t advance = PositionText(font, chars, kerning, &positions);
+    for (auto& position : positions) {
+        LinkedList<GlyphBitmapInfo> result = GetGlyphBitmapInfo(font, position.char_code, position.x / 64.0f);
+        if (!result.size()) {
+            continue;
+        }
+        PositionedGlyph positioned;
+        positioned.glyph = result[0];
+        positioned.x = (position.x >> 6) + positioned.glyph.bearing_x;
+        glyphs->push_back(positioned);
+    }
+    return advance;
+}
+
+static uint8_t Premultiply(uint8_t value, uint8_t alpha) { return static_cast<uint8_t>((value * alpha + 127) / 255); }
+
+GlyphBitmapInfo DrawTextRun(FontInfo* font, const std::vector<uint32_t>& chars, const TextRunOptions& options) {
+    std::vector<PositionedGlyph> glyphs;
+    GlyphBitmapInfo run;
+    run.advance_26_6 = LayoutTextRun(font, chars, options.kerning, &glyphs);
+    run.advance = (run.advance_26_6 + 32) >> 6;
+    // Ink bounds, bearing_y up from the baseline like the glyphs'.
+    int left = INT_MAX, right = INT_MIN, top = INT_MIN, bottom = INT_MAX;
+    for (auto& positioned : glyphs) {
+        const GlyphBitmapInfo& glyph = positioned.glyph;
+        if (!glyph.data || !glyph.width || !glyph.height) {
+            continue;
+        }
+        left = std::min(left, positioned.x);
+        right = std::max(right, positioned.x + static_cast<int>(glyph.width));
+        top = std::max(top, glyph.bearing_y);
+        bottom = std::min(bottom, glyph.bearing_y - static_cast<int>(glyph.height));
+    }
+    if (left >= right) {
+        run.error_code = GlyphErrorCode::NoBitmapData;
+        return run;
+    }
+    run.width = static_cast<unsigned int>(right - left);
+    run.height = static_cast<unsigned int>(top - bottom);
+    run.bearing_x = left;
+    run.bearing_y = top;
+    const bool coverage = options.format == GlyphPixelFormat::Alpha8;
+    const size_t pixel_bytes = coverage ? 1 : 4;
+    const size_t pitch = run.width * pixel_bytes;
+    uint8_t* pixels = static_cast<uint8_t*>(run.Allocate(pitch * run.height));
+    if (!pixels) {
+        run.error_code = GlyphErrorCode::NoBitmapData;
+        return run;
+    }
+    const uint8_t* background = options.background;
+    if (coverage) {
+        memset(pixels, background[3], pitch * run.height);
+    } else {
+        const uint8_t fill[4] = {Premultiply(background[0], background[3]), Premultiply(background[1], background[3]), Premultiply(background[2], background[3]), background[3]};
+        for (size_t i = 0; i < size_t(run.width) * run.height; ++i) {
+            memcpy(pixels + i * 4, fill, 4);
+        }
+    }
+    const uint8_t* color = options.color;
+    const uint8_t text_tint[4] = {Premultiply(color[0], color[3]), Premultiply(color[1], color[3]), Premultiply(color[2], color[3]), color[3]};
+    const uint8_t color_tint[4] = {color[3], color[3], color[3], color[3]};
+    for (auto& positioned : glyphs) {
+        const GlyphBitmapInfo& glyph = positioned.glyph;
+        if (!glyph.data || !glyph.width || !glyph.height) {
+            continue;
+        }
+        uint8_t* origin = pixels + size_t(top - glyph.bearing_y) * pitch + size_t(positioned.x - left) * pixel_bytes;
+        const uint8_t* src = static_cast<const uint8_t*>(glyph.data);
+        if (coverage) {
+            BlendAlphaOver(origin, pitch, src, glyph.width * 4, glyph.width, glyph.height, color[3]);
+        } else {
+            BlendTintedOver(origin, pitch, src, glyph.width * 4, glyph.width, glyph.height, glyph.emoji ? color_tint : text_tint);
+        }
+    }
+    if (options.format == GlyphPixelFormat::BGRA) {
+        ConvertBGRAToRGBA(pixels, pitch, pixels, pitch, run.width, run.height);
+    }
+    return run;
+}
+
+GlyphBitmapInfo TextRunCache::Render(FontInfo* font, const char* utf8, const TextRunOptions& options) {
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (!budget_) {
+            return DrawTextRun(font, DecodeUtf8(utf8), options);
+        }
+    }
+    TextRunKey key;
+    key.font = font;
+    key.text = utf8;
+    key.family = font->name.data();
+    key.size = font->size;
+    key.style = StyleKey(*font);
+    key.subpixel_phases = font->subpixel_phases;
+    key.palette_index = font->palette_index;
+    key.variation = MakeVariationKey(*font);
+    memcpy(key.color, options.color, sizeof(key.color));
+    memcpy(key.background, options.background, sizeof(key.background));
+    key.format = options.format;
+    key.kerning = options.kerning;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        GlyphBitmapInfo* cached = runs_.Find(key);
+        if (cached) {
+            return *cached;
+        }
+    }
+    // Drawn unlocked, two threads missing the same run both draw it and the second insert wins.
+    GlyphBitmapInfo run = DrawTextRun(font, DecodeUtf8(utf8), options);
+    const size_t pixel_bytes = options.format == GlyphPixelFormat::Alpha8 ? 1 : 4;
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (budget_) {
+        runs_.Insert(key, run, size_t(run.width) * run.height * pixel_bytes + key.text.size() + key.family.size() + sizeof(TextRunKey) + sizeof(GlyphBitmapInfo) + 64);
+    }
+    return run;
+}
+
+void TextRunCache::SetBudget(size_t bytes) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    budget_ = bytes;
+    if (bytes) {
+        runs_.SetBudget(bytes);
+    } else {
+        runs_.Clear();
+    }
+}
+
+TextRunCacheStats TextRunCache::GetStats() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    TextRunCacheStats stats;
+    stats.runs = static_cast<uint32_t>(runs_.size());
+    stats.bytes = runs_.bytes();
+    stats.hits = runs_.hits();
+    stats.misses = runs_.misses();
+    stats.evictions = runs_.evictions();
+    return stats;
+}
+
+void TextRunCache::Remove(const FontInfo* font) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    std::vector<TextRunKey> keys;
+    runs_.ForEach([font, &keys](const TextRunKey& key, GlyphBitmapInfo&) {
+        if (key.font == font) {
+            keys.push_back(key);
+        }
+    });
+    for (auto& key : keys) {
+        runs_.Erase(key);
+    }
+}
+
+void TextRunCache::Clear() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    runs_.Clear();
+}
+
+TextRunCache& GetTextRunCache() {
+    static TextRunCache cache;
+    return cache;
+}
+
+WordLayoutCache::WordLayoutCache() : budget_(DefaultWordCacheBudget), words_(DefaultWordCacheBudget) {}
+
+void WordLayoutCache::Layout(FontInfo* font, const uint32_t* word, size_t length, bool kerning, WordLayout* layout) {
+    bool enabled;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        enabled = budget_ != 0;
+    }
+    if (!enabled) {
+        LayoutWord(font, word, length, kerning, layout);
+        return;
+    }
+    WordKey key;
+    key.font = font;
+    key.word.assign(reinterpret_cast<const char32_t*>(word), length);
+    key.family = font->name.data();
+    key.size = font->size;
+    key.style = StyleKey(*font);
+    key.subpixel_phases = font->subpixel_phases;
+    key.variation = MakeVariationKey(*font);
+    key.kerning = kerning;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        WordLayout* cached = words_.Find(key);
+        if (cached) {
+            *layout = *cached;
+            return;
+        }
+    }
+    LayoutWord(font, word, length, kerning, layout);
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (budget_) {
+        words_.Insert(key, *layout, key.word.size() * sizeof(char32_t) + layout->glyphs.size() * sizeof(GlyphPosition) + key.family.size() + sizeof(WordKey) + sizeof(WordLayout) + 64);
+    }
+}
+
+void WordLayoutCache::SetBudget(size_t bytes) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    budget_ = bytes;
+    if (bytes) {
+        words_.SetBudget(bytes);
+    } else {
+        words_.Clear();
+    }
+}
+
+WordCacheStats WordLayoutCache::GetStats() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    WordCacheStats stats;
+    stats.words = static_cast<uint32_t>(words_.size());
+    stats.bytes = words_.bytes();
+    stats.hits = words_.hits();
+    stats.misses = words_.misses();
+    stats.evictions = words_.evictions();
+    return stats;
+}
+
+void WordLayoutCache::Remove(const FontInfo* font) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    std::vector<WordKey> keys;
+    words_.ForEach([font, &keys](const WordKey& key, WordLayout&) {
+        if (key.font == font) {
+            keys.push_back(key);
+        }
+    });
+    for (auto& key : keys) {
+        words_.Erase(key);
+    }
+}
+
+void WordLayoutCache::Clear() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    words_.Clear();
+}
+
+WordLayoutCache& GetWordLayoutCache() {
+    static WordLayoutCache cache;
+    return cache;
+}
+
+void RemoveTextCaches(const FontInfo* font) {
+    GetTextRunCache().Remove(font);
+    GetWordLayoutCache().Remove(font);
+}
+
+void ClearTextCaches() {
+    GetTextRunCache().Clear();
+    GetWordLayoutCache().Clear();
+    GetAdvanceTableCache().Clear();
+}
+
+}  // namespace Font
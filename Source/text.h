@@ -0,0 +1,212 @@
+﻿#pragma once
+
+#include "font.h"
+#include "cache.h"
+#include "sfnt.h"
+#include <climits>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace Font {
+
+// Code points of UTF-8 text, malformed sequences become U+FFFD.
+std::vector<uint32_t> DecodeUtf8(const char* text);
+
+// A character placed on a line, `x` is the pen position of its origin in 26.6.
+struct GlyphPosition {
+    uint32_t char_code;
+    int32_t x;
+};
+
+// A glyph of a laid out run, its bitmap's left edge is `x` pixels right of the run's origin.
+struct PositionedGlyph {
+    GlyphBitmapInfo glyph;
+    int x;
+};
+
+// Place `chars` on one line, word by word through the word cache. The pen is kept in 26.6 so subpixel
+// positioned fonts do not drift. Characters no font has are left out. Returns the advance of the run, 26.6.
+int32_t PositionText(FontInfo* font, const std::vector<uint32_t>& chars, bool kerning, std::vector<GlyphPosition>* positions);
+
+// PositionText, then fetch the glyphs at their positions.
+int32_t LayoutTextRun(FontInfo* font, const std::vector<uint32_t>& chars, bool kerning, std::vector<PositionedGlyph>* glyphs);
+
+GlyphBitmapInfo DrawTextRun(FontInfo* font, const std::vector<uint32_t>& chars, const TextRunOptions& options);
+
+// Everything that selects the pixels of a text run. The font pointer keeps fonts that share
+// all their settings apart, so destroying one only drops its own runs.
+struct TextRunKey {
+    const FontInfo* font;
+    std::string text;
+    std::string family;
+    int size;
+    // Bold, italic and the render mode.
+    uint32_t style;
+    uint32_t subpixel_phases;
+    uint32_t palette_index;
+    SfntVariationKey variation;
+    uint8_t color[4];
+    uint8_t background[4];
+    GlyphPixelFormat format;
+    bool kerning;
+    bool operator==(const TextRunKey& other) const {
+        return font == other.font && size == other.size && style == other.style && subpixel_phases == other.subpixel_phases && palette_index == other.palette_index && variation == other.variation && format == other.format &&
+               kerning == other.kerning && !memcmp(color, other.color, sizeof(color)) && !memcmp(background, other.background, sizeof(background)) && text == other.text && family == other.family;
+    }
+};
+
+struct TextRunKeyHash {
+    size_t operator()(const TextRunKey& key) const {
+        uint32_t colors[2];
+        memcpy(colors, key.color, sizeof(key.color));
+        memcpy(colors + 1, key.background, sizeof(key.background));
+        return std::hash<std::string>()(key.text) ^ std::hash<const void*>()(key.font) ^
+               std::hash<uint64_t>()((uint64_t(key.size) << 32) ^ (uint64_t(key.style) << 24) ^ (uint64_t(key.format) << 20) ^ (uint64_t(key.kerning) << 19) ^ key.subpixel_phases ^ (uint64_t(colors[0]) * 0x9E3779B97F4A7C15ull) ^ (uint64_t(colors[1]) << 8) ^
+                                     key.variation.Hash() ^ (uint64_t(key.palette_index) << 40));
+    }
+};
+
+// Composed runs handed out again for repeated strings, held to a byte budget of their own.
+class TextRunCache {
+public:
+    GlyphBitmapInfo Render(FontInfo* font, const char* utf8, const TextRunOptions& options);
+    // 0 turns the cache off and drops its runs.
+    void SetBudget(size_t bytes);
+    TextRunCacheStats GetStats();
+    // Drop the runs of a font about to be destroyed.
+    void Remove(const FontInfo* font);
+    void Clear();
+
+private:
+    std::mutex mutex_;
+    size_t budget_ = 0;
+    TwoQueueCache<TextRunKey, GlyphBitmapInfo, TextRunKeyHash> runs_;
+};
+
+TextRunCache& GetTextRunCache();
+
+// What decides the positions of a word's characters, the face fallback and hinting included.
+struct WordKey {
+    const FontInfo* font;
+    std::u32string word;
+    std::string family;
+    int size;
+    // Bold, italic and the render mode.
+    uint32_t style;
+    uint32_t subpixel_phases;
+    SfntVariationKey variation;
+    bool kerning;
+    bool operator==(const WordKey& other) const {
+        return font == other.font && size == other.size && style == other.style && subpixel_phases == other.subpixel_phases && variation == other.variation && kerning == other.kerning && word == other.word && family == other.family;
+    }
+};
+
+struct WordKeyHash {
+    size_t operator()(const WordKey& key) const {
+        return std::hash<std::u32string>()(key.word) ^ std::hash<const void*>()(key.font) ^
+               std::hash<uint64_t>()((uint64_t(key.size) << 32) ^ (uint64_t(key.style) << 24) ^ (uint64_t(key.kerning) << 20) ^ key.subpixel_phases ^ key.variation.Hash());
+    }
+};
+
+// Positions relative to the start of the word.
+struct WordLayout {
+    std::vector<GlyphPosition> glyphs;
+    int32_t advance;
+};
+
+// Layouts of words seen before, so text made of common words skips the per character
+// advance and kerning lookups. Held to a byte budget, on by default.
+class WordLayoutCache {
+public:
+    WordLayoutCache();
+    // Fill `layout` for the word starting at `word`, laying it out on a miss.
+    void Layout(FontInfo* font, const uint32_t* word, size_t length, bool kerning, WordLayout* layout);
+    // 0 turns the cache off and drops its words.
+    void SetBudget(size_t bytes);
+    WordCacheStats GetStats();
+    void Remove(const FontInfo* font);
+    void Clear();
+
+private:
+    std::mutex mutex_;
+    size_t budget_;
+    TwoQueueCache<WordKey, WordLayout, WordKeyHash> words_;
+};
+
+WordLayoutCache& GetWordLayoutCache();
+
+// What decides a character's advance: the faces it falls back through, their size and hinting.
+// Unlike words, tables are shared by every font with the same settings.
+struct AdvanceKey {
+    std::string family;
+    int size;
+    // Bold, italic and the render mode.
+    uint32_t style;
+    uint32_t subpixel_phases;
+    SfntVariationKey variation;
+    bool operator==(const AdvanceKey& other) const { return size == other.size && style == other.style && subpixel_phases == other.subpixel_phases && variation == other.variation && family == other.family; }
+};
+
+struct AdvanceKeyHash {
+    size_t operator()(const AdvanceKey& key) const { return std::hash<std::string>()(key.family) ^ std::hash<uint64_t>()((uint64_t(key.size) << 32) ^ (uint64_t(key.style) << 24) ^ key.subpixel_phases ^ key.variation.Hash()); }
+};
+
+// Advances and kerning of one font setup at one size, looked up once per character or pair and
+// then read from memory. The BMP is held in pages of 256 advances, allocated when one of their
+// characters is first measured, characters beyond it in a map.
+class AdvanceTable {
+public:
+    // Read the line metrics, the font's size and faces do not change for the life of the table.
+    explicit AdvanceTable(FontInfo* font);
+    // A private table for one thread in front of a shared one, it fills in from `shared` so the
+    // thread only takes the shared table's lock for characters and pairs it has not seen yet.
+    explicit AdvanceTable(std::shared_ptr<AdvanceTable> shared);
+    // Advances in 26.6, `missing` for characters no font has.
+    void Advances(FontInfo* font, const uint32_t* chars, size_t count, int32_t missing, int32_t* advances);
+    // kernings[i] is the kerning between chars[i] and chars[i + 1], 26.6.
+    void Kernings(FontInfo* font, const uint32_t* chars, size_t count, int32_t* kernings);
+    static const int32_t Missing = INT_MIN;
+    int32_t ascent = 0;
+    int32_t descent = 0;
+    int32_t line_gap = 0;
+
+private:
+    static const int32_t Unknown = INT_MIN + 1;
+    // Pairs kept before the pair map starts over, pairs are cheap to look up again.
+    static const size_t MaxKerningPairs = 1 << 16;
+    int32_t Resolve(FontInfo* font, uint32_t char_code);
+    std::shared_ptr<AdvanceTable> shared_;
+    std::mutex mutex_;
+    std::unique_ptr<int32_t[]> pages_[256];
+    std::unordered_map<uint32_t, int32_t> supplementary_;
+    std::unordered_map<uint64_t, int32_t> kerning_;
+};
+
+// The advance tables of the most recently measured font setups.
+class AdvanceTableCache {
+public:
+    AdvanceTableCache();
+    std::shared_ptr<AdvanceTable> Find(FontInfo* font);
+    void Clear();
+
+private:
+    // Counted in tables rather than bytes, a table's pages fill in after it is stored.
+    static const size_t MaxTables = 64;
+    std::mutex mutex_;
+    TwoQueueCache<AdvanceKey, std::shared_ptr<AdvanceTable>, AdvanceKeyHash> tables_;
+};
+
+AdvanceTableCache& GetAdvanceTableCache();
+
+// Width of `count` characters through the advance table, the same advance PositionText gives them.
+TextMetrics MeasureChars(FontInfo* font, const uint32_t* chars, size_t count, bool kerning);
+
+// Drop the cached runs and words of a font about to be destroyed, or of all fonts when faces change.
+void RemoveTextCaches(const FontInfo* font);
+void ClearTextCaches();
+
+}  // namespace Font
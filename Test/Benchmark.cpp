@@ -0,0 +1,146 @@
+﻿#include "Benchmark.h"
+#include <algorithm>
+#include <chrono>
+#include <iomanip>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Paragraphs of a few to a few hundred words, enough text for every worker to get a share.
+static std::string MakeDocument(size_t paragraphs) {
+    static const char* const words[] = {"lorem", "ipsum", "dolor", "sit", "amet,", "consectetur", "adipiscing", "elit,", "sed", "do", "eiusmod", "tempor", "incididunt", "ut", "labore", "et", "dolore", "magna", "aliqua."};
+    std::string text;
+    uint32_t seed = 1;
+    for (size_t paragraph = 0; paragraph < paragraphs; ++paragraph) {
+        const size_t length = 5 + paragraph * 37 % 400;
+        for (size_t word = 0; word < length; ++word) {
+            seed = seed * 1103515245u + 12345u;
+            text += words[(seed >> 16) % (sizeof(words) / sizeof(words[0]))];
+            text += word + 1 < length ? ' ' : '\n';
+        }
+    }
+    return text;
+}
+
+void RunLayoutBenchmark(Font::FontInfo* font, uint32_t maxThreads, uint32_t rounds) {
+    const std::string text = MakeDocument(1000);
+    const int32_t width = 40 * font->size * 64;
+    if (maxThreads == 0) {
+        maxThreads = std::max(1u, std::thread::hardware_concurrency());
+    }
+    rounds = std::max(1u, rounds);
+    // Fill the shared advance table first, so every thread count runs warm.
+    Font::DestroyDocumentLayout(Font::LayoutDocument(font, text.c_str(), width, 1));
+    std::cout << "LayoutDocument, " << text.size() / 1024 << " KB of text, best of " << rounds << " runs" << std::endl;
+    double singleMs = 0;
+    for (uint32_t threads = 1; threads <= maxThreads; ++threads) {
+        double bestMs = 0;
+        Font::DocumentStats stats;
+        for (uint32_t round = 0; round < rounds; ++round) {
+            const auto start = std::chrono::steady_clock::now();
+            Font::DocumentLayout* document = Font::LayoutDocument(font, text.c_str(), width, threads);
+            const double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+            if (round == 0 || ms < bestMs) {
+                bestMs = ms;
+                stats = Font::GetDocumentStats(document);
+            }
+            Font::DestroyDocumentLayout(document);
+        }
+        if (threads == 1) {
+            singleMs = bestMs;
+        }
+        std::cout << std::setw(3) << threads << " threads: " << std::fixed << std::setprecision(2) << bestMs << " ms, " << text.size() / bestMs / 1000.0 << " MB/s, " << stats.glyphs / bestMs / 1000.0
+                  << " Mglyphs/s, x" << singleMs / bestMs << " (layout " << stats.layout_ms << " ms, stitch " << stats.stitch_ms << " ms, " << stats.steals << " steals)" << std::endl;
+    }
+}
+
+void RunWordCacheBenchmark(Font::FontInfo* font, const std::string& corpus, uint32_t rounds) {
+    std::vector<std::string> lines;
+    std::istringstream stream(corpus);
+    for (std::string line; std::getline(stream, line);) {
+        if (!line.empty() && line.back() == '\r') {
+            line.pop_back();
+        }
+        if (!line.empty()) {
+            lines.push_back(line);
+        }
+    }
+    rounds = std::max(1u, rounds);
+    // Alpha8 keeps the drawing cheap next to the layout. Runs are not cached, so every pass lays out each line.
+    Font::TextRunOptions options;
+    options.format = Font::GlyphPixelFormat::Alpha8;
+    Font::SetTextRunCacheBudget(0);
+    auto drawLines = [&]() {
+        for (auto& line : lines) {
+            Font::GlyphBitmapInfo run = Font::RenderTextRun(font, line.c_str(), options);
+            Font::ReleaseGlyph(run);
+        }
+    };
+    // Fill the glyph cache and the advance table first, so both budgets run warm.
+    drawLines();
+    std::cout << "RenderTextRun, " << lines.size() << " lines, " << corpus.size() / 1024 << " KB of text, best of " << rounds << " runs" << std::endl;
+    const size_t budgets[] = {size_t(1) << 20, 0};
+    for (size_t budget : budgets) {
+        // Start from an empty word cache, the first pass pays the misses.
+        Font::SetWordCacheBudget(0);
+        Font::SetWordCacheBudget(budget);
+        const Font::WordCacheStats before = Font::GetWordCacheStats();
+        double bestMs = 0;
+        for (uint32_t round = 0; round < rounds; ++round) {
+            const auto start = std::chrono::steady_clock::now();
+            drawLines();
+            const double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+            if (round == 0 || ms < bestMs) {
+                bestMs = ms;
+            }
+        }
+        const Font::WordCacheStats after = Font::GetWordCacheStats();
+        std::cout << "word cache " << std::setw(7) << budget / 1024 << " KB: " << std::fixed << std::setprecision(2) << bestMs << " ms, " << corpus.size() / bestMs / 1000.0 << " MB/s, " << lines.size() / bestMs << " klines/s ("
+                  << after.hits - before.hits << " hits, " << after.misses - before.misses << " misses, " << after.words << " words cached)" << std::endl;
+    }
+    Font::SetWordCacheBudget(size_t(1) << 20);
+}
+
+void RunAtlasCompressionBenchmark(Font::FontInfo* font, uint32_t rounds) {
+    const size_t pageBytes = size_t(1024) * 1024 * 4;
+    Font::GlyphAtlas* atlas = Font::CreateGlyphAtlas(1024, 1024, 1, Font::AtlasFormat::ChannelPacked);
+    // Stop growing while the next size still fits, a full page would evict the smaller glyphs again.
+    for (uint32_t size = 8; size <= 128 && Font::GetAtlasStats(atlas).used_bytes < pageBytes * 2 / 3; size += 4) {
+        Font::FontInfo* sized = Font::CreateFont(font->name, size);
+        for (uint32_t charCode = 33; charCode < 127; ++charCode) {
+            Font::AtlasGlyph glyph;
+            Font::GetAtlasGlyph(atlas, sized, charCode, 0.0f, &glyph);
+        }
+        Font::DestroyFont(sized);
+    }
+    Font::CollectAtlasUploads(atlas);
+    const Font::AtlasStats filled = Font::GetAtlasStats(atlas);
+    rounds = std::max(1u, rounds);
+    std::cout << "CollectAtlasUploads, 1024x1024 channel packed page, " << filled.glyphs << " glyphs, " << filled.used_bytes * 100 / pageBytes << "% used, best of " << rounds << " runs" << std::endl;
+    const Font::AtlasCompression compressions[] = {Font::AtlasCompression::BC4, Font::AtlasCompression::BC5};
+    const char* const names[] = {"BC4", "BC5"};
+    for (size_t i = 0; i < 2; ++i) {
+        double bestMs = 0;
+        uint64_t blocks = 0;
+        double error = 0;
+        for (uint32_t round = 0; round < rounds; ++round) {
+            // Setting the compression hands out the whole page again.
+            Font::SetAtlasCompression(atlas, compressions[i]);
+            const Font::AtlasStats before = Font::GetAtlasStats(atlas);
+            Font::CollectAtlasUploads(atlas);
+            const Font::AtlasStats after = Font::GetAtlasStats(atlas);
+            const double ms = after.encode_ms - before.encode_ms;
+            if (round == 0 || ms < bestMs) {
+                bestMs = ms;
+            }
+            blocks = after.encoded_blocks - before.encoded_blocks;
+            // encode_error is a running mean, take this encode's share of the summed error.
+            error = (after.encode_error * after.encoded_blocks - before.encode_error * before.encoded_blocks) / (blocks * 16.0);
+        }
+        // Every BC4 block encodes 16 bytes of one channel plane.
+        std::cout << names[i] << ": " << std::fixed << std::setprecision(2) << bestMs << " ms, " << blocks * 16 / bestMs / 1000.0 << " MB/s, " << blocks / bestMs / 1000.0 << " Mblocks/s, MSE " << std::setprecision(3) << error << std::endl;
+    }
+    Font::DestroyGlyphAtlas(atlas);
+}
@@ -0,0 +1,16 @@
+﻿#pragma once
+#include "font.h"
+#include <stdint.h>
+#include <string>
+
+// Lay out a generated document with LayoutDocument on 1 to `maxThreads` threads (0 for the
+// hardware threads) and print the best of `rounds` runs per thread count.
+void RunLayoutBenchmark(Font::FontInfo* font, uint32_t maxThreads, uint32_t rounds);
+
+// Draw every line of `corpus` with RenderTextRun, once with the default word cache budget and once with
+// the word cache off, and print the best of `rounds` passes and the word cache hits and misses of each.
+void RunWordCacheBenchmark(Font::FontInfo* font, const std::string& corpus, uint32_t rounds);
+
+// Fill a channel packed atlas with the printable ASCII glyphs of `font`'s family at growing sizes, then
+// encode all of it through CollectAtlasUploads as BC4 and as BC5 and print the best of `rounds` encodes.
+void RunAtlasCompressionBenchmark(Font::FontInfo* font, uint32_t rounds);
@@ -1,7 +1,10 @@
 ﻿#include "font.h"
+#include "Benchmark.h"
 #include "GLContext.h"
 #include "GL/glew.h"
+#include <fstream>
 #include <iostream>
+#include <iterator>
 #include <string>
 #include <clocale>
 
@@ -11,6 +14,33 @@ extern "C" const size_t PacificoTTF_len;
 int main(int argc, char* argv[]) {
     auto fonts = Font::GetSystemFonts();
     std::string fontName = Font::LoadTTFFont((void*)PacificoTTF, static_cast<uint32_t>(PacificoTTF_len)).data();
+    // WinFont --bench-layout [threads]: time LayoutDocument on 1 to `threads` threads instead of opening the window.
+    if (argc > 1 && std::string(argv[1]) == "--bench-layout") {
+        auto benchFont = Font::CreateFont(fontName.c_str(), 16);
+        RunLayoutBenchmark(benchFont, argc > 2 ? static_cast<uint32_t>(std::stoul(argv[2])) : 0, 5);
+        Font::DestroyFont(benchFont);
+        return 0;
+    }
+    // WinFont --bench-words <text file>: time RenderTextRun over the file's lines with and without the word cache.
+    if (argc > 2 && std::string(argv[1]) == "--bench-words") {
+        std::ifstream corpusFile(argv[2], std::ios::binary);
+        if (!corpusFile) {
+            std::cerr << "Cannot read " << argv[2] << std::endl;
+            return 1;
+        }
+        const std::string corpus((std::istreambuf_iterator<char>(corpusFile)), std::istreambuf_iterator<char>());
+        auto benchFont = Font::CreateFont(fontName.c_str(), 16);
+        RunWordCacheBenchmark(benchFont, corpus, 5);
+        Font::DestroyFont(benchFont);
+        return 0;
+    }
+    // WinFont --bench-atlas: time BC4 and BC5 encoding of a full channel packed atlas page.
+    if (argc > 1 && std::string(argv[1]) == "--bench-atlas") {
+        auto benchFont = Font::CreateFont(fontName.c_str(), 16);
+        RunAtlasCompressionBenchmark(benchFont, 5);
+        Font::DestroyFont(benchFont);
+        return 0;
+    }
     auto font = Font::CreateFont(fontName.c_str(), 512);
     auto glyphs = Font::GetGlyphBitmapInfo(font, 0x27296);  // 40481 25105 32 65
 
@@ -21,6 +51,7 @@ int main(int argc, char* argv[]) {
         texHeight = glyphs[0].height;
         frame = new unsigned char[texWidth * texHeight * 4];
         memcpy(frame, glyphs[0].data, texWidth * texHeight * 4);
+        Font::ReleaseGlyph(glyphs[0]);
     } else {
         texWidth = 32;
         texHeight = 32;